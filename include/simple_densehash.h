@@ -0,0 +1,90 @@
+/* vim: noet ts=4 sw=4
+*/
+#pragma once
+#include <inttypes.h>
+#include "simple_sparsehash.h"
+
+/* The dense side of the family. Where a sparse_dict packs its buckets into
+ * groups and has to popcount its way to one, a dense_dict is one flat,
+ * cache-line-aligned array with a slot for every bucket, empty or not. Gets
+ * go straight to the slot the hash says, and each slot is a cache line of its
+ * own, so a lookup that finds its key first time touches exactly one line.
+ * The price is memory: every empty slot costs as much as a full one.
+ */
+
+/* The default size of the table. */
+#define DENSE_STARTING_SIZE 32
+
+/* The defaults for when a dense_dict grows and shrinks, as percentages of the
+ * table that's occupied. Dense tables are cheap to leave empty space in,
+ * relatively speaking, and probing is what they're trying to avoid, so they
+ * grow a lot earlier than sparse ones.
+ */
+#define DENSE_RESIZE_PERCENT 50
+#define DENSE_SHRINK_PERCENT 20
+
+/* Keys and values whose combined length is at most this many bytes are kept
+ * in the bucket, which is then exactly 64 bytes.
+ */
+#define DENSE_INLINE_SIZE 48
+
+/* The stored hash of an empty slot and of a deleted one. Real hashes that
+ * happen to come out as one of these get nudged out of the way.
+ */
+#define DENSE_HASH_EMPTY 0
+#define DENSE_HASH_TOMBSTONE 1
+
+struct dense_bucket {
+	uint64_t		hash;			/* The key's hash, or DENSE_HASH_EMPTY/TOMBSTONE. */
+	uint32_t		klen;
+	uint32_t		vlen;
+	union {
+		unsigned char	bytes[DENSE_INLINE_SIZE];	/* The value followed by the key, if they fit. */
+		unsigned char	*heap;						/* Otherwise the same layout, somewhere on the heap. */
+	} data;
+};
+
+struct dense_dict {
+	sparse_hash_fn hash_fn;				/* The function we hash keys with. */
+	uint64_t seed;						/* Random, per-dictionary seed handed to hash_fn. */
+	size_t bucket_max;					/* How many slots `buckets` has. Always a power of two. */
+	size_t bucket_count;				/* How many of them hold something. */
+	size_t tombstone_count;				/* How many of them used to. */
+	unsigned int resize_percent;		/* Grow once this much of the table is used. */
+	unsigned int shrink_percent;		/* Shrink once less than this is. 0 never shrinks. */
+	struct dense_bucket *buckets;		/* bucket_max of them, CACHE_LINE_SIZE aligned. */
+};
+
+struct dense_dict_iter {
+	struct dense_dict	*dict;
+	size_t				slot;			/* The next slot to look at. */
+};
+
+/* ---------------- */
+/* Dense Dictionary */
+/* ---------------- */
+
+/* These all work like their sparse_dict_* namesakes. */
+struct dense_dict *dense_dict_init();
+struct dense_dict *dense_dict_init_with_hash(const sparse_hash_fn hash_fn);
+
+/* Changes when `dict` grows and shrinks. `resize_percent` has to be between 1
+ * and 99, and `shrink_percent` less than half of it so that a table that's
+ * just shrunk isn't about to grow again. Takes effect from the next change.
+ */
+const int dense_dict_set_resize_policy(struct dense_dict *dict, const unsigned int resize_percent,
+									   const unsigned int shrink_percent);
+
+const int dense_dict_set(struct dense_dict *dict,
+						 const char *key, const size_t klen,
+						 const void *value, const size_t vlen);
+const void *dense_dict_get(struct dense_dict *dict, const char *key,
+						   const size_t klen, size_t *outsize);
+const int dense_dict_delete(struct dense_dict *dict, const char *key, const size_t klen);
+
+void dense_dict_iter_init(struct dense_dict_iter *iter, struct dense_dict *dict);
+const int dense_dict_iter_next(struct dense_dict_iter *iter,
+							   const char **key, size_t *klen,
+							   const void **value, size_t *vlen);
+
+const int dense_dict_free(struct dense_dict *dict);
@@ -3,9 +3,12 @@
 #pragma once
 #include <inttypes.h>
 #include <stdio.h>
+#include <pthread.h>
 
-/* The maximum size of each sparse_array_group. */
-#define GROUP_SIZE 48
+/* The maximum size of each sparse_array_group. Keep this a multiple of 64 so
+ * the bitmap is made of whole words.
+ */
+#define GROUP_SIZE 64
 
 /* The default size of the hash table. Used to init bucket_max. */
 #define STARTING_SIZE 32
@@ -13,54 +16,439 @@
 /* The default 'should we resize' percentage, out of 100 percent. */
 #define RESIZE_PERCENT 80
 
+/* The highest one sparse_dict_probing will go along with. */
+#define SPARSE_MAX_RESIZE_PERCENT 95
+
+/* The default 'should we shrink' percentage. When deletions bring a
+ * dictionary's occupancy below this, the table gets smaller.
+ */
+#define SHRINK_PERCENT 20
+
+/* How a dictionary picks which slots to try for a key. See sparse_dict_probing.
+ * QUADRATIC jumps further each time, LINEAR tries the next slot along, which
+ * keeps most probes in the same group, and ROBIN_HOOD is LINEAR where keys far
+ * from home get to move in ahead of ones that are close to it.
+ */
+#define SPARSE_PROBE_QUADRATIC		0
+#define SPARSE_PROBE_LINEAR			1
+#define SPARSE_PROBE_ROBIN_HOOD		2
+
+/* When a dictionary is rehashing incrementally, this is how many groups of
+ * the old table each call to sparse_dict_set moves over to the new one.
+ */
+#define REHASH_GROUPS_PER_SET 4
+
+/* How many keys sparse_dict_get_many and sparse_dict_set_many work on at a
+ * time. Big enough to keep plenty of cache misses in flight.
+ */
+#define BATCH_SIZE 32
+
+/* How many probe lengths sparse_dict_stats keeps apart. The last one counts
+ * everything that long or longer.
+ */
+#define SPARSE_PROBE_HISTOGRAM_SIZE 16
+
+/* Tables with fewer items than this always get rehashed on one thread, even
+ * if the dictionary has parallel rehashing turned on. Starting threads isn't
+ * worth it for them.
+ */
+#define PARALLEL_REHASH_MIN 65536
+
+/* How many ranges of the new table each thread of a parallel rehash gets.
+ * More than one evens things out if some ranges turn out busier.
+ */
+#define PARTITIONS_PER_WORKER 4
+
+/* What we assume a cache line is. Used to keep things that different threads
+ * write to from sharing one.
+ */
+#define CACHE_LINE_SIZE 64
+
+/* How many threads can be registered to read a dictionary without locks at
+ * once. See sparse_dict_concurrent_readers.
+ */
+#define MAX_READERS 64
+
+/* How many pieces of memory a dictionary with lock-free readers lets pile up
+ * before it checks whether the readers are done with them.
+ */
+#define RETIRE_BATCH 64
+
+/* Bumped whenever the sparse_dict_save format changes. Images written with a
+ * different version won't open.
+ */
+#define SPARSE_IMAGE_VERSION 2
+
+/* Same thing, for sparse_dict_dump_stream. */
+#define SPARSE_STREAM_VERSION 1
+
+/* Flags for sparse_dict_open_mmap. */
+#define SPARSE_MMAP_COPY_ON_WRITE	0x01	/* Modifying the dictionary copies it into memory first. */
+#define SPARSE_MMAP_VERIFY			0x02	/* Check the whole image's checksum when opening it. */
+
+/* Keys and values whose combined length is at most this many bytes are
+ * stored directly inside their bucket, and therefore directly inside the
+ * sparse_array_group storage. Anything longer spills into a single heap
+ * allocation. This must be at least sizeof(void *).
+ */
+#define INLINE_SIZE 32
+
+/* The same thing for sparse_u64_dict, where only the value has to fit. */
+#define U64_INLINE_SIZE 16
+
 /* The math here is, I believe, so that we
  * store exactly enough bits for our group size. The math returns the
  * minimum number of bytes to hold all the bits we need.
  */
-#define BITCHUNK_SIZE (sizeof(uint32_t) * 8)
+#define BITCHUNK_SIZE (sizeof(uint64_t) * 8)
 #define BITMAP_SIZE (GROUP_SIZE-1)/BITCHUNK_SIZE + 1
 
 /* These are the objects that get stored in the sparse arrays that
  * make up a sparse dictionary.
  */
 struct sparse_bucket {
-	char			*key;
-	const size_t	klen;
-	void			*val;
-	const size_t	vlen;
-	const uint64_t	hash;
+	size_t			klen;
+	size_t			vlen;
+	uint64_t		hash;
+	union {
+		unsigned char	bytes[INLINE_SIZE];		/* The value followed by the key, if they fit. */
+		unsigned char	*heap;					/* Otherwise the same layout, somewhere on the heap. */
+	} data;
 };
 
+/* A group's header is kept small, since most of a sparse table is groups
+ * that are mostly empty. How many items it holds is however many bits are set
+ * in `bitmap`, and how big they are is the same for the whole array.
+ */
 struct sparse_array_group {
-	uint32_t		count;							/* The number of items currently in this vector. */
-	size_t			elem_size;						/* The maximum size of each element. */
 	void *			group;							/* The place where we actually store things. */
-	uint32_t		bitmap[BITMAP_SIZE];			/* This is how we store the state of what is occupied in group. */
+	uint64_t		bitmap[BITMAP_SIZE];			/* This is how we store the state of what is occupied in group. */
 	/* bitmap requires some explanation. We use the bitmap to store which
 	 * `offsets` in the array are occupied. We do this through a series
 	 * of bit-testing functions.
 	 */
+	uint32_t		seq;							/* Odd while a shared group is being swapped out. See sparse_epoch. */
+	uint16_t		capacity;						/* The number of items `group` has room for. */
 };
 
 struct sparse_array {
 	const size_t					maximum;		/* The maximum number of items that can be in this array. */
+	const size_t					elem_size;		/* The maximum size of each element. */
+	const size_t					stride;			/* How far apart elements are in a group: elem_size, plus their length unless the array is fixed-size. */
+	uint32_t						first_capacity;	/* How many items a group has room for when it's first used. */
+	uint32_t						max_probe;		/* The most probes it's taken the dictionary to place anything. */
+	int								probing;		/* Which SPARSE_PROBE_* the dictionary probes this with. */
 	struct sparse_array_group		*groups;		/* The number of groups we have. This is (num_buckets/GROUP_SIZE). */
+	uint8_t							*tags;			/* Optional byte of metadata per slot, GROUP_SIZE to a group. */
+	struct sparse_epoch				*epoch;			/* Non-NULL if lock-free readers can see this array. */
+};
+
+/* Lock-free readers.
+ * While a dictionary has readers that don't take locks, nothing they might be
+ * looking at is changed in place or freed straight away. Groups are rebuilt
+ * into fresh storage and swapped in, and whatever the writer replaces is
+ * `retired` instead of freed. Each reader has a slot of its own that says
+ * which epoch it started reading in. Once no reader is still in the epoch
+ * something was retired in, it gets freed for real.
+ */
+struct sparse_reader {
+	uint64_t			epoch;		/* The epoch this reader started in, 0 if it isn't reading. */
+	struct sparse_epoch	*owner;
+	uint32_t			in_use;		/* Whether somebody has registered this slot. */
+	unsigned char		pad[CACHE_LINE_SIZE - sizeof(uint64_t) - sizeof(struct sparse_epoch *) - sizeof(uint32_t)];
+};
+
+struct sparse_retired {
+	void		*ptr;
+	void		(*free_fn)(void *);
+	uint64_t	epoch;				/* The epoch it was retired in. */
+};
+
+struct sparse_epoch {
+	uint64_t				global;				/* Only ever advanced by the writer. */
+	struct sparse_reader	*readers;			/* MAX_READERS slots, CACHE_LINE_SIZE aligned. */
+	struct sparse_retired	*retired;			/* Things waiting for readers to move on. */
+	size_t					retired_count;
+	size_t					retired_capacity;
+};
+
+/* Snapshots.
+ * sparse_dict_save writes a dictionary out in a form that can be mapped
+ * straight back into memory and looked things up in, without loading it:
+ *
+ *   header | groups | tags | buckets | key/value arena | checksum
+ *
+ * Every section starts on a CACHE_LINE_SIZE boundary and everything that
+ * would be a pointer in memory is an offset instead. Integers are in the byte
+ * order of whoever wrote it; byte_order tells us if that isn't us.
+ */
+struct sparse_image_header {
+	char		magic[8];			/* SPARSE_IMAGE_MAGIC */
+	uint32_t	version;			/* SPARSE_IMAGE_VERSION */
+	uint32_t	group_size;			/* GROUP_SIZE, INLINE_SIZE and the size of a bucket */
+	uint32_t	inline_size;		/* when it was written. They all have to match ours. */
+	uint32_t	bucket_size;
+	uint32_t	probing;			/* SPARSE_PROBE_*, */
+	uint32_t	max_probe;			/* and the most probes anything takes to find. */
+	uint64_t	byte_order;			/* SPARSE_IMAGE_BYTE_ORDER, as written. */
+	uint64_t	hash_id;			/* Which built-in hash function the keys were hashed with. */
+	uint64_t	seed;
+	uint64_t	bucket_max;
+	uint64_t	bucket_count;
+	uint64_t	tombstone_count;
+	uint64_t	groups_offset;		/* Offsets from the start of the image. */
+	uint64_t	tags_offset;
+	uint64_t	storage_offset;
+	uint64_t	arena_offset;
+	uint64_t	arena_len;
+	uint64_t	image_len;			/* The whole thing, checksum included. */
+	uint64_t	header_checksum;	/* Of this header, with this field zeroed. */
+};
+
+/* What a group looks like in an image. Buckets in images are all the same
+ * size, so unlike in memory they don't need their size in front of them.
+ */
+struct sparse_image_group {
+	uint64_t	storage_offset;		/* Where this group's buckets start, from the start of the buckets. */
+	uint64_t	bitmap[BITMAP_SIZE];
 };
 
+struct sparse_image_bucket {
+	uint64_t	klen;
+	uint64_t	vlen;
+	uint64_t	hash;
+	union {
+		unsigned char	bytes[INLINE_SIZE];	/* Same as sparse_bucket. */
+		uint64_t		offset;				/* Where it is in the arena, when it doesn't fit. */
+	} data;
+};
+
+/* A dictionary opened with sparse_dict_open_mmap. */
+struct sparse_mapping {
+	const unsigned char					*base;
+	size_t								len;
+	int									flags;
+	const struct sparse_image_header	*header;
+	const struct sparse_image_group		*groups;
+	const uint8_t						*tags;
+	const unsigned char					*storage;
+	size_t								storage_len;
+	const unsigned char					*arena;
+	size_t								arena_len;
+};
+
+/* Where all of the memory comes from. Anything a replacement returns has to
+ * be usable with the replacement's free_fn, and free_fn has to accept NULL
+ * the way free() does. aligned_fn works like posix_memalign: 0 on success.
+ */
+struct sparse_allocator {
+	void *(*malloc_fn)(size_t size);
+	void *(*realloc_fn)(void *ptr, size_t size);
+	void (*free_fn)(void *ptr);
+	int (*aligned_fn)(void **ptr, size_t alignment, size_t size);
+};
+
+/* Running totals for sparse_dict_stats. Rehashes are rare enough to always
+ * count. Counting every lookup costs something on every get and set, so
+ * that only happens when built with SPARSE_DICT_STATS defined.
+ */
+struct sparse_dict_counters {
+	uint64_t	rehashes;
+	uint64_t	rehash_ns;
+	uint64_t	lookups;
+	uint64_t	lookup_probes[SPARSE_PROBE_HISTOGRAM_SIZE];
+};
+
+/* What sparse_dict_stats fills in. Probe lengths count the slots skipped
+ * before getting to the right one, so 0 means a key is where it hashes to.
+ */
+struct sparse_dict_stats {
+	size_t		bucket_max;
+	size_t		bucket_count;
+	size_t		tombstone_count;
+	double		load_factor;		/* bucket_count / bucket_max. */
+
+	/* How far everything in the table is from where it hashes to right now.
+	 * Works out what a successful lookup of every key would cost.
+	 */
+	uint64_t	displacement[SPARSE_PROBE_HISTOGRAM_SIZE];
+	/* What sparse_dict_get and sparse_dict_set actually ran into. Always
+	 * zero without SPARSE_DICT_STATS.
+	 */
+	uint64_t	lookups;
+	uint64_t	lookup_probes[SPARSE_PROBE_HISTOGRAM_SIZE];
+
+	size_t		max_probe;			/* No lookup probes more than this many slots. */
+
+	uint64_t	rehashes;			/* How many times the table has been resized, */
+	uint64_t	rehash_ns;			/* and how long it took all together. */
+
+	size_t		group_fill[GROUP_SIZE + 1];	/* How many groups have 0, 1, ... GROUP_SIZE slots used. */
+
+	size_t		table_bytes;		/* Group headers and tags. */
+	size_t		storage_bytes;		/* Everything allocated for group storage, used or not. */
+	size_t		bucket_bytes;		/* The part of that that's buckets, tombstones included. */
+	size_t		blob_bytes;			/* Keys and values that didn't fit in their bucket. */
+};
+
+/* Hash functions take the key and a per-dictionary seed. */
+typedef uint64_t (*sparse_hash_fn)(const char *key, const size_t klen, const uint64_t seed);
+
+/* What sparse_dict_upsert hands the value it found or just put in to.
+ * `inserted` is 1 if it's new, in which case it's all zeroes.
+ */
+typedef void (*sparse_upsert_fn)(void *value, const size_t vlen, const int inserted, void *ctx);
+
 struct sparse_dict {
+	sparse_hash_fn hash_fn;				/* The function we hash keys with. */
+	uint64_t seed;						/* Random, per-dictionary seed handed to hash_fn. */
 	size_t bucket_max;					/* The current maximum number of buckets in this dictionary. */
 	size_t bucket_count;				/* The number of occupied buckets in this dictionary. */
+	size_t tombstone_count;				/* The number of deleted buckets still taking up slots in `buckets`. */
+	unsigned int shrink_percent;		/* The low-water mark for occupancy. Defaults to SHRINK_PERCENT, 0 never shrinks. */
+	unsigned int resize_percent;		/* The high-water mark. Defaults to RESIZE_PERCENT. */
+	int probing;						/* SPARSE_PROBE_*. Defaults to SPARSE_PROBE_QUADRATIC. */
 	struct sparse_array *buckets;		/* Array of `sparse_array` objects. Defaults to STARTING_SIZE elements in length. */
+	int incremental;					/* Whether we grow the table a few groups at a time instead of all at once. */
+	struct sparse_array *old_buckets;	/* The table we're migrating out of, or NULL if we aren't. */
+	size_t old_bucket_max;				/* The maximum number of buckets in old_buckets. */
+	size_t migrate_group;				/* The next group of old_buckets that needs to be moved. */
+	struct sparse_epoch *epoch;			/* Non-NULL while lock-free readers are allowed. */
+	unsigned int rehash_threads;		/* How many threads resizing a big table uses. 0 or 1 is just us. */
+	struct sparse_mapping *mapping;		/* Non-NULL if we're reading straight out of a saved image. */
+	struct sparse_cache *cache;			/* The cache this is the table of, if it is one. */
+	struct sparse_dict_counters counters;
+};
+
+/* Iterators walk groups in memory order and keep track of where they are in
+ * the group's storage, so getting the next item never has to popcount. They
+ * live on the stack; modifying what they're iterating over while they're in
+ * use is undefined.
+ */
+struct sparse_array_iter {
+	struct sparse_array		*arr;
+	size_t					group;		/* The group we're in. */
+	uint32_t				word;		/* Which word of that group's bitmap we're in. */
+	uint32_t				offset;		/* The offset of the next item in the group's storage. */
+	uint64_t				bits;		/* The bits of the current word we haven't visited yet. */
+};
+
+struct sparse_dict_iter {
+	struct sparse_dict			*dict;
+	int							in_old_buckets;	/* Whether we're onto the unmigrated part of the old table. */
+	struct sparse_array_iter	buckets_iter;
+};
+
+/* Each shard of a sparse_sharded_dict is a whole dictionary with its own lock.
+ * They're padded out to a cache line so that threads working on neighbouring
+ * shards don't fight over the line the locks live in.
+ */
+struct sparse_shard {
+	pthread_mutex_t		lock;
+	struct sparse_dict	*dict;
+	unsigned char		pad[CACHE_LINE_SIZE -
+							(sizeof(pthread_mutex_t) + sizeof(struct sparse_dict *)) % CACHE_LINE_SIZE];
+};
+
+struct sparse_sharded_dict {
+	sparse_hash_fn hash_fn;				/* Shared by every shard, so a key only gets hashed once. */
+	uint64_t seed;						/* Likewise. */
+	size_t shard_count;					/* Always a power of two. */
+	struct sparse_shard *shards;		/* shard_count shards, CACHE_LINE_SIZE aligned. */
+};
+
+struct sparse_cache {
+	struct sparse_dict *dict;			/* Where everything actually lives. */
+	size_t max_bytes;					/* The budget. */
+	size_t blob_bytes;					/* Keys and values that didn't fit in their bucket. */
+	size_t hand;						/* The slot the clock hand is pointing at. */
+	uint64_t *recent;					/* Which slots have been used lately, BITMAP_SIZE words per group. */
+	uint64_t *old_recent;				/* The same for the table being migrated out of, while there is one. */
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+};
+
+/* A sparse_u64_dict's bucket. The key is the key, so there's nothing to
+ * compare but one integer, and the hash is cheap enough to work out again
+ * whenever the table gets rehashed.
+ */
+struct sparse_u64_bucket {
+	uint64_t		key;
+	size_t			vlen;
+	union {
+		unsigned char	bytes[U64_INLINE_SIZE];	/* The value, if it fits. */
+		unsigned char	*heap;					/* Otherwise where it is. */
+	} data;
+};
+
+struct sparse_u64_dict {
+	uint64_t seed;						/* Random, per-dictionary seed handed to sparse_hash_u64. */
+	size_t bucket_max;					/* Same as in sparse_dict. */
+	size_t bucket_count;
+	size_t tombstone_count;
+	struct sparse_array *buckets;		/* Full of sparse_u64_buckets. */
+};
+
+struct sparse_u64_dict_iter {
+	struct sparse_array_iter	buckets_iter;
 };
 
+/* ------- */
+/* Hashing */
+/* ------- */
+
+/* The default. Fast, reads keys 8 bytes at a time, after wyhash. */
+uint64_t sparse_hash_wy(const char *key, const size_t klen, const uint64_t seed);
+/* FNV-1a, one byte at a time. */
+uint64_t sparse_hash_fnv1a(const char *key, const size_t klen, const uint64_t seed);
+/* What sparse_u64_dict hashes its keys with. Just a few multiplies and shifts. */
+uint64_t sparse_hash_u64(const uint64_t key, const uint64_t seed);
+/* A new random seed, the same as every dictionary gets for itself. */
+uint64_t sparse_random_seed(void);
+
+/* ------ */
+/* Memory */
+/* ------ */
+
+/* Replaces the allocator everything in here uses, or puts the default back
+ * if `allocator` is NULL. Only do this while nothing allocated by the old one
+ * is still around, because it's the new one that gets asked to free it.
+ */
+void sparse_set_allocator(const struct sparse_allocator *allocator);
+/* The allocator in use right now, for anything built on top of this that
+ * wants to allocate the same way.
+ */
+const struct sparse_allocator *sparse_get_allocator(void);
+
 /* ------------ */
 /* Sparse Array */
 /* ------------ */
 
 struct sparse_array *sparse_array_init(const size_t element_size, const uint32_t maximum);
+/* An array where everything is exactly `element_size` bytes, so nothing's
+ * length has to be stored. Setting anything else fails, and gets always say
+ * `element_size`.
+ */
+struct sparse_array *sparse_array_init_fixed(const size_t element_size, const uint32_t maximum);
 const int sparse_array_set(struct sparse_array *arr, const uint32_t i,
 						   const void *val, const size_t vlen);
 const void *sparse_array_get(struct sparse_array *arr, const uint32_t i, size_t *outsize);
+/* Iterates over every item in `arr`, in index order. sparse_array_iter_next
+ * returns 0 when there's nothing left, otherwise fills in whichever of `i`,
+ * `val` and `vlen` are non-null.
+ */
+void sparse_array_iter_init(struct sparse_array_iter *iter, struct sparse_array *arr);
+const int sparse_array_iter_next(struct sparse_array_iter *iter, uint32_t *i,
+								 const void **val, size_t *vlen);
+
+/* Tells `arr` roughly what percentage of each group is expected to be
+ * occupied, so that groups are allocated at about that size the first time
+ * they're used instead of growing into it.
+ */
+void sparse_array_hint_density(struct sparse_array *arr, const unsigned int percent);
+/* Removes the element at `i`, if there is one. Returns 0 if there wasn't. */
+const int sparse_array_erase(struct sparse_array *arr, const uint32_t i);
 const int sparse_array_free(struct sparse_array *arr);
 
 
@@ -71,16 +459,321 @@ const int sparse_array_free(struct sparse_array *arr);
 /* Creates a new sparse dictionary. */
 struct sparse_dict *sparse_dict_init();
 
-/* Copies `value` into `dict`. */
+/* Creates a new sparse dictionary that hashes keys with `hash_fn`, or the
+ * default if it's NULL. Either way the dictionary gets a random seed, so the
+ * same key hashes differently in different dictionaries.
+ */
+struct sparse_dict *sparse_dict_init_with_hash(const sparse_hash_fn hash_fn);
+
+/* Creates a new sparse dictionary big enough to hold `capacity` items without
+ * having to grow.
+ */
+struct sparse_dict *sparse_dict_init_with_capacity(const size_t capacity);
+
+/* Grows `dict` so it can hold `capacity` items without growing again. Never
+ * shrinks it.
+ */
+const int sparse_dict_reserve(struct sparse_dict *dict, const size_t capacity);
+
+/* Copies `count` keys and values into `dict` in one go. The table is sized
+ * once and filled in group order, which is a lot quicker than calling
+ * sparse_dict_set `count` times. Later duplicates win, like they would with
+ * sparse_dict_set.
+ */
+const int sparse_dict_bulk_load(struct sparse_dict *dict,
+								const char **keys, const size_t *klens,
+								const void **values, const size_t *vlens,
+								const size_t count);
+
+/* Copies `value` into `dict`. Replacing a value with one the same size
+ * writes over it where it is, without allocating anything.
+ */
 const int sparse_dict_set(struct sparse_dict *dict,
 						  const char *key, const size_t klen,
 						  const void *value, const size_t vlen);
 
+/* Counters and the like, without a get and a set that both hash and probe.
+ * Finds `key`, putting it in with `vlen` zeroed bytes if it isn't there, and
+ * calls `callback` with its value, which can be changed in place but not
+ * resized.
+ * Doesn't work on dictionaries with concurrent readers, which would see the
+ * value halfway through being changed.
+ */
+const int sparse_dict_upsert(struct sparse_dict *dict, const char *key, const size_t klen,
+							 const size_t vlen, sparse_upsert_fn callback, void *ctx);
+
+/* The same thing without the callback: returns `key`'s value, putting it in
+ * with a copy of `value` first if it isn't there. The value can be changed in
+ * place until the next time `dict` is modified. *outsize is filled out if
+ * it's non-null. NULL if it didn't work.
+ */
+void *sparse_dict_get_or_insert(struct sparse_dict *dict, const char *key, const size_t klen,
+								const void *value, const size_t vlen, size_t *outsize);
+
 /* Returns the value of `key` from `dict`. *outsize will be filled out if it
  * is non-null.
+ * Short values live inside the table itself, so the returned pointer is only
+ * good until the next time `dict` is modified.
  */
 const void *sparse_dict_get(struct sparse_dict *dict, const char *key,
 							const size_t klen, size_t *outsize);
 
+/* Looks up `count` keys at once, which is a good deal faster than calling
+ * sparse_dict_get in a loop when the table doesn't fit in cache. values[i] is
+ * set to what sparse_dict_get would have returned for keys[i], and
+ * outsizes[i] to its size if `outsizes` is non-null. Returns how many were
+ * found.
+ */
+const size_t sparse_dict_get_many(struct sparse_dict *dict, const size_t count,
+								  const char **keys, const size_t *klens,
+								  const void **values, size_t *outsizes);
+
+/* sparse_dict_set for `count` keys and values at once. Stops and returns 0 at
+ * the first one that fails.
+ */
+const int sparse_dict_set_many(struct sparse_dict *dict, const size_t count,
+							   const char **keys, const size_t *klens,
+							   const void **values, const size_t *vlens);
+
+/* Removes `key` from `dict`. Returns 0 if it wasn't there. */
+const int sparse_dict_delete(struct sparse_dict *dict, const char *key,
+							 const size_t klen);
+
+/* The same as the calls above, for callers that already have each key's
+ * hash and don't want it worked out twice. The hash has to be exactly
+ * dict->hash_fn(key, klen, dict->seed), or the key ends up somewhere it'll
+ * never be found again. If yours comes from somewhere else, like a routing
+ * hash, make the dictionary with sparse_dict_init_with_hash and a hash_fn
+ * that gives the same answer and ignores the seed.
+ * Building with SPARSE_CHECK_HASHES defined rehashes every key and aborts
+ * when the two don't agree.
+ */
+const int sparse_dict_set_hashed(struct sparse_dict *dict,
+								 const char *key, const size_t klen,
+								 const void *value, const size_t vlen,
+								 const uint64_t key_hash);
+const void *sparse_dict_get_hashed(struct sparse_dict *dict, const char *key,
+								   const size_t klen, size_t *outsize,
+								   const uint64_t key_hash);
+const int sparse_dict_delete_hashed(struct sparse_dict *dict, const char *key,
+									const size_t klen, const uint64_t key_hash);
+const size_t sparse_dict_get_many_hashed(struct sparse_dict *dict, const size_t count,
+										 const char **keys, const size_t *klens, const uint64_t *key_hashes,
+										 const void **values, size_t *outsizes);
+const int sparse_dict_set_many_hashed(struct sparse_dict *dict, const size_t count,
+									  const char **keys, const size_t *klens, const uint64_t *key_hashes,
+									  const void **values, const size_t *vlens);
+
+/* Iterates over every key and value in `dict`, in no particular order. The
+ * pointers point into the dictionary, same as sparse_dict_get.
+ * sparse_dict_iter_next returns 0 when there's nothing left.
+ */
+void sparse_dict_iter_init(struct sparse_dict_iter *iter, struct sparse_dict *dict);
+const int sparse_dict_iter_next(struct sparse_dict_iter *iter,
+								const char **key, size_t *klen,
+								const void **value, size_t *vlen);
+
+/* Turns incremental rehashing on or off for `dict`. When it's on, growing the
+ * table doesn't move everything at once: the old and new tables live side by
+ * side and every sparse_dict_set moves REHASH_GROUPS_PER_SET groups over.
+ * Turning it off finishes any migration that's in progress. It can't be turned
+ * on while `dict` has concurrent readers.
+ */
+const int sparse_dict_incremental_rehash(struct sparse_dict *dict, const int enabled);
+
+/* Switches `dict` to probing with `probing`, one of SPARSE_PROBE_*, and growing
+ * once `resize_percent` of it is full, or RESIZE_PERCENT if that's 0. That
+ * has to be between 10 and SPARSE_MAX_RESIZE_PERCENT. The table gets rebuilt
+ * to match. Linear and Robin Hood probing stay in the same group far longer
+ * than quadratic does, and Robin Hood keeps every key close to where it
+ * hashes to, so it copes with fuller tables than either.
+ * Robin Hood moves keys around when others are inserted and deleted, so
+ * dictionaries using it can't have concurrent readers, and vice versa.
+ */
+const int sparse_dict_probing(struct sparse_dict *dict, const int probing,
+							  const unsigned int resize_percent);
+
+/* Has `dict` use `threads` threads, counting the calling one, to move
+ * everything over when a table with at least PARALLEL_REHASH_MIN items is
+ * resized. 0 or 1 turns it back off. Only applies when resizes happen all at
+ * once, not when rehashing incrementally, and not to Robin Hood tables.
+ */
+const int sparse_dict_parallel_rehash(struct sparse_dict *dict, const unsigned int threads);
+
+/* Lets threads call sparse_dict_get and sparse_dict_get_many on `dict` without
+ * any locking while one other thread modifies it. Readers never wait and never
+ * write to anything shared; in exchange every modification copies the group
+ * it touches, so writes get slower. Meant for dictionaries that are read far
+ * more than they're written.
+ * The writer has to be the only thread calling anything else on `dict`,
+ * iterators included. Each reader registers once with
+ * sparse_dict_reader_register, and wraps every lookup, and everything it does
+ * with the pointers it got back, in sparse_dict_read_begin/end.
+ * Turning it off fails if any readers are still registered. Returns 0 if it
+ * can't be done on this platform, or `dict` uses SPARSE_PROBE_ROBIN_HOOD.
+ */
+const int sparse_dict_concurrent_readers(struct sparse_dict *dict, const int enabled);
+
+/* Claims a reader slot on `dict`. Returns NULL if all MAX_READERS are taken.
+ * Slots belong to one thread at a time.
+ */
+struct sparse_reader *sparse_dict_reader_register(struct sparse_dict *dict);
+void sparse_dict_reader_unregister(struct sparse_reader *reader);
+
+/* Pointers returned by sparse_dict_get stay good until sparse_dict_read_end,
+ * however much the writer changes in the meantime. Don't stay in for long:
+ * nothing retired after sparse_dict_read_begin can be freed until you leave.
+ */
+void sparse_dict_read_begin(struct sparse_reader *reader);
+void sparse_dict_read_end(struct sparse_reader *reader);
+
+/* Writes `dict` to `fd` as an image sparse_dict_open_mmap can open. The
+ * dictionary has to be using one of the built-in hash functions, since we
+ * can't write a function pointer out. Finishes any incremental rehash that's
+ * in progress first. Returns 0 if anything goes wrong, in which case whatever
+ * made it into `fd` is garbage.
+ */
+const int sparse_dict_save(struct sparse_dict *dict, const int fd);
+
+/* Maps an image written by sparse_dict_save and serves lookups straight out
+ * of it. Nothing is read until it's needed, so opening is quick however big
+ * the image is, and pages nobody asks for are never read at all.
+ * Without SPARSE_MMAP_COPY_ON_WRITE the dictionary is read-only: anything
+ * that would change it fails. With it, the first change copies everything
+ * into memory and carries on as a normal dictionary.
+ * The header is always checked. The rest of the image is only checksummed
+ * with SPARSE_MMAP_VERIFY, which means reading all of it.
+ */
+struct sparse_dict *sparse_dict_open_mmap(const char *path, const int flags);
+
+/* Writes every key and value in `dict` to `out`, a group at a time, as a
+ * stream of length-prefixed records behind a header with the count in it.
+ * Unlike sparse_dict_save this works on any FILE*, pipes included, and uses
+ * nothing but stdio's buffer to do it. Integers are little-endian whatever
+ * we're running on, and the hash function doesn't matter: everything gets
+ * rehashed on the way back in.
+ */
+const int sparse_dict_dump_stream(struct sparse_dict *dict, FILE *out);
+
+/* Reads a stream written by sparse_dict_dump_stream into `dict`, which is
+ * grown up front to fit the whole thing. Keys that are already there get
+ * overwritten. On failure whatever was read before the problem stays in.
+ */
+const int sparse_dict_load_stream(struct sparse_dict *dict, FILE *in);
+
+/* Fills in `out` with what `dict` looks like right now. This walks the whole
+ * table, so it's meant for polling every so often, not every operation. The
+ * same threads that can call sparse_dict_set can call it. Images opened with
+ * sparse_dict_open_mmap don't get displacements worked out.
+ */
+const int sparse_dict_stats(struct sparse_dict *dict, struct sparse_dict_stats *out);
+
 /* Frees and cleans up a sparse_dict created with sparse_dict_init(). */
 const int sparse_dict_free(struct sparse_dict *dict);
+
+/* ------------------------- */
+/* Sharded Sparse Dictionary */
+/* ------------------------- */
+
+/* A sparse_sharded_dict is safe to use from several threads at once. Keys are
+ * split between `shard_count` independent dictionaries by their hash, and each
+ * one has its own lock, so threads only wait on each other when they land in
+ * the same shard. Shards grow and shrink on their own.
+ * `shard_count` gets rounded up to a power of two. Something like a few times
+ * the number of threads you have is about right.
+ */
+struct sparse_sharded_dict *sparse_sharded_dict_init(const size_t shard_count);
+
+/* Copies `value` into `dict`. */
+const int sparse_sharded_dict_set(struct sparse_sharded_dict *dict,
+								  const char *key, const size_t klen,
+								  const void *value, const size_t vlen);
+
+/* Copies the value of `key` into `value`, which has room for `vlen` bytes.
+ * Unlike sparse_dict_get we can't hand out a pointer into the table, because
+ * another thread could change it the moment we let go of the lock.
+ * *outsize is set to the value's real size if it is non-null, so a buffer that
+ * turned out to be too small can be retried. Returns 0 if `key` isn't there.
+ */
+const int sparse_sharded_dict_get(struct sparse_sharded_dict *dict,
+								  const char *key, const size_t klen,
+								  void *value, const size_t vlen, size_t *outsize);
+
+/* Removes `key` from `dict`. Returns 0 if it wasn't there. */
+const int sparse_sharded_dict_delete(struct sparse_sharded_dict *dict,
+									 const char *key, const size_t klen);
+
+/* How many items are in `dict`. Shards are counted one at a time, so with
+ * other threads writing this is only a snapshot.
+ */
+const size_t sparse_sharded_dict_count(struct sparse_sharded_dict *dict);
+
+/* Frees `dict` and every shard in it. Nothing else can be using it. */
+const int sparse_sharded_dict_free(struct sparse_sharded_dict *dict);
+
+/* ----- */
+/* Cache */
+/* ----- */
+
+/* A sparse_cache is a dictionary that never takes up more than `max_bytes`.
+ * The budget covers keys, values, buckets and the table itself, which is
+ * charged for as many buckets as it can hold before it rehashes, so the
+ * tombstones evictions leave behind are already paid for. Malloc's own
+ * overhead isn't counted, and neither is the old table while a rehash is
+ * copying out of it.
+ * Once it's full, making room means evicting things, oldest-looking first: a
+ * clock hand sweeps the table, and anything that's been looked at since the
+ * hand last went by gets a second chance. Like sparse_dict, it does no
+ * locking.
+ */
+struct sparse_cache *sparse_cache_init(const size_t max_bytes);
+
+/* Stores a copy of `value` under `key`, evicting as much as it takes to fit.
+ * Fails if it can't ever fit.
+ */
+const int sparse_cache_set(struct sparse_cache *cache,
+						   const char *key, const size_t klen,
+						   const void *value, const size_t vlen);
+
+/* Same as sparse_dict_get, except it marks `key` as recently used. */
+const void *sparse_cache_get(struct sparse_cache *cache, const char *key,
+							 const size_t klen, size_t *outsize);
+
+const int sparse_cache_delete(struct sparse_cache *cache, const char *key, const size_t klen);
+
+/* How much of the budget is in use. */
+const size_t sparse_cache_bytes(const struct sparse_cache *cache);
+
+const int sparse_cache_free(struct sparse_cache *cache);
+
+/* -------------------------- */
+/* Integer Sparse Dictionary  */
+/* -------------------------- */
+
+/* A sparse_u64_dict maps 64-bit integers to values, the way you'd otherwise
+ * use a sparse_dict with 8-byte keys. It's built out of the same groups, but
+ * keys live right in the bucket, get hashed with sparse_hash_u64 and are
+ * compared with ==, so it's smaller and quicker for maps of IDs. Values up to
+ * U64_INLINE_SIZE bytes live in the bucket too. There's no incremental or
+ * concurrent anything, it's just a table.
+ */
+struct sparse_u64_dict *sparse_u64_dict_init();
+
+/* Copies `value` into `dict`. */
+const int sparse_u64_dict_set(struct sparse_u64_dict *dict, const uint64_t key,
+							  const void *value, const size_t vlen);
+
+/* Returns the value of `key` from `dict`, with the same caveats as
+ * sparse_dict_get.
+ */
+const void *sparse_u64_dict_get(struct sparse_u64_dict *dict, const uint64_t key, size_t *outsize);
+
+/* Removes `key` from `dict`. Returns 0 if it wasn't there. */
+const int sparse_u64_dict_delete(struct sparse_u64_dict *dict, const uint64_t key);
+
+/* Iterates over every key and value in `dict`, like sparse_dict_iter_next. */
+void sparse_u64_dict_iter_init(struct sparse_u64_dict_iter *iter, struct sparse_u64_dict *dict);
+const int sparse_u64_dict_iter_next(struct sparse_u64_dict_iter *iter, uint64_t *key,
+									const void **value, size_t *vlen);
+
+const int sparse_u64_dict_free(struct sparse_u64_dict *dict);
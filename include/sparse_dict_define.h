@@ -0,0 +1,345 @@
+/* vim: noet ts=4 sw=4
+*/
+#pragma once
+#include <stdlib.h>
+#include <string.h>
+#include "simple_sparsehash.h"
+
+/* Type-specialized sparse dictionaries, for when the keys and values are
+ * fixed-size types you know at compile time.
+ *
+ *   SPARSE_DICT_DEFINE(id_map, uint64_t, struct thing, hash_id, ids_equal)
+ *
+ * defines `struct id_map` and id_map_init, id_map_set, id_map_get,
+ * id_map_delete, id_map_iter_next and id_map_free, all static inline. The
+ * table is the same as sparse_dict's: GROUP_SIZE slots to a group, a bitmap
+ * saying which are used, a tag byte per slot and quadratic probing. The
+ * difference is that groups are plain arrays of {key, value} pairs, so
+ * there's no length in front of each element, nothing spills onto the heap,
+ * and the compiler knows every size and can inline `hashfn` and `eqfn`.
+ *
+ * `hashfn` is called as hashfn(key) and returns a uint64_t; all 64 bits
+ * should be good, since the low ones pick the slot and the high ones make
+ * the tag. `eqfn` is called as eqfn(a, b) and returns non-zero if they're the
+ * same key. Either can be a macro.
+ *
+ * Everything is allocated with SPARSE_DEFINE_REALLOC and SPARSE_DEFINE_FREE,
+ * which default to realloc and free. Define them before including this if you
+ * want something else; sparse_set_allocator doesn't reach in here.
+ */
+
+#ifndef SPARSE_DEFINE_REALLOC
+#define SPARSE_DEFINE_REALLOC realloc
+#endif
+#ifndef SPARSE_DEFINE_FREE
+#define SPARSE_DEFINE_FREE free
+#endif
+
+/* Same tags as sparse_dict: the top seven bits of the hash with the high bit
+ * set for live slots, SPARSE_DEFINE_TAG_TOMBSTONE for deleted ones.
+ */
+#define SPARSE_DEFINE_TAG_TOMBSTONE 0x01
+#define SPARSE_DEFINE_TAG(key_hash) ((uint8_t)((key_hash) >> 57) | 0x80)
+#define SPARSE_DEFINE_PROBE(key_hash, num_probes, maximum) \
+	(((key_hash) + ((num_probes) * ((num_probes) + 1)) / 2) & ((maximum) - 1))
+
+/* These don't depend on the types, so there's only one copy of them. */
+static inline uint32_t _sparse_define_popcount(uint64_t x) {
+#if defined(__GNUC__)
+	return (uint32_t)__builtin_popcountll(x);
+#else
+	x = x - ((x >> 1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (uint32_t)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/* How many slots before `position` are occupied, which is where its element
+ * is in the group's array.
+ */
+static inline uint32_t _sparse_define_offset(const uint64_t *bitmap, const uint32_t position) {
+	uint32_t offset = 0, word = 0;
+	for (word = 0; word < position / BITCHUNK_SIZE; word++)
+		offset += _sparse_define_popcount(bitmap[word]);
+	if (position % BITCHUNK_SIZE)
+		offset += _sparse_define_popcount(bitmap[word] << (BITCHUNK_SIZE - position % BITCHUNK_SIZE));
+	return offset;
+}
+
+static inline int _sparse_define_occupied(const uint64_t *bitmap, const uint32_t position) {
+	return (bitmap[position / BITCHUNK_SIZE] >> (position % BITCHUNK_SIZE)) & 1;
+}
+
+/* Grows by a quarter at a time, same as sparse_array's groups. */
+static inline uint32_t _sparse_define_grown_capacity(const uint32_t capacity) {
+	uint32_t new_capacity = capacity + capacity / 4 + 1;
+	return new_capacity > GROUP_SIZE ? GROUP_SIZE : new_capacity;
+}
+
+#define SPARSE_DICT_DEFINE(name, KeyT, ValT, hashfn, eqfn)										\
+																								\
+struct name##_entry {																			\
+	KeyT	key;																				\
+	ValT	value;																				\
+};																								\
+																								\
+struct name##_group {																			\
+	uint16_t				count;																\
+	uint16_t				capacity;															\
+	struct name##_entry		*entries;															\
+	uint64_t				bitmap[BITMAP_SIZE];												\
+};																								\
+																								\
+struct name {																					\
+	size_t				bucket_max;																\
+	size_t				bucket_count;															\
+	size_t				tombstone_count;														\
+	struct name##_group	*groups;																\
+	uint8_t				*tags;																	\
+};																								\
+																								\
+/* Where an iteration is up to: the next slot to look at. */									\
+struct name##_iter {																			\
+	struct name	*dict;																			\
+	size_t		slot;																			\
+};																								\
+																								\
+static inline int name##_alloc_table(struct name *dict, const size_t bucket_max) {				\
+	const size_t num_groups = (bucket_max - 1) / GROUP_SIZE + 1;								\
+	dict->groups = SPARSE_DEFINE_REALLOC(NULL, num_groups * sizeof(struct name##_group));		\
+	dict->tags = SPARSE_DEFINE_REALLOC(NULL, num_groups * GROUP_SIZE);							\
+	if (dict->groups == NULL || dict->tags == NULL) {											\
+		SPARSE_DEFINE_FREE(dict->groups);														\
+		SPARSE_DEFINE_FREE(dict->tags);															\
+		return 0;																				\
+	}																							\
+	memset(dict->groups, 0, num_groups * sizeof(struct name##_group));							\
+	memset(dict->tags, 0, num_groups * GROUP_SIZE);												\
+	dict->bucket_max = bucket_max;																\
+	dict->tombstone_count = 0;																	\
+	return 1;																					\
+}																								\
+																								\
+static inline void name##_free_table(struct name##_group *groups, uint8_t *tags,				\
+									 const size_t bucket_max) {									\
+	size_t i = 0;																				\
+	for (i = 0; i < (bucket_max - 1) / GROUP_SIZE + 1; i++)										\
+		SPARSE_DEFINE_FREE(groups[i].entries);													\
+	SPARSE_DEFINE_FREE(groups);																	\
+	SPARSE_DEFINE_FREE(tags);																	\
+}																								\
+																								\
+static inline struct name *name##_init(void) {													\
+	struct name *dict = SPARSE_DEFINE_REALLOC(NULL, sizeof(struct name));						\
+	if (dict == NULL)																			\
+		return NULL;																			\
+	dict->bucket_count = 0;																		\
+	if (!name##_alloc_table(dict, STARTING_SIZE)) {												\
+		SPARSE_DEFINE_FREE(dict);																\
+		return NULL;																			\
+	}																							\
+	return dict;																				\
+}																								\
+																								\
+/* Puts `entry` in `slot`, which is empty, making room in its group. */						\
+static inline int name##_place(struct name *dict, const size_t slot,							\
+							   const struct name##_entry *entry, const uint8_t tag) {			\
+	struct name##_group *group = &dict->groups[slot / GROUP_SIZE];								\
+	const uint32_t position = slot % GROUP_SIZE;												\
+	const uint32_t offset = _sparse_define_offset(group->bitmap, position);					\
+	if (group->count == group->capacity) {														\
+		const uint32_t new_capacity = _sparse_define_grown_capacity(group->capacity);			\
+		struct name##_entry *entries = SPARSE_DEFINE_REALLOC(group->entries,					\
+				new_capacity * sizeof(struct name##_entry));									\
+		if (entries == NULL)																	\
+			return 0;																			\
+		group->entries = entries;																\
+		group->capacity = new_capacity;															\
+	}																							\
+	memmove(&group->entries[offset + 1], &group->entries[offset],								\
+			(group->count - offset) * sizeof(struct name##_entry));							\
+	group->entries[offset] = *entry;															\
+	group->count++;																				\
+	group->bitmap[position / BITCHUNK_SIZE] |= (uint64_t)1 << (position % BITCHUNK_SIZE);		\
+	dict->tags[slot] = tag;																		\
+	return 1;																					\
+}																								\
+																								\
+static inline struct name##_entry *name##_entry_at(struct name *dict, const size_t slot) {		\
+	struct name##_group *group = &dict->groups[slot / GROUP_SIZE];								\
+	return &group->entries[_sparse_define_offset(group->bitmap, slot % GROUP_SIZE)];			\
+}																								\
+																								\
+/* Finds `key`, or else the first tombstone or empty slot on its way. */						\
+static inline struct name##_entry *name##_lookup(struct name *dict, const KeyT key,				\
+												 const uint64_t key_hash, size_t *slot,			\
+												 int *slot_is_tombstone) {						\
+	const uint8_t tag = SPARSE_DEFINE_TAG(key_hash);											\
+	const size_t max_probes = dict->bucket_count + dict->tombstone_count;						\
+	size_t num_probes = 0;																		\
+	int found_tombstone = 0;																	\
+	*slot = dict->bucket_max;																	\
+	*slot_is_tombstone = 0;																		\
+	for (num_probes = 0; num_probes <= max_probes; num_probes++) {								\
+		const size_t probed_val = SPARSE_DEFINE_PROBE(key_hash, num_probes, dict->bucket_max);	\
+		if (!_sparse_define_occupied(dict->groups[probed_val / GROUP_SIZE].bitmap,				\
+									 probed_val % GROUP_SIZE)) {								\
+			if (!found_tombstone)																\
+				*slot = probed_val;																\
+			return NULL;																		\
+		}																						\
+		if (dict->tags[probed_val] == SPARSE_DEFINE_TAG_TOMBSTONE) {							\
+			if (!found_tombstone) {																\
+				found_tombstone = 1;															\
+				*slot = probed_val;																\
+				*slot_is_tombstone = 1;															\
+			}																					\
+		} else if (dict->tags[probed_val] == tag) {												\
+			struct name##_entry *entry = name##_entry_at(dict, probed_val);						\
+			if (eqfn(entry->key, key)) {														\
+				*slot = probed_val;																\
+				*slot_is_tombstone = 0;															\
+				return entry;																	\
+			}																					\
+		}																						\
+	}																							\
+	return NULL;																				\
+}																								\
+																								\
+/* Moves everything into a fresh table, leaving the tombstones behind. If it						\
+ * can't, the old table is put back as it was.													\
+ */																								\
+static inline int name##_resize(struct name *dict, const size_t new_bucket_max) {				\
+	struct name##_group *old_groups = dict->groups;												\
+	uint8_t *old_tags = dict->tags;																\
+	const size_t old_bucket_max = dict->bucket_max;												\
+	const size_t old_tombstone_count = dict->tombstone_count;									\
+	size_t i = 0;																				\
+	if (!name##_alloc_table(dict, new_bucket_max)) {											\
+		dict->groups = old_groups;																\
+		dict->tags = old_tags;																	\
+		return 0;																				\
+	}																							\
+	for (i = 0; i < (old_bucket_max - 1) / GROUP_SIZE + 1; i++) {								\
+		const struct name##_group *group = &old_groups[i];										\
+		uint32_t position = 0, offset = 0;														\
+		for (position = 0; position < GROUP_SIZE; position++) {									\
+			const struct name##_entry *entry = NULL;											\
+			uint64_t key_hash = 0;																\
+			size_t num_probes = 0, probed_val = 0;												\
+			if (!_sparse_define_occupied(group->bitmap, position))								\
+				continue;																		\
+			entry = &group->entries[offset++];													\
+			if (old_tags[i * GROUP_SIZE + position] == SPARSE_DEFINE_TAG_TOMBSTONE)				\
+				continue;																		\
+			key_hash = hashfn(entry->key);														\
+			do {																				\
+				probed_val = SPARSE_DEFINE_PROBE(key_hash, num_probes, new_bucket_max);			\
+				num_probes++;																	\
+			} while (_sparse_define_occupied(dict->groups[probed_val / GROUP_SIZE].bitmap,		\
+											 probed_val % GROUP_SIZE));							\
+			if (!name##_place(dict, probed_val, entry, SPARSE_DEFINE_TAG(key_hash))) {			\
+				name##_free_table(dict->groups, dict->tags, new_bucket_max);					\
+				dict->groups = old_groups;														\
+				dict->tags = old_tags;															\
+				dict->bucket_max = old_bucket_max;												\
+				dict->tombstone_count = old_tombstone_count;									\
+				return 0;																		\
+			}																					\
+		}																						\
+	}																							\
+	name##_free_table(old_groups, old_tags, old_bucket_max);									\
+	return 1;																					\
+}																								\
+																								\
+static inline int name##_set(struct name *dict, const KeyT key, const ValT value) {				\
+	const uint64_t key_hash = hashfn(key);														\
+	struct name##_entry *existing = NULL;														\
+	struct name##_entry entry;																	\
+	size_t slot = 0;																			\
+	int is_tombstone = 0;																		\
+	existing = name##_lookup(dict, key, key_hash, &slot, &is_tombstone);						\
+	if (existing != NULL) {																		\
+		existing->value = value;																\
+		return 1;																				\
+	}																							\
+	if (slot >= dict->bucket_max)																\
+		return 0;																				\
+	entry.key = key;																			\
+	entry.value = value;																		\
+	if (is_tombstone) {																			\
+		/* The tombstone keeps its place in the group, we just move in. */						\
+		*name##_entry_at(dict, slot) = entry;													\
+		dict->tags[slot] = SPARSE_DEFINE_TAG(key_hash);											\
+		dict->tombstone_count--;																\
+	} else if (!name##_place(dict, slot, &entry, SPARSE_DEFINE_TAG(key_hash))) {				\
+		return 0;																				\
+	}																							\
+	dict->bucket_count++;																		\
+	if ((dict->bucket_count + dict->tombstone_count) * 100 >= dict->bucket_max * RESIZE_PERCENT) {	\
+		if (dict->bucket_count * 200 >= dict->bucket_max * RESIZE_PERCENT)						\
+			return name##_resize(dict, dict->bucket_max * 2);									\
+		return name##_resize(dict, dict->bucket_max);											\
+	}																							\
+	return 1;																					\
+}																								\
+																								\
+/* A pointer to the value of `key`, good until `dict` is next modified, or						\
+ * NULL if it isn't there.																		\
+ */																								\
+static inline ValT *name##_get(struct name *dict, const KeyT key) {								\
+	size_t slot = 0;																			\
+	int is_tombstone = 0;																		\
+	struct name##_entry *entry = name##_lookup(dict, key, hashfn(key), &slot, &is_tombstone);	\
+	return entry != NULL ? &entry->value : NULL;												\
+}																								\
+																								\
+/* Returns 0 if `key` wasn't there. */															\
+static inline int name##_delete(struct name *dict, const KeyT key) {							\
+	size_t slot = 0, new_bucket_max = 0;														\
+	int is_tombstone = 0;																		\
+	if (name##_lookup(dict, key, hashfn(key), &slot, &is_tombstone) == NULL)					\
+		return 0;																				\
+	dict->tags[slot] = SPARSE_DEFINE_TAG_TOMBSTONE;												\
+	dict->bucket_count--;																		\
+	dict->tombstone_count++;																	\
+	/* Same low-water mark as sparse_dict. Shrinking failing loses nothing. */					\
+	new_bucket_max = dict->bucket_max;															\
+	while (new_bucket_max / 2 >= STARTING_SIZE &&												\
+			dict->bucket_count * 200 < (new_bucket_max / 2) * RESIZE_PERCENT)					\
+		new_bucket_max /= 2;																	\
+	if (dict->bucket_count * 100 < dict->bucket_max * SHRINK_PERCENT &&						\
+			new_bucket_max != dict->bucket_max)													\
+		name##_resize(dict, new_bucket_max);													\
+	return 1;																					\
+}																								\
+																								\
+static inline void name##_iter_init(struct name##_iter *iter, struct name *dict) {				\
+	iter->dict = dict;																			\
+	iter->slot = 0;																				\
+}																								\
+																								\
+/* Returns 0 when there's nothing left. Same rules as sparse_dict_iter_next. */					\
+static inline int name##_iter_next(struct name##_iter *iter, KeyT **key, ValT **value) {		\
+	struct name *dict = iter->dict;																\
+	while (iter->slot < dict->bucket_max) {														\
+		const size_t slot = iter->slot++;														\
+		struct name##_entry *entry = NULL;														\
+		if (dict->tags[slot] < 0x80 ||															\
+				!_sparse_define_occupied(dict->groups[slot / GROUP_SIZE].bitmap, slot % GROUP_SIZE))	\
+			continue;																			\
+		entry = name##_entry_at(dict, slot);													\
+		if (key)																				\
+			*key = &entry->key;																	\
+		if (value)																				\
+			*value = &entry->value;																\
+		return 1;																				\
+	}																							\
+	return 0;																					\
+}																								\
+																								\
+static inline void name##_free(struct name *dict) {												\
+	name##_free_table(dict->groups, dict->tags, dict->bucket_max);								\
+	SPARSE_DEFINE_FREE(dict);																	\
+}
@@ -0,0 +1,966 @@
+/* vim: noet ts=4 sw=4
+*/
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "simple_sparsehash.h"
+#include "simple_densehash.h"
+
+/* Dictionaries made with SPARSE_DICT_DEFINE get counted too. */
+#define SPARSE_DEFINE_REALLOC counting_realloc
+#define SPARSE_DEFINE_FREE counting_free
+#include "sparse_dict_define.h"
+
+/* Benchmarks. Not tests: nothing in here checks that anything is right, it
+ * just prints how long things took. Build with `make bench`.
+ *
+ * Every result is one line of JSON on stdout, so runs from different versions
+ * can be diffed or fed to something that graphs them. Anything meant for
+ * people goes to stderr.
+ */
+
+#define KEY_COUNT 1000000
+#define OPS_PER_THREAD 2000000
+#define KEY_LEN 16
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* xorshift, so every thread can have its own cheap random numbers. */
+static uint64_t next_random(uint64_t *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+/* ----------------- */
+/* Counting memory   */
+/* ----------------- */
+
+/* Everything the library allocates comes through here, with the size and the
+ * real start of the block stashed just in front of what we hand out. That's
+ * how we know what a table costs per entry, allocator overhead aside.
+ */
+struct alloc_header {
+	size_t size;
+	void *base;
+};
+#define ALLOC_HEADER_SIZE 16
+
+static size_t live_bytes = 0;
+static size_t peak_bytes = 0;
+
+static void count_alloc(const size_t size) {
+	size_t live = __atomic_add_fetch(&live_bytes, size, __ATOMIC_RELAXED);
+	size_t peak = __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED);
+	while (live > peak &&
+			!__atomic_compare_exchange_n(&peak_bytes, &peak, live, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void *counting_place(void *base, const size_t offset, const size_t size) {
+	unsigned char *ptr = (unsigned char *)base + offset;
+	struct alloc_header header;
+	header.size = size;
+	header.base = base;
+	memcpy(ptr - sizeof(header), &header, sizeof(header));
+	count_alloc(size);
+	return ptr;
+}
+
+static struct alloc_header counting_header(void *ptr) {
+	struct alloc_header header;
+	memcpy(&header, (unsigned char *)ptr - sizeof(header), sizeof(header));
+	return header;
+}
+
+static void *counting_malloc(size_t size) {
+	void *base = malloc(size + ALLOC_HEADER_SIZE);
+	if (base == NULL)
+		return NULL;
+	return counting_place(base, ALLOC_HEADER_SIZE, size);
+}
+
+static void counting_free(void *ptr) {
+	struct alloc_header header;
+	if (ptr == NULL)
+		return;
+	header = counting_header(ptr);
+	__atomic_sub_fetch(&live_bytes, header.size, __ATOMIC_RELAXED);
+	free(header.base);
+}
+
+static void *counting_realloc(void *ptr, size_t size) {
+	struct alloc_header header;
+	void *base = NULL;
+
+	if (ptr == NULL)
+		return counting_malloc(size);
+	header = counting_header(ptr);
+	/* Aligned blocks can't be realloc'd without losing their alignment. */
+	if ((unsigned char *)header.base + ALLOC_HEADER_SIZE != ptr) {
+		void *moved = counting_malloc(size);
+		if (moved != NULL) {
+			memcpy(moved, ptr, header.size < size ? header.size : size);
+			counting_free(ptr);
+		}
+		return moved;
+	}
+
+	base = realloc(header.base, size + ALLOC_HEADER_SIZE);
+	if (base == NULL)
+		return NULL;
+	__atomic_sub_fetch(&live_bytes, header.size, __ATOMIC_RELAXED);
+	return counting_place(base, ALLOC_HEADER_SIZE, size);
+}
+
+static int counting_memalign(void **ptr, size_t alignment, size_t size) {
+	void *base = NULL;
+	const size_t offset = alignment < ALLOC_HEADER_SIZE ? ALLOC_HEADER_SIZE : alignment;
+	const int ret = posix_memalign(&base, offset, size + offset);
+	if (ret != 0)
+		return ret;
+	*ptr = counting_place(base, offset, size);
+	return 0;
+}
+
+static const struct sparse_allocator counting_allocator = {
+	counting_malloc, counting_realloc, counting_free, counting_memalign
+};
+
+/* ----------------- */
+/* Latencies         */
+/* ----------------- */
+
+/* Log-linear buckets, HIST_SUB_BUCKETS to every power of two, so any
+ * percentile we report is within about 6% of the real thing, and recording a
+ * sample is a couple of instructions. The odd slow op that had to grow the
+ * table lands in here along with everything else.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)
+
+struct histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t samples;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
+
+static unsigned int hist_bucket(const uint64_t ns) {
+	unsigned int msb = 0;
+	if (ns < HIST_SUB_BUCKETS)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + ((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* The biggest value that lands in `bucket`. */
+static uint64_t hist_bucket_max(const unsigned int bucket) {
+	unsigned int shift = 0;
+	if (bucket < HIST_SUB_BUCKETS)
+		return bucket;
+	shift = bucket / HIST_SUB_BUCKETS - 1;
+	return ((uint64_t)(HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+static void hist_record(struct histogram *hist, const uint64_t ns) {
+	hist->counts[hist_bucket(ns)]++;
+	hist->samples++;
+	hist->total_ns += ns;
+	if (ns > hist->max_ns)
+		hist->max_ns = ns;
+}
+
+static uint64_t hist_percentile(const struct histogram *hist, const double percentile) {
+	const uint64_t target = (uint64_t)(percentile / 100.0 * hist->samples + 0.5);
+	uint64_t seen = 0;
+	unsigned int i = 0;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen >= target && seen > 0)
+			return hist_bucket_max(i);
+	}
+	return hist->max_ns;
+}
+
+/* ----------------- */
+/* Workloads         */
+/* ----------------- */
+
+/* Single-threaded, and everything is measured an op at a time. Tables are
+ * filled to `keys` items with keys of `key_size` bytes and 8-byte values, then
+ * poked at in various ways. "seq" keys are consecutive numbers, "random" keys
+ * are those numbers run through a bijective mixer, so they never collide but
+ * look nothing alike.
+ */
+
+#define WORKLOAD_MIN_OPS 1000000
+#define MAX_KEY_SIZE 64
+
+static const size_t key_sizes[] = {8, 16, 64};
+static const size_t table_sizes[] = {1000, 10000, 100000, 1000000, 10000000, 100000000};
+
+static uint64_t mix_key(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+/* The number goes in front. Longer keys are padded out with something that
+ * depends on it, so that hashing them has to read the whole thing.
+ */
+static void make_key(char *key, const size_t key_size, const uint64_t n) {
+	uint64_t fill = n * 0x9e3779b97f4a7c15ULL;
+	size_t i = 0;
+	memcpy(key, &n, sizeof(n));
+	for (i = sizeof(n); i < key_size; i++) {
+		key[i] = (char)fill;
+		fill = (fill >> 8) | (fill << 56);
+	}
+}
+
+static void report_workload(const char *suite, const char *workload, const size_t key_size,
+							const size_t keys, const struct histogram *hist, const size_t count) {
+	printf("{\"suite\":\"%s\",\"workload\":\"%s\",\"key_size\":%zu,\"keys\":%zu,"
+		   "\"ops\":%" PRIu64 ",\"ops_per_sec\":%.0f,"
+		   "\"p50_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64 ",\"p999_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 ","
+		   "\"bytes_per_entry\":%.1f,\"peak_bytes\":%zu}\n",
+		   suite, workload, key_size, keys, hist->samples,
+		   hist->total_ns > 0 ? hist->samples / (hist->total_ns / 1e9) : 0.0,
+		   hist_percentile(hist, 50.0), hist_percentile(hist, 99.0), hist_percentile(hist, 99.9),
+		   hist->max_ns,
+		   count > 0 ? (double)__atomic_load_n(&live_bytes, __ATOMIC_RELAXED) / count : 0.0,
+		   __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED));
+	fflush(stdout);
+}
+
+/* Fills a new dictionary with keys 0 to `keys`, mixed or not. */
+static struct sparse_dict *run_insert(const size_t key_size, const size_t keys, const int random,
+									  struct histogram *hist) {
+	struct sparse_dict *dict = sparse_dict_init();
+	char key[MAX_KEY_SIZE];
+	uint64_t i = 0;
+
+	for (i = 0; i < keys; i++) {
+		uint64_t start = 0;
+		make_key(key, key_size, random ? mix_key(i) : i);
+		start = now_ns();
+		sparse_dict_set(dict, key, key_size, &i, sizeof(i));
+		hist_record(hist, now_ns() - start);
+	}
+	return dict;
+}
+
+enum workload { WORKLOAD_HIT, WORKLOAD_MISS, WORKLOAD_OVERWRITE, WORKLOAD_MIXED,
+				WORKLOAD_COUNT_GET_SET, WORKLOAD_COUNT_UPSERT, WORKLOAD_HIT_HASHED };
+
+static void bump(void *value, const size_t vlen, const int inserted, void *ctx) {
+	(void)vlen;
+	(void)inserted;
+	(void)ctx;
+	(*(uint64_t *)value)++;
+}
+
+/* Runs against a table filled by run_insert with random keys. Mixed is 80%
+ * hits, 10% overwrites, and 5% each inserts and deletes of new keys, so the
+ * table stays the same size. The counting workloads add one to an existing
+ * key's value, with a get and a set or with one upsert. hit_hashed is hit
+ * with the hash already in hand, the way a caller that routed on it would be.
+ */
+static void run_ops(struct sparse_dict *dict, const size_t key_size, const size_t keys,
+					const enum workload workload, struct histogram *hist) {
+	const uint64_t ops = keys < WORKLOAD_MIN_OPS ? WORKLOAD_MIN_OPS : keys;
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	uint64_t inserted = 0, deleted = 0, i = 0;
+	char key[MAX_KEY_SIZE];
+	uint64_t key_hash = 0;
+	size_t outsize = 0;
+
+	for (i = 0; i < ops; i++) {
+		const uint64_t r = next_random(&state);
+		const unsigned int pick = workload == WORKLOAD_MIXED ? (r >> 40) % 100 : 0;
+		uint64_t start = 0;
+		int op = 0;
+
+		/* 0 is a get, 1 a set, 2 a delete, 3 a count, 4 a get with the hash. */
+		if (workload == WORKLOAD_MISS) {
+			make_key(key, key_size, mix_key(keys + r % keys));
+		} else if (workload == WORKLOAD_MIXED && pick >= 95 && deleted < inserted) {
+			make_key(key, key_size, mix_key(keys + deleted++));
+			op = 2;
+		} else if (workload == WORKLOAD_MIXED && pick >= 90) {
+			make_key(key, key_size, mix_key(keys + inserted++));
+			op = 1;
+		} else {
+			make_key(key, key_size, mix_key(r % keys));
+			op = workload == WORKLOAD_OVERWRITE || (workload == WORKLOAD_MIXED && pick >= 80);
+			if (workload == WORKLOAD_COUNT_GET_SET || workload == WORKLOAD_COUNT_UPSERT)
+				op = 3;
+			if (workload == WORKLOAD_HIT_HASHED) {
+				key_hash = dict->hash_fn(key, key_size, dict->seed);
+				op = 4;
+			}
+		}
+
+		start = now_ns();
+		if (op == 0)
+			sparse_dict_get(dict, key, key_size, &outsize);
+		else if (op == 1)
+			sparse_dict_set(dict, key, key_size, &r, sizeof(r));
+		else if (op == 2)
+			sparse_dict_delete(dict, key, key_size);
+		else if (op == 4)
+			sparse_dict_get_hashed(dict, key, key_size, &outsize, key_hash);
+		else if (workload == WORKLOAD_COUNT_UPSERT)
+			sparse_dict_upsert(dict, key, key_size, sizeof(uint64_t), bump, NULL);
+		else {
+			uint64_t count = *(const uint64_t *)sparse_dict_get(dict, key, key_size, &outsize) + 1;
+			sparse_dict_set(dict, key, key_size, &count, sizeof(count));
+		}
+		hist_record(hist, now_ns() - start);
+	}
+}
+
+static void bench_workloads(const size_t max_keys) {
+	static const char *names[] = {"hit", "miss", "overwrite", "mixed", "count_get_set", "count_upsert",
+								  "hit_hashed"};
+	struct histogram *hist = malloc(sizeof(struct histogram));
+	size_t k = 0, t = 0;
+	int w = 0;
+
+	for (k = 0; k < sizeof(key_sizes) / sizeof(key_sizes[0]); k++) {
+		for (t = 0; t < sizeof(table_sizes) / sizeof(table_sizes[0]) && table_sizes[t] <= max_keys; t++) {
+			const size_t keys = table_sizes[t];
+			struct sparse_dict *dict = NULL;
+
+			memset(hist, 0, sizeof(*hist));
+			__atomic_store_n(&peak_bytes, __atomic_load_n(&live_bytes, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+			dict = run_insert(key_sizes[k], keys, 0, hist);
+			report_workload("workloads", "seq_insert", key_sizes[k], keys, hist, dict->bucket_count);
+			sparse_dict_free(dict);
+
+			memset(hist, 0, sizeof(*hist));
+			__atomic_store_n(&peak_bytes, __atomic_load_n(&live_bytes, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+			dict = run_insert(key_sizes[k], keys, 1, hist);
+			report_workload("workloads", "random_insert", key_sizes[k], keys, hist, dict->bucket_count);
+
+			for (w = WORKLOAD_HIT; w <= WORKLOAD_HIT_HASHED; w++) {
+				memset(hist, 0, sizeof(*hist));
+				run_ops(dict, key_sizes[k], keys, (enum workload)w, hist);
+				report_workload("workloads", names[w], key_sizes[k], keys, hist, dict->bucket_count);
+			}
+			sparse_dict_free(dict);
+		}
+	}
+	free(hist);
+}
+
+/* ------------------ */
+/* Defined types      */
+/* ------------------ */
+
+/* SPARSE_DICT_DEFINE's version of the same thing, with the hash inlined. */
+static inline uint64_t hash_id(const uint64_t key) {
+	return sparse_hash_u64(key, 0x9e3779b97f4a7c15ULL);
+}
+#define IDS_EQUAL(a, b) ((a) == (b))
+SPARSE_DICT_DEFINE(id_map, uint64_t, uint64_t, hash_id, IDS_EQUAL)
+
+/* Shows up in the u64 suite as "defined_insert" and "defined_hit". */
+static void bench_defined(const size_t keys, struct histogram *hist) {
+	const uint64_t ops = keys < WORKLOAD_MIN_OPS ? WORKLOAD_MIN_OPS : keys;
+	struct id_map *map = NULL;
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	uint64_t i = 0, start = 0, found = 0;
+
+	memset(hist, 0, sizeof(*hist));
+	__atomic_store_n(&peak_bytes, __atomic_load_n(&live_bytes, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	map = id_map_init();
+	for (i = 0; i < keys; i++) {
+		start = now_ns();
+		id_map_set(map, mix_key(i), i);
+		hist_record(hist, now_ns() - start);
+	}
+	report_workload("u64", "defined_insert", sizeof(uint64_t), keys, hist, map->bucket_count);
+
+	memset(hist, 0, sizeof(*hist));
+	for (i = 0; i < ops; i++) {
+		const uint64_t key = mix_key(next_random(&state) % keys);
+		start = now_ns();
+		found += id_map_get(map, key) != NULL;
+		hist_record(hist, now_ns() - start);
+	}
+	report_workload("u64", "defined_hit", sizeof(uint64_t), keys, hist, map->bucket_count);
+	if (found != ops)
+		fprintf(stderr, "defined_hit: only found %" PRIu64 " of %" PRIu64 "\n", found, ops);
+	id_map_free(map);
+}
+
+/* ------------------ */
+/* Integer keys       */
+/* ------------------ */
+
+/* The same random 64-bit IDs mapped to 8-byte values, as 8-byte string keys
+ * in a sparse_dict, in a sparse_u64_dict, and in a dictionary made with
+ * SPARSE_DICT_DEFINE. Workloads come out as "dict_insert", "u64_insert",
+ * "defined_insert" and so on.
+ */
+static void bench_u64(const size_t max_keys) {
+	struct histogram *hist = malloc(sizeof(struct histogram));
+	size_t t = 0;
+
+	for (t = 0; t < sizeof(table_sizes) / sizeof(table_sizes[0]) && table_sizes[t] <= max_keys; t++) {
+		const size_t keys = table_sizes[t];
+		const uint64_t ops = keys < WORKLOAD_MIN_OPS ? WORKLOAD_MIN_OPS : keys;
+		struct sparse_dict *dict = NULL;
+		struct sparse_u64_dict *u64_dict = NULL;
+		uint64_t state = 0x9e3779b97f4a7c15ULL;
+		uint64_t i = 0, start = 0;
+		size_t outsize = 0;
+
+		memset(hist, 0, sizeof(*hist));
+		__atomic_store_n(&peak_bytes, __atomic_load_n(&live_bytes, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+		dict = run_insert(sizeof(uint64_t), keys, 1, hist);
+		report_workload("u64", "dict_insert", sizeof(uint64_t), keys, hist, dict->bucket_count);
+
+		memset(hist, 0, sizeof(*hist));
+		for (i = 0; i < ops; i++) {
+			char key[sizeof(uint64_t)];
+			make_key(key, sizeof(key), mix_key(next_random(&state) % keys));
+			start = now_ns();
+			sparse_dict_get(dict, key, sizeof(key), &outsize);
+			hist_record(hist, now_ns() - start);
+		}
+		report_workload("u64", "dict_hit", sizeof(uint64_t), keys, hist, dict->bucket_count);
+		sparse_dict_free(dict);
+
+		memset(hist, 0, sizeof(*hist));
+		__atomic_store_n(&peak_bytes, __atomic_load_n(&live_bytes, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+		u64_dict = sparse_u64_dict_init();
+		for (i = 0; i < keys; i++) {
+			const uint64_t key = mix_key(i);
+			start = now_ns();
+			sparse_u64_dict_set(u64_dict, key, &i, sizeof(i));
+			hist_record(hist, now_ns() - start);
+		}
+		report_workload("u64", "u64_insert", sizeof(uint64_t), keys, hist, u64_dict->bucket_count);
+
+		memset(hist, 0, sizeof(*hist));
+		state = 0x9e3779b97f4a7c15ULL;
+		for (i = 0; i < ops; i++) {
+			const uint64_t key = mix_key(next_random(&state) % keys);
+			start = now_ns();
+			sparse_u64_dict_get(u64_dict, key, &outsize);
+			hist_record(hist, now_ns() - start);
+		}
+		report_workload("u64", "u64_hit", sizeof(uint64_t), keys, hist, u64_dict->bucket_count);
+		sparse_u64_dict_free(u64_dict);
+
+		bench_defined(keys, hist);
+	}
+	free(hist);
+}
+
+/* ------------------ */
+/* Sparse vs. dense   */
+/* ------------------ */
+
+/* The same random 16-byte keys and 8-byte values in a sparse_dict and in a
+ * dense_dict at its default resize point, and at sparse_dict's, so it's clear
+ * how much of the difference is just the dense table being emptier.
+ */
+#define DENSE_KEY_SIZE 16
+
+static void bench_dense_one(const char *name, const size_t keys, const unsigned int resize_percent,
+							struct histogram *hist) {
+	const uint64_t ops = keys < WORKLOAD_MIN_OPS ? WORKLOAD_MIN_OPS : keys;
+	struct dense_dict *dict = NULL;
+	char workload[64];
+	char key[DENSE_KEY_SIZE];
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	uint64_t i = 0, start = 0;
+	size_t outsize = 0;
+
+	memset(hist, 0, sizeof(*hist));
+	__atomic_store_n(&peak_bytes, __atomic_load_n(&live_bytes, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	dict = dense_dict_init();
+	dense_dict_set_resize_policy(dict, resize_percent, resize_percent / 4);
+	for (i = 0; i < keys; i++) {
+		make_key(key, sizeof(key), mix_key(i));
+		start = now_ns();
+		dense_dict_set(dict, key, sizeof(key), &i, sizeof(i));
+		hist_record(hist, now_ns() - start);
+	}
+	snprintf(workload, sizeof(workload), "%s_insert", name);
+	report_workload("dense", workload, sizeof(key), keys, hist, dict->bucket_count);
+
+	memset(hist, 0, sizeof(*hist));
+	for (i = 0; i < ops; i++) {
+		make_key(key, sizeof(key), mix_key(next_random(&state) % keys));
+		start = now_ns();
+		dense_dict_get(dict, key, sizeof(key), &outsize);
+		hist_record(hist, now_ns() - start);
+	}
+	snprintf(workload, sizeof(workload), "%s_hit", name);
+	report_workload("dense", workload, sizeof(key), keys, hist, dict->bucket_count);
+
+	memset(hist, 0, sizeof(*hist));
+	for (i = 0; i < ops; i++) {
+		make_key(key, sizeof(key), mix_key(keys + next_random(&state) % keys));
+		start = now_ns();
+		dense_dict_get(dict, key, sizeof(key), &outsize);
+		hist_record(hist, now_ns() - start);
+	}
+	snprintf(workload, sizeof(workload), "%s_miss", name);
+	report_workload("dense", workload, sizeof(key), keys, hist, dict->bucket_count);
+	dense_dict_free(dict);
+}
+
+static void bench_dense(const size_t max_keys) {
+	struct histogram *hist = malloc(sizeof(struct histogram));
+	size_t t = 0;
+
+	for (t = 0; t < sizeof(table_sizes) / sizeof(table_sizes[0]) && table_sizes[t] <= max_keys; t++) {
+		const size_t keys = table_sizes[t];
+		struct sparse_dict *dict = NULL;
+
+		memset(hist, 0, sizeof(*hist));
+		__atomic_store_n(&peak_bytes, __atomic_load_n(&live_bytes, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+		dict = run_insert(DENSE_KEY_SIZE, keys, 1, hist);
+		report_workload("dense", "sparse_insert", DENSE_KEY_SIZE, keys, hist, dict->bucket_count);
+		memset(hist, 0, sizeof(*hist));
+		run_ops(dict, DENSE_KEY_SIZE, keys, WORKLOAD_HIT, hist);
+		report_workload("dense", "sparse_hit", DENSE_KEY_SIZE, keys, hist, dict->bucket_count);
+		memset(hist, 0, sizeof(*hist));
+		run_ops(dict, DENSE_KEY_SIZE, keys, WORKLOAD_MISS, hist);
+		report_workload("dense", "sparse_miss", DENSE_KEY_SIZE, keys, hist, dict->bucket_count);
+		sparse_dict_free(dict);
+
+		bench_dense_one("dense", keys, DENSE_RESIZE_PERCENT, hist);
+		bench_dense_one("dense80", keys, RESIZE_PERCENT, hist);
+	}
+	free(hist);
+}
+
+/* ------------------ */
+/* Probing strategies */
+/* ------------------ */
+
+/* The same keys the workloads use, put into dictionaries that probe each
+ * way. Tables only come in powers of two, so rather than leave the load to
+ * wherever the key count happens to land, each table is filled to exactly
+ * half, three quarters and nine tenths of its size, with the resize point
+ * pushed up out of the way. Alongside how fast hits and misses are, we print
+ * how far everything ended up from where it hashes to, which is what the
+ * probing is actually deciding.
+ */
+static const int probings[] = {SPARSE_PROBE_QUADRATIC, SPARSE_PROBE_LINEAR, SPARSE_PROBE_ROBIN_HOOD};
+static const char *probing_names[] = {"quadratic", "linear", "robin_hood"};
+static const unsigned int probing_loads[] = {50, 75, 90};
+
+static void report_probes(const char *workload, const size_t key_size, const size_t keys,
+						  struct sparse_dict *dict) {
+	struct sparse_dict_stats stats;
+	double total = 0.0;
+	size_t i = 0;
+
+	sparse_dict_stats(dict, &stats);
+	printf("{\"suite\":\"probing\",\"workload\":\"%s\",\"key_size\":%zu,\"keys\":%zu,"
+		   "\"load_factor\":%.3f,\"max_probe\":%zu,\"displacement\":[",
+		   workload, key_size, keys, stats.load_factor, stats.max_probe);
+	for (i = 0; i < SPARSE_PROBE_HISTOGRAM_SIZE; i++) {
+		printf("%s%" PRIu64, i > 0 ? "," : "", stats.displacement[i]);
+		total += (double)i * stats.displacement[i];
+	}
+	printf("],\"mean_displacement\":%.3f}\n", stats.bucket_count > 0 ? total / stats.bucket_count : 0.0);
+	fflush(stdout);
+}
+
+static void bench_probing(const size_t max_keys) {
+	struct histogram *hist = malloc(sizeof(struct histogram));
+	char workload[64];
+	char key[MAX_KEY_SIZE];
+	size_t k = 0, t = 0, p = 0, l = 0;
+	int random = 0;
+
+	for (k = 0; k < sizeof(key_sizes) / sizeof(key_sizes[0]); k++) {
+		for (t = 0; t < sizeof(table_sizes) / sizeof(table_sizes[0]) && table_sizes[t] <= max_keys; t++) {
+			size_t bucket_max = STARTING_SIZE;
+			while (bucket_max < table_sizes[t])
+				bucket_max *= 2;
+			for (p = 0; p < sizeof(probings) / sizeof(probings[0]); p++) {
+				for (l = 0; l < sizeof(probing_loads) / sizeof(probing_loads[0]); l++) {
+					for (random = 0; random <= 1; random++) {
+						const size_t keys = bucket_max * probing_loads[l] / 100;
+						struct sparse_dict *dict = sparse_dict_init();
+						uint64_t i = 0, start = 0;
+
+						sparse_dict_probing(dict, probings[p], SPARSE_MAX_RESIZE_PERCENT);
+						memset(hist, 0, sizeof(*hist));
+						__atomic_store_n(&peak_bytes, __atomic_load_n(&live_bytes, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+						for (i = 0; i < keys; i++) {
+							make_key(key, key_sizes[k], random ? mix_key(i) : i);
+							start = now_ns();
+							sparse_dict_set(dict, key, key_sizes[k], &i, sizeof(i));
+							hist_record(hist, now_ns() - start);
+						}
+						snprintf(workload, sizeof(workload), "%s_%u_%s_insert", probing_names[p],
+								 probing_loads[l], random ? "random" : "seq");
+						report_workload("probing", workload, key_sizes[k], keys, hist, dict->bucket_count);
+						snprintf(workload, sizeof(workload), "%s_%u_%s", probing_names[p],
+								 probing_loads[l], random ? "random" : "seq");
+						report_probes(workload, key_sizes[k], keys, dict);
+
+						/* run_ops only knows about random keys. */
+						if (random) {
+							memset(hist, 0, sizeof(*hist));
+							run_ops(dict, key_sizes[k], keys, WORKLOAD_HIT, hist);
+							snprintf(workload, sizeof(workload), "%s_%u_hit", probing_names[p], probing_loads[l]);
+							report_workload("probing", workload, key_sizes[k], keys, hist, dict->bucket_count);
+							memset(hist, 0, sizeof(*hist));
+							run_ops(dict, key_sizes[k], keys, WORKLOAD_MISS, hist);
+							snprintf(workload, sizeof(workload), "%s_%u_miss", probing_names[p], probing_loads[l]);
+							report_workload("probing", workload, key_sizes[k], keys, hist, dict->bucket_count);
+						}
+						sparse_dict_free(dict);
+					}
+				}
+			}
+		}
+	}
+	free(hist);
+}
+
+/* ---------------------------- */
+/* Sharded dictionary scaling   */
+/* ---------------------------- */
+
+/* Every thread does the same thing against the same keys: nine gets for every
+ * set. We run it once with everything behind one mutex, the way you'd have to
+ * share a plain sparse_dict, and once against a sparse_sharded_dict.
+ */
+
+struct scaling_thread {
+	pthread_t thread;
+	struct sparse_sharded_dict *sharded;
+	struct sparse_dict *global;
+	pthread_mutex_t *global_lock;
+	char (*keys)[KEY_LEN];
+	uint64_t seed;
+};
+
+static void *scaling_run(void *arg) {
+	struct scaling_thread *t = arg;
+	uint64_t state = t->seed;
+	uint64_t value = 0;
+	size_t outsize = 0;
+	int i = 0;
+
+	for (i = 0; i < OPS_PER_THREAD; i++) {
+		const uint64_t r = next_random(&state);
+		const char *key = t->keys[r % KEY_COUNT];
+		const int is_set = (r >> 32) % 10 == 0;
+
+		if (t->sharded != NULL) {
+			if (is_set)
+				sparse_sharded_dict_set(t->sharded, key, KEY_LEN, &r, sizeof(r));
+			else
+				sparse_sharded_dict_get(t->sharded, key, KEY_LEN, &value, sizeof(value), &outsize);
+		} else {
+			pthread_mutex_lock(t->global_lock);
+			if (is_set) {
+				sparse_dict_set(t->global, key, KEY_LEN, &r, sizeof(r));
+			} else {
+				const void *found = sparse_dict_get(t->global, key, KEY_LEN, &outsize);
+				if (found != NULL)
+					memcpy(&value, found, sizeof(value));
+			}
+			pthread_mutex_unlock(t->global_lock);
+		}
+	}
+	return NULL;
+}
+
+static double run_scaling(const int nthreads, struct sparse_sharded_dict *sharded,
+						  struct sparse_dict *global, pthread_mutex_t *global_lock,
+						  char (*keys)[KEY_LEN]) {
+	struct scaling_thread *threads = calloc(nthreads, sizeof(struct scaling_thread));
+	uint64_t start = 0;
+	uint64_t elapsed = 0;
+	int i = 0;
+
+	start = now_ns();
+	for (i = 0; i < nthreads; i++) {
+		threads[i].sharded = sharded;
+		threads[i].global = global;
+		threads[i].global_lock = global_lock;
+		threads[i].keys = keys;
+		threads[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+		pthread_create(&threads[i].thread, NULL, scaling_run, &threads[i]);
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i].thread, NULL);
+	elapsed = now_ns() - start;
+
+	free(threads);
+	return (double)nthreads * OPS_PER_THREAD / (elapsed / 1e9) / 1e6;
+}
+
+static void bench_sharded_scaling(const int max_threads) {
+	char (*keys)[KEY_LEN] = malloc((size_t)KEY_COUNT * KEY_LEN);
+	struct sparse_sharded_dict *sharded = NULL;
+	struct sparse_dict *global = NULL;
+	pthread_mutex_t global_lock;
+	uint64_t i = 0;
+	int nthreads = 0;
+
+	sharded = sparse_sharded_dict_init(max_threads * 4);
+	global = sparse_dict_init();
+	pthread_mutex_init(&global_lock, NULL);
+
+	for (i = 0; i < KEY_COUNT; i++) {
+		memset(keys[i], 0, KEY_LEN);
+		snprintf(keys[i], KEY_LEN, "key%" PRIu64, i);
+		sparse_sharded_dict_set(sharded, keys[i], KEY_LEN, &i, sizeof(i));
+		sparse_dict_set(global, keys[i], KEY_LEN, &i, sizeof(i));
+	}
+
+	/* 90% get / 10% set. */
+	for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+		const double with_global = run_scaling(nthreads, NULL, global, &global_lock, keys);
+		const double with_shards = run_scaling(nthreads, sharded, NULL, NULL, keys);
+		printf("{\"suite\":\"sharded_scaling\",\"keys\":%d,\"shards\":%zu,\"threads\":%d,"
+			   "\"global_mops\":%.2f,\"sharded_mops\":%.2f}\n",
+			   KEY_COUNT, sharded->shard_count, nthreads, with_global, with_shards);
+		fflush(stdout);
+	}
+
+	pthread_mutex_destroy(&global_lock);
+	sparse_dict_free(global);
+	sparse_sharded_dict_free(sharded);
+	free(keys);
+}
+
+/* ------------------------ */
+/* Lock-free reader scaling */
+/* ------------------------ */
+
+/* Readers do nothing but random gets while one writer keeps overwriting
+ * random keys as fast as it can. Readers either go through a
+ * sparse_sharded_dict or read a sparse_dict with concurrent readers on.
+ */
+
+struct reader_thread {
+	pthread_t thread;
+	struct sparse_sharded_dict *sharded;
+	struct sparse_dict *dict;
+	char (*keys)[KEY_LEN];
+	uint64_t seed;
+	int *stop;
+};
+
+static void *reader_run(void *arg) {
+	struct reader_thread *t = arg;
+	struct sparse_reader *reader = t->dict != NULL ? sparse_dict_reader_register(t->dict) : NULL;
+	uint64_t state = t->seed;
+	uint64_t value = 0;
+	size_t outsize = 0;
+	int i = 0;
+
+	for (i = 0; i < OPS_PER_THREAD; i++) {
+		const char *key = t->keys[next_random(&state) % KEY_COUNT];
+		if (reader != NULL) {
+			const void *found = NULL;
+			sparse_dict_read_begin(reader);
+			found = sparse_dict_get(t->dict, key, KEY_LEN, &outsize);
+			if (found != NULL)
+				memcpy(&value, found, sizeof(value));
+			sparse_dict_read_end(reader);
+		} else {
+			sparse_sharded_dict_get(t->sharded, key, KEY_LEN, &value, sizeof(value), &outsize);
+		}
+	}
+
+	if (reader != NULL)
+		sparse_dict_reader_unregister(reader);
+	return NULL;
+}
+
+static void *writer_run(void *arg) {
+	struct reader_thread *t = arg;
+	uint64_t state = t->seed;
+
+	while (!__atomic_load_n(t->stop, __ATOMIC_ACQUIRE)) {
+		const uint64_t r = next_random(&state);
+		const char *key = t->keys[r % KEY_COUNT];
+		if (t->dict != NULL)
+			sparse_dict_set(t->dict, key, KEY_LEN, &r, sizeof(r));
+		else
+			sparse_sharded_dict_set(t->sharded, key, KEY_LEN, &r, sizeof(r));
+	}
+	return NULL;
+}
+
+static double run_readers(const int nthreads, struct sparse_sharded_dict *sharded,
+						  struct sparse_dict *dict, char (*keys)[KEY_LEN]) {
+	struct reader_thread *threads = calloc(nthreads + 1, sizeof(struct reader_thread));
+	int stop = 0;
+	uint64_t start = 0;
+	uint64_t elapsed = 0;
+	int i = 0;
+
+	for (i = 0; i <= nthreads; i++) {
+		threads[i].sharded = sharded;
+		threads[i].dict = dict;
+		threads[i].keys = keys;
+		threads[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+		threads[i].stop = &stop;
+	}
+
+	pthread_create(&threads[nthreads].thread, NULL, writer_run, &threads[nthreads]);
+	start = now_ns();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i].thread, NULL, reader_run, &threads[i]);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i].thread, NULL);
+	elapsed = now_ns() - start;
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	pthread_join(threads[nthreads].thread, NULL);
+
+	free(threads);
+	return (double)nthreads * OPS_PER_THREAD / (elapsed / 1e9) / 1e6;
+}
+
+static void bench_concurrent_readers(const int max_threads) {
+	char (*keys)[KEY_LEN] = malloc((size_t)KEY_COUNT * KEY_LEN);
+	struct sparse_sharded_dict *sharded = NULL;
+	struct sparse_dict *dict = NULL;
+	uint64_t i = 0;
+	int nthreads = 0;
+
+	sharded = sparse_sharded_dict_init(max_threads * 4);
+	dict = sparse_dict_init();
+
+	for (i = 0; i < KEY_COUNT; i++) {
+		memset(keys[i], 0, KEY_LEN);
+		snprintf(keys[i], KEY_LEN, "key%" PRIu64, i);
+		sparse_sharded_dict_set(sharded, keys[i], KEY_LEN, &i, sizeof(i));
+		sparse_dict_set(dict, keys[i], KEY_LEN, &i, sizeof(i));
+	}
+	if (!sparse_dict_concurrent_readers(dict, 1)) {
+		fprintf(stderr, "no lock-free readers on this platform\n");
+		goto cleanup;
+	}
+
+	for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+		const double with_shards = run_readers(nthreads, sharded, NULL, keys);
+		const double lock_free = run_readers(nthreads, NULL, dict, keys);
+		printf("{\"suite\":\"concurrent_readers\",\"keys\":%d,\"readers\":%d,"
+			   "\"sharded_mops\":%.2f,\"lock_free_mops\":%.2f}\n",
+			   KEY_COUNT, nthreads, with_shards, lock_free);
+		fflush(stdout);
+	}
+
+cleanup:
+	sparse_dict_free(dict);
+	sparse_sharded_dict_free(sharded);
+	free(keys);
+}
+
+/* ---------------- */
+/* Parallel rehash  */
+/* ---------------- */
+
+/* How long it takes to double a table of REHASH_KEYS items. */
+#define REHASH_KEYS 2000000
+
+static void bench_parallel_rehash(const int max_threads) {
+	char key[KEY_LEN] = {0};
+	int nthreads = 0;
+	uint64_t i = 0;
+
+	for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+		struct sparse_dict *dict = sparse_dict_init();
+		uint64_t start = 0;
+
+		for (i = 0; i < REHASH_KEYS; i++) {
+			snprintf(key, KEY_LEN, "key%" PRIu64, i);
+			sparse_dict_set(dict, key, KEY_LEN, &i, sizeof(i));
+		}
+		sparse_dict_parallel_rehash(dict, nthreads);
+
+		start = now_ns();
+		sparse_dict_reserve(dict, dict->bucket_max);
+		printf("{\"suite\":\"parallel_rehash\",\"keys\":%d,\"threads\":%d,\"ms\":%.1f}\n",
+			   REHASH_KEYS, nthreads, (now_ns() - start) / 1e6);
+		fflush(stdout);
+
+		sparse_dict_free(dict);
+	}
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-t max threads] [-m max keys] [workloads|u64|dense|probing|sharded|readers|rehash]...\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	size_t max_keys = 100000000;
+	int opt = 0, i = 0, all = 0;
+
+	while ((opt = getopt(argc, argv, "t:m:")) != -1) {
+		if (opt == 't')
+			max_threads = atoi(optarg);
+		else if (opt == 'm')
+			max_keys = strtoull(optarg, NULL, 10);
+		else
+			usage(argv[0]);
+	}
+	if (max_threads < 1)
+		max_threads = 1;
+	all = optind == argc;
+
+	/* Installed before anything's allocated, and never taken out. */
+	sparse_set_allocator(&counting_allocator);
+
+	for (i = optind; i < argc; i++) {
+		if (strcmp(argv[i], "workloads") != 0 && strcmp(argv[i], "u64") != 0 &&
+				strcmp(argv[i], "dense") != 0 && strcmp(argv[i], "probing") != 0 &&
+				strcmp(argv[i], "sharded") != 0 &&
+				strcmp(argv[i], "readers") != 0 && strcmp(argv[i], "rehash") != 0)
+			usage(argv[0]);
+	}
+	for (i = optind; i < argc || all; i++) {
+		const char *suite = all ? NULL : argv[i];
+		if (all || strcmp(suite, "workloads") == 0)
+			bench_workloads(max_keys);
+		if (all || strcmp(suite, "u64") == 0)
+			bench_u64(max_keys);
+		if (all || strcmp(suite, "dense") == 0)
+			bench_dense(max_keys);
+		if (all || strcmp(suite, "probing") == 0)
+			bench_probing(max_keys);
+		if (all || strcmp(suite, "sharded") == 0)
+			bench_sharded_scaling(max_threads);
+		if (all || strcmp(suite, "readers") == 0)
+			bench_concurrent_readers(max_threads);
+		if (all || strcmp(suite, "rehash") == 0)
+			bench_parallel_rehash(max_threads);
+		all = 0;
+	}
+	return 0;
+}
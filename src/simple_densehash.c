@@ -0,0 +1,281 @@
+/* vim: noet ts=4 sw=4
+*/
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <string.h>
+#include "simple_densehash.h"
+
+/* The same triangular probing sparse_dict does, so every slot gets visited. */
+#define QUADRATIC_PROBE(maximum) (key_hash + (num_probes * (num_probes + 1)) / 2) & (maximum - 1)
+
+/* One bucket, one cache line. */
+typedef char dense_bucket_is_a_cache_line[(sizeof(struct dense_bucket) == CACHE_LINE_SIZE) ? 1 : -1];
+
+/* Memory */
+
+/* Everything comes from whatever allocator the sparse side is using. */
+static inline void *_dense_malloc(const size_t size) {
+	return sparse_get_allocator()->malloc_fn(size);
+}
+
+static inline void _dense_free(void *ptr) {
+	sparse_get_allocator()->free_fn(ptr);
+}
+
+static struct dense_bucket *_dense_table_alloc(const size_t bucket_max) {
+	void *buckets = NULL;
+	if (bucket_max > SIZE_MAX / sizeof(struct dense_bucket))
+		return NULL;
+	if (sparse_get_allocator()->aligned_fn(&buckets, CACHE_LINE_SIZE,
+										   bucket_max * sizeof(struct dense_bucket)) != 0)
+		return NULL;
+	/* All zeroes is all DENSE_HASH_EMPTY. */
+	memset(buckets, 0, bucket_max * sizeof(struct dense_bucket));
+	return buckets;
+}
+
+/* Buckets */
+
+/* Keeps real hashes from looking like an empty slot or a tombstone. */
+static inline uint64_t _dense_hash(const struct dense_dict *dict, const char *key, const size_t klen) {
+	const uint64_t key_hash = dict->hash_fn(key, klen, dict->seed);
+	return key_hash <= DENSE_HASH_TOMBSTONE ? key_hash + 2 : key_hash;
+}
+
+static inline const int _bucket_is_live(const struct dense_bucket *bucket) {
+	return bucket->hash > DENSE_HASH_TOMBSTONE;
+}
+
+static inline const int _bucket_is_inline(const struct dense_bucket *bucket) {
+	return (size_t)bucket->klen + bucket->vlen <= DENSE_INLINE_SIZE;
+}
+
+static inline unsigned char *_bucket_data(struct dense_bucket *bucket) {
+	if (_bucket_is_inline(bucket))
+		return bucket->data.bytes;
+	return bucket->data.heap;
+}
+
+static void _bucket_free(struct dense_bucket *bucket) {
+	if (_bucket_is_live(bucket) && !_bucket_is_inline(bucket))
+		_dense_free(bucket->data.heap);
+}
+
+/* Dense Dictionary */
+struct dense_dict *dense_dict_init() {
+	return dense_dict_init_with_hash(NULL);
+}
+
+struct dense_dict *dense_dict_init_with_hash(const sparse_hash_fn hash_fn) {
+	struct dense_dict *new = _dense_malloc(sizeof(struct dense_dict));
+	if (new == NULL)
+		return NULL;
+	memset(new, 0, sizeof(struct dense_dict));
+
+	new->hash_fn = hash_fn != NULL ? hash_fn : sparse_hash_wy;
+	new->seed = sparse_random_seed();
+	new->bucket_max = DENSE_STARTING_SIZE;
+	new->resize_percent = DENSE_RESIZE_PERCENT;
+	new->shrink_percent = DENSE_SHRINK_PERCENT;
+	new->buckets = _dense_table_alloc(DENSE_STARTING_SIZE);
+	if (new->buckets == NULL) {
+		_dense_free(new);
+		return NULL;
+	}
+	return new;
+}
+
+const int dense_dict_set_resize_policy(struct dense_dict *dict, const unsigned int resize_percent,
+									   const unsigned int shrink_percent) {
+	if (resize_percent < 1 || resize_percent > 99 || shrink_percent * 2 >= resize_percent)
+		return 0;
+	dict->resize_percent = resize_percent;
+	dict->shrink_percent = shrink_percent;
+	return 1;
+}
+
+/* Finds the slot holding `key`, or the slot it should go in if it isn't
+ * there: the first tombstone on the way, or else the empty slot where the
+ * probe sequence ended. The hash is right there in the bucket, so keys only
+ * get compared when the whole 64-bit hash matches.
+ */
+static struct dense_bucket *_dense_lookup(struct dense_dict *dict,
+						const char *key, const size_t klen, const uint64_t key_hash,
+						struct dense_bucket **slot) {
+	struct dense_bucket *first_tombstone = NULL;
+	size_t num_probes = 0;
+
+	*slot = NULL;
+	for (num_probes = 0; num_probes < dict->bucket_max; num_probes++) {
+		struct dense_bucket *bucket = &dict->buckets[QUADRATIC_PROBE(dict->bucket_max)];
+
+		if (bucket->hash == DENSE_HASH_EMPTY) {
+			*slot = first_tombstone != NULL ? first_tombstone : bucket;
+			return NULL;
+		}
+		if (bucket->hash == DENSE_HASH_TOMBSTONE) {
+			if (first_tombstone == NULL)
+				first_tombstone = bucket;
+		} else if (bucket->hash == key_hash && bucket->klen == klen &&
+				memcmp(_bucket_data(bucket) + bucket->vlen, key, klen) == 0) {
+			*slot = bucket;
+			return bucket;
+		}
+	}
+
+	*slot = first_tombstone;
+	return NULL;
+}
+
+/* Moves every live bucket into a fresh table. Buckets own whatever they
+ * point to, so they just get copied.
+ */
+static const int _dense_resize(struct dense_dict *dict, const size_t new_bucket_max) {
+	struct dense_bucket *new_buckets = _dense_table_alloc(new_bucket_max);
+	size_t i = 0;
+
+	if (new_buckets == NULL)
+		return 0;
+
+	for (i = 0; i < dict->bucket_max; i++) {
+		const struct dense_bucket *bucket = &dict->buckets[i];
+		const uint64_t key_hash = bucket->hash;
+		size_t num_probes = 0;
+
+		if (!_bucket_is_live(bucket))
+			continue;
+		while (new_buckets[QUADRATIC_PROBE(new_bucket_max)].hash != DENSE_HASH_EMPTY)
+			num_probes++;
+		new_buckets[QUADRATIC_PROBE(new_bucket_max)] = *bucket;
+	}
+
+	_dense_free(dict->buckets);
+	dict->buckets = new_buckets;
+	dict->bucket_max = new_bucket_max;
+	dict->tombstone_count = 0;
+	return 1;
+}
+
+const int dense_dict_set(struct dense_dict *dict,
+						 const char *key, const size_t klen,
+						 const void *value, const size_t vlen) {
+	const uint64_t key_hash = _dense_hash(dict, key, klen);
+	struct dense_bucket *existing_bucket = NULL, *slot = NULL;
+	struct dense_bucket new_bucket;
+	unsigned char *destination = NULL;
+
+	if (klen > UINT32_MAX || vlen > UINT32_MAX)
+		return 0;
+
+	existing_bucket = _dense_lookup(dict, key, klen, key_hash, &slot);
+	if (slot == NULL)
+		return 0;
+
+	memset(&new_bucket, 0, sizeof(new_bucket));
+	new_bucket.hash = key_hash;
+	new_bucket.klen = (uint32_t)klen;
+	new_bucket.vlen = (uint32_t)vlen;
+	if (_bucket_is_inline(&new_bucket)) {
+		destination = new_bucket.data.bytes;
+	} else {
+		new_bucket.data.heap = _dense_malloc(klen + vlen);
+		if (new_bucket.data.heap == NULL)
+			return 0;
+		destination = new_bucket.data.heap;
+	}
+	memcpy(destination, value, vlen);
+	memcpy(destination + vlen, key, klen);
+
+	if (existing_bucket != NULL) {
+		_bucket_free(existing_bucket);
+		*existing_bucket = new_bucket;
+		return 1;
+	}
+
+	if (slot->hash == DENSE_HASH_TOMBSTONE)
+		dict->tombstone_count--;
+	*slot = new_bucket;
+	dict->bucket_count++;
+
+	/* Tombstones make probe sequences just as long as live buckets do, but if
+	 * they're most of what's filling the table, it only needs clearing out.
+	 */
+	if ((dict->bucket_count + dict->tombstone_count) * 100 >= dict->bucket_max * dict->resize_percent) {
+		if (dict->bucket_count * 200 >= dict->bucket_max * dict->resize_percent)
+			return _dense_resize(dict, dict->bucket_max * 2);
+		return _dense_resize(dict, dict->bucket_max);
+	}
+	return 1;
+}
+
+const void *dense_dict_get(struct dense_dict *dict, const char *key,
+						   const size_t klen, size_t *outsize) {
+	struct dense_bucket *slot = NULL;
+	struct dense_bucket *existing_bucket = _dense_lookup(dict, key, klen, _dense_hash(dict, key, klen), &slot);
+
+	if (existing_bucket == NULL)
+		return NULL;
+	if (outsize)
+		*outsize = existing_bucket->vlen;
+	return _bucket_data(existing_bucket);
+}
+
+const int dense_dict_delete(struct dense_dict *dict, const char *key, const size_t klen) {
+	struct dense_bucket *slot = NULL;
+	struct dense_bucket *existing_bucket = _dense_lookup(dict, key, klen, _dense_hash(dict, key, klen), &slot);
+	size_t new_bucket_max = dict->bucket_max;
+
+	if (existing_bucket == NULL)
+		return 0;
+
+	_bucket_free(existing_bucket);
+	existing_bucket->hash = DENSE_HASH_TOMBSTONE;
+	dict->bucket_count--;
+	dict->tombstone_count++;
+
+	/* Halve the table for as long as what's left stays under half of the
+	 * resize point. If it fails we just keep the bigger table.
+	 */
+	if (dict->shrink_percent > 0 && dict->bucket_count * 100 < dict->bucket_max * dict->shrink_percent) {
+		while (new_bucket_max / 2 >= DENSE_STARTING_SIZE &&
+				dict->bucket_count * 200 < (new_bucket_max / 2) * dict->resize_percent)
+			new_bucket_max /= 2;
+		if (new_bucket_max != dict->bucket_max)
+			_dense_resize(dict, new_bucket_max);
+	}
+	return 1;
+}
+
+void dense_dict_iter_init(struct dense_dict_iter *iter, struct dense_dict *dict) {
+	iter->dict = dict;
+	iter->slot = 0;
+}
+
+const int dense_dict_iter_next(struct dense_dict_iter *iter,
+							   const char **key, size_t *klen,
+							   const void **value, size_t *vlen) {
+	while (iter->slot < iter->dict->bucket_max) {
+		struct dense_bucket *bucket = &iter->dict->buckets[iter->slot++];
+		if (!_bucket_is_live(bucket))
+			continue;
+		if (key)
+			*key = (const char *)_bucket_data(bucket) + bucket->vlen;
+		if (klen)
+			*klen = bucket->klen;
+		if (value)
+			*value = _bucket_data(bucket);
+		if (vlen)
+			*vlen = bucket->vlen;
+		return 1;
+	}
+	return 0;
+}
+
+const int dense_dict_free(struct dense_dict *dict) {
+	size_t i = 0;
+	for (i = 0; i < dict->bucket_max; i++)
+		_bucket_free(&dict->buckets[i]);
+	_dense_free(dict->buckets);
+	_dense_free(dict);
+	return 1;
+}
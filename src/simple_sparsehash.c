@@ -1,60 +1,343 @@
 /* vim: noet ts=4 sw=4
 */
+#define _POSIX_C_SOURCE 200112L
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+#ifdef SPARSE_CHECK_HASHES
+#include <stdio.h>
+#endif
 #include "simple_sparsehash.h"
 
-#define FULL_ELEM_SIZE (arr->elem_size + sizeof(size_t))
+#define FULL_ELEM_SIZE (owner->stride)
+#define LEN_PREFIX_SIZE (owner->stride - owner->elem_size)
 #define MAX_ARR_SIZE ((arr->maximum - 1)/GROUP_SIZE + 1)
-#define QUADRATIC_PROBE(maximum) (key_hash + num_probes * num_probes) & (maximum - 1)
+/* Probing by triangular numbers visits every slot of a power-of-two table, so
+ * even a bad hash function can't make us miss an empty one.
+ */
+#define QUADRATIC_PROBE(maximum) (key_hash + (num_probes * (num_probes + 1)) / 2) & (maximum - 1)
+/* Whichever sequence the table is using. Anything that isn't quadratic is
+ * linear, Robin Hood only changes who ends up where along it.
+ */
+#define PROBE(probing, maximum) ((probing) == SPARSE_PROBE_QUADRATIC ? \
+		QUADRATIC_PROBE(maximum) : (key_hash + num_probes) & (maximum - 1))
+#define TOMBSTONE_KLEN ((size_t)-1)
+#define TAG_TOMBSTONE 0x01
+
+/* Images (see sparse_dict_save). */
+#define SPARSE_IMAGE_MAGIC "SPARSEHT"
+#define SPARSE_IMAGE_BYTE_ORDER 0x0102030405060708ULL
+#define IMAGE_TOMBSTONE_KLEN UINT64_MAX
+#define IMAGE_BUFFER_SIZE 65536
+#define IMAGE_HASH_WY 1
+#define IMAGE_HASH_FNV1A 2
+
+/* Streams (see sparse_dict_dump_stream). */
+#define SPARSE_STREAM_MAGIC "SPARSEDS"
+#define STREAM_HEADER_SIZE 24
+#define STREAM_RECORD_HEADER_SIZE 16
+/* The most entries we'll make room for on a stream's say-so alone. */
+#define STREAM_PRESIZE_MAX ((uint64_t)1 << 20)
+
+/* Counting lookups for sparse_dict_stats. */
+#ifdef SPARSE_DICT_STATS
+#define COUNT_LOOKUP(dict, probes) _count_lookup((dict), (probes))
+#else
+#define COUNT_LOOKUP(dict, probes) ((void)(probes))
+#endif
+
+/* Checking hashes handed to the *_hashed functions. */
+#ifdef SPARSE_CHECK_HASHES
+#define CHECK_HASH(dict, key, klen, key_hash) _check_hash((dict), (key), (klen), (key_hash))
+#else
+#define CHECK_HASH(dict, key, klen, key_hash) ((void)0)
+#endif
+
+#if defined(__GNUC__)
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr) ((void)(addr))
+#endif
+
+/* Anything a lock-free reader might be looking at at the same time as the
+ * writer changes it goes through these. Without the GNU builtins there are no
+ * lock-free readers, and these are plain loads and stores.
+ */
+#if defined(__GNUC__)
+#define HAVE_ATOMICS 1
+#define LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define LOAD_RELAXED(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define STORE_RELAXED(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define COMPARE_AND_SWAP(p, expected, desired) \
+	__atomic_compare_exchange_n((p), &(expected), (desired), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+#define FENCE_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define FENCE_RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define FENCE_FULL() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define COUNTER_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#else
+#define HAVE_ATOMICS 0
+#define LOAD_ACQUIRE(p) (*(p))
+#define LOAD_RELAXED(p) (*(p))
+#define STORE_RELEASE(p, v) (*(p) = (v))
+#define STORE_RELAXED(p, v) (*(p) = (v))
+#define COMPARE_AND_SWAP(p, expected, desired) (*(p) == (expected) ? (*(p) = (desired), 1) : 0)
+#define FENCE_ACQUIRE() ((void)0)
+#define FENCE_RELEASE() ((void)0)
+#define FENCE_FULL() ((void)0)
+#define COUNTER_ADD(p, v) (*(p) += (v))
+#endif
+
+/* position_to_offset counts whole bitmap words, so make sure there are some. */
+typedef char group_size_is_a_multiple_of_64[(GROUP_SIZE % 64 == 0) ? 1 : -1];
+/* Groups keep their capacity in 16 bits. */
+typedef char group_size_fits_in_capacity[(GROUP_SIZE <= UINT16_MAX) ? 1 : -1];
+
+/* Memory */
+
+static int _default_memalign(void **ptr, size_t alignment, size_t size) {
+	return posix_memalign(ptr, alignment, size);
+}
+
+static struct sparse_allocator _allocator = {malloc, realloc, free, _default_memalign};
+
+void sparse_set_allocator(const struct sparse_allocator *allocator) {
+	static const struct sparse_allocator defaults = {malloc, realloc, free, _default_memalign};
+	_allocator = allocator != NULL ? *allocator : defaults;
+}
+
+const struct sparse_allocator *sparse_get_allocator(void) {
+	return &_allocator;
+}
+
+static inline void *_sparse_malloc(const size_t size) {
+	return _allocator.malloc_fn(size);
+}
+
+static void *_sparse_calloc(const size_t count, const size_t size) {
+	void *ptr = NULL;
+	if (size != 0 && count > SIZE_MAX / size)
+		return NULL;
+	ptr = _allocator.malloc_fn(count * size);
+	if (ptr != NULL)
+		memset(ptr, 0, count * size);
+	return ptr;
+}
+
+static inline void *_sparse_realloc(void *ptr, const size_t size) {
+	return _allocator.realloc_fn(ptr, size);
+}
+
+static void _sparse_free(void *ptr) {
+	_allocator.free_fn(ptr);
+}
+
+static inline int _sparse_memalign(void **ptr, const size_t alignment, const size_t size) {
+	return _allocator.aligned_fn(ptr, alignment, size);
+}
+
+/* Hashing */
 
 /* One of the simplest hashing functions, FNV-1a. See the wikipedia article for more info:
  * http://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function
+ * It's simple, but it goes a byte at a time. It's here for anybody that
+ * wants it, the default is sparse_hash_wy below.
  */
-static const uint64_t hash_fnv1a(const char *key, const size_t klen) {
+uint64_t sparse_hash_fnv1a(const char *key, const size_t klen, const uint64_t seed) {
 	static const uint64_t fnv_prime = 1099511628211ULL;
 	static const uint64_t fnv_offset_bias = 14695981039346656037ULL;
 
-	const int iterations = klen;
-
-	uint8_t i;
-	uint64_t hash = fnv_offset_bias;
+	size_t i;
+	uint64_t hash = fnv_offset_bias ^ seed;
 
-	for(i = 0; i < iterations; i++) {
-		hash = hash ^ key[i];
+	for(i = 0; i < klen; i++) {
+		hash = hash ^ (unsigned char)key[i];
 		hash = hash * fnv_prime;
 	}
 
 	return hash;
 }
 
+/* Multiplies two 64-bit numbers and folds the 128-bit result back down. This
+ * is the whole trick behind wyhash: one multiply mixes every input bit into
+ * the middle of the result.
+ */
+static inline void _mum(uint64_t *a, uint64_t *b) {
+#if defined(__SIZEOF_INT128__)
+	__extension__ typedef unsigned __int128 uint128_t;
+	const uint128_t r = (uint128_t)*a * *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	const uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+	const uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	const uint64_t t = rl + (rm0 << 32);
+	uint64_t lo = t + (rm1 << 32), hi = 0;
+	hi = rh + (rm0 >> 32) + (rm1 >> 32) + (t < rl) + (lo < t);
+	*a = lo;
+	*b = hi;
+#endif
+}
+
+static inline uint64_t _mix(uint64_t a, uint64_t b) {
+	_mum(&a, &b);
+	return a ^ b;
+}
+
+/* Keys can start anywhere, so all reads go through memcpy. Compilers turn
+ * these into single loads. Like wyhash we assume little-endian; on anything
+ * else hashes are still good, just different.
+ */
+static inline uint64_t _read64(const unsigned char *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t _read32(const unsigned char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t _read_small(const unsigned char *p, const size_t k) {
+	return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k >> 1]) << 8) | p[k - 1];
+}
+
+/* A word-at-a-time hash following wyhash (https://github.com/wangyi-fudan/wyhash),
+ * which is public domain. Keys are eaten 48 bytes a loop, and short keys
+ * only take a couple of loads and multiplies.
+ */
+uint64_t sparse_hash_wy(const char *key, const size_t klen, const uint64_t seed) {
+	static const uint64_t secret[4] = {
+		0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+		0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL
+	};
+	const unsigned char *p = (const unsigned char *)key;
+	uint64_t a = 0, b = 0;
+	uint64_t s = seed ^ _mix(seed ^ secret[0], secret[1]);
+
+	if (klen <= 16) {
+		if (klen >= 4) {
+			a = (_read32(p) << 32) | _read32(p + ((klen >> 3) << 2));
+			b = (_read32(p + klen - 4) << 32) | _read32(p + klen - 4 - ((klen >> 3) << 2));
+		} else if (klen > 0) {
+			a = _read_small(p, klen);
+		}
+	} else {
+		size_t i = klen;
+		if (i > 48) {
+			uint64_t see1 = s, see2 = s;
+			do {
+				s = _mix(_read64(p) ^ secret[1], _read64(p + 8) ^ s);
+				see1 = _mix(_read64(p + 16) ^ secret[2], _read64(p + 24) ^ see1);
+				see2 = _mix(_read64(p + 32) ^ secret[3], _read64(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			s ^= see1 ^ see2;
+		}
+		while (i > 16) {
+			s = _mix(_read64(p) ^ secret[1], _read64(p + 8) ^ s);
+			i -= 16;
+			p += 16;
+		}
+		a = _read64(p + i - 16);
+		b = _read64(p + i - 8);
+	}
+
+	a ^= secret[1];
+	b ^= s;
+	_mum(&a, &b);
+	return _mix(a ^ secret[0] ^ klen, b ^ secret[1]);
+}
+
+/* The SplitMix64 finalizer on the key and seed. Every bit of the key ends up
+ * affecting every bit of the hash, which matters since we probe with the low
+ * bits and tag with the high ones.
+ */
+uint64_t sparse_hash_u64(const uint64_t key, const uint64_t seed) {
+	uint64_t z = key ^ seed;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* SplitMix64, used to turn one random number into many. */
+static uint64_t _splitmix64(uint64_t *state) {
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* Every dictionary gets its own seed so nobody can work out ahead of time
+ * which keys collide. We read some real randomness once and derive the rest
+ * from it. If there's no /dev/urandom, the time and some addresses will have
+ * to do.
+ */
+static uint64_t _new_seed(const void *salt) {
+	static uint64_t state = 0;
+	static int seeded = 0;
+
+	if (!seeded) {
+		FILE *urandom = fopen("/dev/urandom", "rb");
+		uint64_t from_os = 0;
+		if (urandom != NULL) {
+			if (fread(&from_os, sizeof(from_os), 1, urandom) != 1)
+				from_os = 0;
+			fclose(urandom);
+		}
+		state = from_os ^ (uint64_t)time(NULL) ^ ((uint64_t)clock() << 32) ^
+			(uint64_t)(uintptr_t)&state;
+		seeded = 1;
+	}
+
+	return _splitmix64(&state) ^ (uint64_t)(uintptr_t)salt;
+}
+
+uint64_t sparse_random_seed(void) {
+	return _new_seed(NULL);
+}
+
 /* TODO: Figure out better names for charbit/modbit */
 static const uint32_t charbit(const uint32_t position) {
-	/* Get enough bits to store 0 - 31. */
-	return position >> 5;
+	/* Get enough bits to store 0 - 63. */
+	return position >> 6;
 }
 
-static const uint32_t modbit(const uint32_t position) {
-	/* Get the number of bits of this number that are 0 - 31,
+static const uint64_t modbit(const uint32_t position) {
+	/* Get the number of bits of this number that are 0 - 63,
 	 * or something like that.
 	 */
-	return 1 << (position & 31);
+	return (uint64_t)1 << (position & 63);
 }
 
-/* This is one of the popcount implementations from Wikipedia.
+/* This is one of the popcount implementations from Wikipedia, widened to 64
+ * bits. It's what we fall back on when the CPU can't do it for us.
  * http://en.wikipedia.org/wiki/Hamming_weight
  */
-static inline uint32_t popcount_32(uint32_t x) {
-	const uint32_t m1 = 0x55555555;
-	const uint32_t m2 = 0x33333333;
-	const uint32_t m4 = 0x0f0f0f0f;
+static inline uint32_t popcount_64(uint64_t x) {
+	const uint64_t m1 = 0x5555555555555555ULL;
+	const uint64_t m2 = 0x3333333333333333ULL;
+	const uint64_t m4 = 0x0f0f0f0f0f0f0f0fULL;
+	const uint64_t h01 = 0x0101010101010101ULL;
 	x -= (x >> 1) & m1;
 	x = (x & m2) + ((x >> 2) & m2);
 	x = (x + (x >> 4)) & m4;
-	x += x >>  8;
-	return (x + (x >> 16)) & 0x3f;
+	return (x * h01) >> 56;
 }
 
+#if !defined(__POPCNT__)
 /* This function is used to map an item's 'position' (the user-facing index
  * into the array) with the 'offset' which is the actual position in the
  * array, memory-wise.
@@ -63,96 +346,350 @@ static inline uint32_t popcount_32(uint32_t x) {
  * 0 .. i-1 in the bitmap. The original implementation uses a big table for the
  * popcount.
  */
-static const uint32_t position_to_offset(const uint32_t *bitmap,
+static uint32_t position_to_offset_soft(const uint64_t *bitmap,
 									   const uint32_t position) {
 	uint32_t retval = 0;
 	uint32_t pos = position;
 	uint32_t bitmap_iter = 0;
 
-	/* Here we loop through the bitmap a uint32_t at a time, and count the number
+	/* Here we loop through the bitmap a uint64_t at a time, and count the number
 	 * of 1s in that chunk.
 	 */
 	for (; pos >= BITCHUNK_SIZE; pos -= BITCHUNK_SIZE)
-		retval += popcount_32(bitmap[bitmap_iter++]);
+		retval += popcount_64(bitmap[bitmap_iter++]);
 
 	/* This last bit does the same thing as above, but takes care of the
-	 * remainder that didn't fit cleanly into the 32 x 32 x 32 ... loop above. That
-	 * is to say, it grabs the last 0 - 7 bits and adds the number of 1s in it to
+	 * remainder that didn't fit cleanly into the 64 x 64 x 64 ... loop above. That
+	 * is to say, it grabs the last 0 - 63 bits and adds the number of 1s in it to
 	 * retval.
 	 */
-	return retval + popcount_32(bitmap[bitmap_iter] & (((uint32_t)1 << pos) - 1u));
+	return retval + popcount_64(bitmap[bitmap_iter] & (((uint64_t)1 << pos) - 1u));
+}
+
+/* How many positions in a group's bitmap are occupied. */
+static uint32_t group_count_soft(const uint64_t *bitmap) {
+	uint32_t count = 0, word = 0;
+	for (word = 0; word < BITMAP_SIZE; word++)
+		count += popcount_64(bitmap[word]);
+	return count;
+}
+#endif
+
+#if defined(__POPCNT__)
+/* We were compiled for a CPU that has POPCNT (and maybe BZHI), so there's
+ * nothing to decide at runtime.
+ */
+static inline const uint32_t position_to_offset(const uint64_t *bitmap,
+									   const uint32_t position) {
+	uint32_t retval = 0;
+	uint32_t pos = position;
+	uint32_t bitmap_iter = 0;
+
+	for (; pos >= BITCHUNK_SIZE; pos -= BITCHUNK_SIZE)
+		retval += __builtin_popcountll(bitmap[bitmap_iter++]);
+#if defined(__BMI2__)
+	return retval + __builtin_popcountll(_bzhi_u64(bitmap[bitmap_iter], pos));
+#else
+	return retval + __builtin_popcountll(bitmap[bitmap_iter] & (((uint64_t)1 << pos) - 1u));
+#endif
+}
+
+static inline const uint32_t group_count(const uint64_t *bitmap) {
+	uint32_t count = 0, word = 0;
+	for (word = 0; word < BITMAP_SIZE; word++)
+		count += __builtin_popcountll(bitmap[word]);
+	return count;
+}
+
+static void select_popcount(void) {
+}
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+/* We don't know what we'll be running on, so build the hardware version on
+ * the side and pick one the first time somebody makes an array.
+ */
+__attribute__((target("popcnt,bmi2")))
+static uint32_t position_to_offset_hw(const uint64_t *bitmap,
+									   const uint32_t position) {
+	uint32_t retval = 0;
+	uint32_t pos = position;
+	uint32_t bitmap_iter = 0;
+
+	for (; pos >= BITCHUNK_SIZE; pos -= BITCHUNK_SIZE)
+		retval += __builtin_popcountll(bitmap[bitmap_iter++]);
+	return retval + __builtin_popcountll(_bzhi_u64(bitmap[bitmap_iter], pos));
+}
+
+__attribute__((target("popcnt")))
+static uint32_t group_count_hw(const uint64_t *bitmap) {
+	uint32_t count = 0, word = 0;
+	for (word = 0; word < BITMAP_SIZE; word++)
+		count += __builtin_popcountll(bitmap[word]);
+	return count;
+}
+
+static uint32_t (*position_to_offset)(const uint64_t *, const uint32_t) = position_to_offset_soft;
+static uint32_t (*group_count)(const uint64_t *) = group_count_soft;
+
+static pthread_once_t popcount_once = PTHREAD_ONCE_INIT;
+
+static void _pick_popcount(void) {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("popcnt") && __builtin_cpu_supports("bmi2"))
+		position_to_offset = position_to_offset_hw;
+	if (__builtin_cpu_supports("popcnt"))
+		group_count = group_count_hw;
+}
+
+/* Arrays get made from more than one thread, so only pick once. */
+static void select_popcount(void) {
+	pthread_once(&popcount_once, _pick_popcount);
+}
+#else
+#define position_to_offset position_to_offset_soft
+#define group_count group_count_soft
+
+static void select_popcount(void) {
 }
+#endif
 
 /* Simple check to see whether a slot in the array is occupied or not. */
-static const int is_position_occupied(const uint32_t *bitmap,
+static const int is_position_occupied(const uint64_t *bitmap,
 							 const uint32_t position) {
-	return bitmap[charbit(position)] & modbit(position);
+	return (bitmap[charbit(position)] & modbit(position)) != 0;
 }
 
-static void set_position(uint32_t *bitmap, const uint32_t position) {
+static void set_position(uint64_t *bitmap, const uint32_t position) {
 	bitmap[charbit(position)] |= modbit(position);
 }
 
+static void clear_position(uint64_t *bitmap, const uint32_t position) {
+	bitmap[charbit(position)] &= ~modbit(position);
+}
+
+/* Epochs */
+
+static struct sparse_epoch *_epoch_create(void) {
+	struct sparse_epoch *epoch = NULL;
+	void *readers = NULL;
+
+	epoch = _sparse_calloc(1, sizeof(struct sparse_epoch));
+	if (epoch == NULL)
+		return NULL;
+	if (_sparse_memalign(&readers, CACHE_LINE_SIZE, MAX_READERS * sizeof(struct sparse_reader)) != 0) {
+		_sparse_free(epoch);
+		return NULL;
+	}
+	memset(readers, 0, MAX_READERS * sizeof(struct sparse_reader));
+	epoch->readers = readers;
+	/* A reader in epoch 0 isn't reading at all, so we start at 1. */
+	epoch->global = 1;
+	return epoch;
+}
+
+/* Moves the global epoch on. Readers that start after this can't see anything
+ * that was retired before it. Two things make that true:
+ * - The store is a release, and sparse_dict_read_begin loads it with an
+ *   acquire, so a reader that sees the new epoch also sees every unlink we
+ *   did before bumping it, instead of the table or group it replaced.
+ * - The fence pairs with the one in sparse_dict_read_begin, so when we go
+ *   looking at readers' epochs, either we see that a reader has started with
+ *   the old epoch, or it got the new one.
+ */
+static const uint64_t _epoch_advance(struct sparse_epoch *epoch) {
+	STORE_RELEASE(&epoch->global, epoch->global + 1);
+	FENCE_FULL();
+	return epoch->global;
+}
+
+/* Frees everything that was retired before the earliest epoch any reader is
+ * still in.
+ */
+static void _epoch_collect(struct sparse_epoch *epoch) {
+	uint64_t oldest = _epoch_advance(epoch);
+	size_t i = 0, kept = 0;
+
+	/* Acquire, so that anything a reader did before it left is done before
+	 * we free it.
+	 */
+	for (i = 0; i < MAX_READERS; i++) {
+		const uint64_t reader_epoch = LOAD_ACQUIRE(&epoch->readers[i].epoch);
+		if (reader_epoch != 0 && reader_epoch < oldest)
+			oldest = reader_epoch;
+	}
+
+	for (i = 0; i < epoch->retired_count; i++) {
+		struct sparse_retired *retired = &epoch->retired[i];
+		if (retired->epoch < oldest)
+			retired->free_fn(retired->ptr);
+		else
+			epoch->retired[kept++] = *retired;
+	}
+	epoch->retired_count = kept;
+}
+
+/* Waits until every reader that's in the middle of reading has finished. */
+static void _epoch_synchronize(struct sparse_epoch *epoch) {
+	const uint64_t current = _epoch_advance(epoch);
+	size_t i = 0;
+
+	for (i = 0; i < MAX_READERS; i++) {
+		uint64_t reader_epoch = LOAD_ACQUIRE(&epoch->readers[i].epoch);
+		while (reader_epoch != 0 && reader_epoch < current)
+			reader_epoch = LOAD_ACQUIRE(&epoch->readers[i].epoch);
+	}
+}
+
+/* Hands `ptr` over to be freed with `free_fn` once no reader can be using it. */
+static void _epoch_retire(struct sparse_epoch *epoch, void *ptr, void (*free_fn)(void *)) {
+	struct sparse_retired *retired = NULL;
+
+	if (ptr == NULL)
+		return;
+
+	if (epoch->retired_count == epoch->retired_capacity) {
+		const size_t new_capacity = epoch->retired_capacity * 2 + RETIRE_BATCH;
+		retired = _sparse_realloc(epoch->retired, new_capacity * sizeof(struct sparse_retired));
+		if (retired == NULL) {
+			/* No room to remember it, so wait the readers out and free it
+			 * now. Slow, but it beats leaking.
+			 */
+			_epoch_synchronize(epoch);
+			free_fn(ptr);
+			return;
+		}
+		epoch->retired = retired;
+		epoch->retired_capacity = new_capacity;
+	}
+
+	retired = &epoch->retired[epoch->retired_count++];
+	retired->ptr = ptr;
+	retired->free_fn = free_fn;
+	retired->epoch = epoch->global;
+
+	if (epoch->retired_count % RETIRE_BATCH == 0)
+		_epoch_collect(epoch);
+}
+
+/* Only once nobody is reading. */
+static void _epoch_free(struct sparse_epoch *epoch) {
+	size_t i = 0;
+	for (i = 0; i < epoch->retired_count; i++)
+		epoch->retired[i].free_fn(epoch->retired[i].ptr);
+	_sparse_free(epoch->retired);
+	_sparse_free(epoch->readers);
+	_sparse_free(epoch);
+}
+
 /* Sparse Array */
-static const int _sparse_array_group_set(struct sparse_array_group *arr, const uint32_t i,
-						   const void *val, const size_t vlen) {
+
+/* How much room a group gets when it runs out. Growing by a quarter at a time
+ * means a group reallocates about a dozen times on its way to GROUP_SIZE
+ * instead of GROUP_SIZE times, without leaving much unused.
+ */
+static const uint32_t _grown_capacity(const uint32_t capacity, const uint32_t first_capacity) {
+	uint32_t new_capacity = capacity == 0 ? first_capacity : capacity + capacity / 4 + 1;
+	if (new_capacity < capacity + 1)
+		new_capacity = capacity + 1;
+	if (new_capacity > GROUP_SIZE)
+		new_capacity = GROUP_SIZE;
+	return new_capacity;
+}
+
+/* Groups don't keep a count, the bitmap already knows. */
+static inline const uint32_t _group_count(const uint64_t *bitmap) {
+	return group_count(bitmap);
+}
+
+/* Where the element at `offset` in `storage` starts, past its length if the
+ * array keeps one.
+ */
+static inline unsigned char *_element_at(const struct sparse_array *owner, const void *storage,
+										 const uint32_t offset) {
+	return (unsigned char *)storage + offset * FULL_ELEM_SIZE + LEN_PREFIX_SIZE;
+}
+
+/* How long the element at `offset` in `storage` is. Fixed-size arrays don't
+ * have to look.
+ */
+static inline const size_t _element_len(const struct sparse_array *owner, const void *storage,
+										const uint32_t offset) {
+	size_t item_len = owner->elem_size;
+	/* The size might not be aligned, so it has to be copied out. */
+	if (LEN_PREFIX_SIZE > 0)
+		memcpy(&item_len, (const unsigned char *)storage + offset * FULL_ELEM_SIZE, sizeof(item_len));
+	return item_len;
+}
+
+/* Writes `val` into the element at `offset`, with its length in front if the
+ * array keeps one.
+ */
+static inline void _element_write(const struct sparse_array *owner, void *storage,
+								  const uint32_t offset, const void *val, const size_t vlen) {
+	if (LEN_PREFIX_SIZE > 0)
+		memcpy((unsigned char *)storage + offset * FULL_ELEM_SIZE, &vlen, sizeof(vlen));
+	memcpy(_element_at(owner, storage, offset), val, vlen);
+}
+
+/* Fixed-size arrays only take things of exactly that size, everybody else
+ * takes anything up to it.
+ */
+static inline const int _element_fits(const struct sparse_array *owner, const size_t vlen) {
+	return LEN_PREFIX_SIZE > 0 ? vlen <= owner->elem_size : vlen == owner->elem_size;
+}
+
+static const int _sparse_array_group_set(const struct sparse_array *owner, struct sparse_array_group *arr,
+						   const uint32_t i, const void *val, const size_t vlen) {
 	uint32_t offset = 0;
-	void *destination = NULL;
-	if (vlen > arr->elem_size)
+	if (!_element_fits(owner, vlen))
 		return 0;
 	/* So what needs to happen in this function:
 	 * 1. Convert the position (i) to the 'offset'
 	 * 2. Check to see if this slot is already occupied (bmtest).
 	 *    overwrite the old element if this is the case.
-	 * 3. Otherwise, expand the array by a single element and increase
-	 *    our bucket count (arr->count). Finally, OR the bit in our state
-	 *    bitmap that shows this position is occupied.
+	 * 3. Otherwise, make room for a single element (growing the storage if
+	 *    we're at capacity). Finally, OR the bit in our state bitmap that
+	 *    shows this position is occupied, which is also what counts it.
 	 * 4. After doing all that, create a copy of val and stick it in the right
 	 *    position in our array.
 	 */
 
 	offset = position_to_offset(arr->bitmap, i);
 	if (!is_position_occupied(arr->bitmap, i)) {
-		const size_t to_move_siz = (arr->count - offset) * FULL_ELEM_SIZE;
-		/* Reallocate the array to hold the new item */
-		void *new_group = realloc(arr->group, (arr->count + 1) * FULL_ELEM_SIZE);
-		if (new_group == NULL)
-			return 0;
+		const uint32_t count = _group_count(arr->bitmap);
+		const size_t to_move_siz = (count - offset) * FULL_ELEM_SIZE;
+		if (count == arr->capacity) {
+			/* Reallocate the array to hold the new item, and then some. */
+			const uint32_t new_capacity = _grown_capacity(arr->capacity, owner->first_capacity);
+			void *new_group = _sparse_realloc(arr->group, new_capacity * FULL_ELEM_SIZE);
+			if (new_group == NULL)
+				return 0;
+			arr->group = new_group;
+			arr->capacity = new_capacity;
+		}
 
 		/* Now take all of the old items and move them up a slot: */
 		if (to_move_siz > 0) {
-			memmove((unsigned char *)(new_group) + ((offset + 1) * FULL_ELEM_SIZE),
-					(unsigned char *)(new_group) + (offset * FULL_ELEM_SIZE),
+			memmove((unsigned char *)(arr->group) + ((offset + 1) * FULL_ELEM_SIZE),
+					(unsigned char *)(arr->group) + (offset * FULL_ELEM_SIZE),
 					to_move_siz);
 		}
 
-		/* Increase the bucket count because we've expanded: */
-		arr->count++;
-		arr->group = new_group;
 		/* Remember to modify the bitmap: */
 		set_position(arr->bitmap, i);
 	}
 
-	/* Copy the size into the position, fighting -pedantic the whole
-	 * time.
-	 */
-	destination = (unsigned char *)(arr->group) + (offset * FULL_ELEM_SIZE);
-	memcpy(destination, &vlen, sizeof(vlen));
-
-	/* Here we mutate a variable because we're writing C and we don't respect
-	 * anything.
+	/* Copy the size into the position, if we're keeping it, and then the
+	 * thing itself, fighting -pedantic the whole time.
 	 */
-	destination = (unsigned char *)destination + sizeof(vlen);
-	memcpy(destination, val, vlen);
+	_element_write(owner, arr->group, offset, val, vlen);
 
 	return 1;
 }
 
-static const void *_sparse_array_group_get(struct sparse_array_group *arr,
+static const void *_sparse_array_group_get(const struct sparse_array *owner, struct sparse_array_group *arr,
 							 const uint32_t i, size_t *outsize) {
 	const uint32_t offset = position_to_offset(arr->bitmap, i);
-	const unsigned char *item_siz = (unsigned char *)(arr->group) + (offset * FULL_ELEM_SIZE);
-	const void *item = item_siz + sizeof(size_t);
+	size_t item_len = 0;
 
 	if (!is_position_occupied(arr->bitmap, i))
 		return NULL;
@@ -160,28 +697,170 @@ static const void *_sparse_array_group_get(struct sparse_array_group *arr,
 	/* In a perfect world you could store 0 sized items and have that mean
 	 * something, but I'll tolerate none of that right now.
 	 */
-	if (*(size_t *)item_siz == 0)
+	item_len = _element_len(owner, arr->group, offset);
+	if (item_len == 0)
 		return NULL;
 
 	/* If the user wants to know the size (outsize is non-null), write it
 	 * out.
 	 */
 	if (outsize)
-		memcpy(outsize, item_siz, sizeof(size_t));
+		*outsize = item_len;
+
+	return _element_at(owner, arr->group, offset);
+}
+
+static const int _sparse_array_group_erase(const struct sparse_array *owner, struct sparse_array_group *arr,
+						   const uint32_t i) {
+	const uint32_t offset = position_to_offset(arr->bitmap, i);
+	uint32_t count = 0;
+	size_t to_move_siz = 0;
+	void *new_group = NULL;
+
+	if (!is_position_occupied(arr->bitmap, i))
+		return 0;
+
+	/* This is _sparse_array_group_set backwards: slide everything after us
+	 * down a slot, forget about the last one and clear our bit.
+	 */
+	count = _group_count(arr->bitmap) - 1;
+	to_move_siz = (count - offset) * FULL_ELEM_SIZE;
+	if (to_move_siz > 0) {
+		memmove((unsigned char *)(arr->group) + (offset * FULL_ELEM_SIZE),
+				(unsigned char *)(arr->group) + ((offset + 1) * FULL_ELEM_SIZE),
+				to_move_siz);
+	}
+
+	clear_position(arr->bitmap, i);
+
+	if (count == 0) {
+		_sparse_free(arr->group);
+		arr->group = NULL;
+		arr->capacity = 0;
+		return 1;
+	}
+
+	/* Don't give memory back one element at a time, that's just as bad as
+	 * growing one element at a time. Wait until we're using half of it.
+	 * Shrinking can't really fail, but if it does we just keep the bigger
+	 * block around.
+	 */
+	if (count <= arr->capacity / 2u) {
+		const uint32_t new_capacity = _grown_capacity(count, count);
+		new_group = _sparse_realloc(arr->group, new_capacity * FULL_ELEM_SIZE);
+		if (new_group != NULL) {
+			arr->group = new_group;
+			arr->capacity = new_capacity;
+		}
+	}
+
+	return 1;
+}
+
+/* Groups that lock-free readers can see are never changed in place. The
+ * writer builds the new storage off to the side and swaps it in, bumping
+ * `seq` on either side so that a reader can tell if it caught the bitmap and
+ * the storage pointer halfway. The old storage gets retired, since a reader
+ * could still be in it.
+ */
+static void _sparse_array_group_publish(struct sparse_array_group *arr, void *new_group,
+						const uint32_t new_count, const uint64_t *new_bitmap,
+						struct sparse_epoch *epoch) {
+	void *old_group = arr->group;
+	unsigned int word = 0;
+
+	STORE_RELAXED(&arr->seq, arr->seq + 1);
+	FENCE_RELEASE();
+	STORE_RELEASE(&arr->group, new_group);
+	for (word = 0; word < BITMAP_SIZE; word++)
+		STORE_RELAXED(&arr->bitmap[word], new_bitmap[word]);
+	arr->capacity = new_count;
+	STORE_RELEASE(&arr->seq, arr->seq + 1);
+
+	_epoch_retire(epoch, old_group, _sparse_free);
+}
+
+/* _sparse_array_group_set for groups readers can see. The new storage is
+ * exactly big enough, there's no point leaving room when the next change is
+ * going to copy it anyway.
+ */
+static const int _sparse_array_group_set_shared(const struct sparse_array *owner,
+						   struct sparse_array_group *arr, const uint32_t i,
+						   const void *val, const size_t vlen) {
+	const uint32_t offset = position_to_offset(arr->bitmap, i);
+	const int occupied = is_position_occupied(arr->bitmap, i);
+	const uint32_t count = _group_count(arr->bitmap);
+	const uint32_t new_count = occupied ? count : count + 1;
+	/* Everything after us. It moves up a slot, unless we're replacing something. */
+	const uint32_t after = count - offset - (occupied ? 1 : 0);
+	uint64_t new_bitmap[BITMAP_SIZE];
+	unsigned char *new_group = NULL;
+
+	if (!_element_fits(owner, vlen))
+		return 0;
+	new_group = _sparse_malloc(new_count * FULL_ELEM_SIZE);
+	if (new_group == NULL)
+		return 0;
+
+	if (offset > 0)
+		memcpy(new_group, arr->group, offset * FULL_ELEM_SIZE);
+	if (after > 0)
+		memcpy(new_group + (offset + 1) * FULL_ELEM_SIZE,
+			   (unsigned char *)(arr->group) + (count - after) * FULL_ELEM_SIZE,
+			   after * FULL_ELEM_SIZE);
+	_element_write(owner, new_group, offset, val, vlen);
+
+	memcpy(new_bitmap, arr->bitmap, sizeof(new_bitmap));
+	set_position(new_bitmap, i);
+	_sparse_array_group_publish(arr, new_group, new_count, new_bitmap, owner->epoch);
+	return 1;
+}
+
+static const int _sparse_array_group_erase_shared(const struct sparse_array *owner,
+						   struct sparse_array_group *arr, const uint32_t i) {
+	const uint32_t offset = position_to_offset(arr->bitmap, i);
+	const uint32_t count = _group_count(arr->bitmap);
+	const uint32_t after = count - offset - 1;
+	uint64_t new_bitmap[BITMAP_SIZE];
+	unsigned char *new_group = NULL;
+
+	if (!is_position_occupied(arr->bitmap, i))
+		return 0;
+
+	if (count > 1) {
+		new_group = _sparse_malloc((count - 1) * FULL_ELEM_SIZE);
+		if (new_group == NULL)
+			return 0;
+		if (offset > 0)
+			memcpy(new_group, arr->group, offset * FULL_ELEM_SIZE);
+		if (after > 0)
+			memcpy(new_group + offset * FULL_ELEM_SIZE,
+				   (unsigned char *)(arr->group) + (offset + 1) * FULL_ELEM_SIZE,
+				   after * FULL_ELEM_SIZE);
+	}
 
-	return item;
+	memcpy(new_bitmap, arr->bitmap, sizeof(new_bitmap));
+	clear_position(new_bitmap, i);
+	_sparse_array_group_publish(arr, new_group, count - 1, new_bitmap, owner->epoch);
+	return 1;
 }
 
 static const int _sparse_array_group_free(struct sparse_array_group *arr) {
-	free(arr->group);
+	_sparse_free(arr->group);
+	arr->group = NULL;
+	arr->capacity = 0;
 	return 1;
 }
 
-struct sparse_array *sparse_array_init(const size_t element_size, const uint32_t maximum) {
-	unsigned int i = 0;
+static struct sparse_array *_sparse_array_create(const size_t element_size, const uint32_t maximum,
+												  const size_t stride) {
 	struct sparse_array *arr = NULL;
+	void *groups = NULL;
+
+	select_popcount();
+
 	/* CHECK YOUR SYSCALL RETURNS. Listen to djb. */
-	arr = calloc(1, sizeof(struct sparse_array));
+	arr = _sparse_calloc(1, sizeof(struct sparse_array));
 	if (arr == NULL)
 		return NULL;
 
@@ -193,42 +872,76 @@ struct sparse_array *sparse_array_init(const size_t element_size, const uint32_t
 	 */
 	struct sparse_array stack_array = {
 		.maximum = maximum,
+		.elem_size = element_size,
+		.stride = stride,
+		.first_capacity = 1,
 	};
 
 	memcpy(arr, &stack_array, sizeof(struct sparse_array));
-	arr->groups = calloc(MAX_ARR_SIZE, sizeof(struct sparse_array_group));
-	if (arr->groups == NULL) {
-		free(arr);
-		return NULL;
-	}
 
-	for (i = 0; i < MAX_ARR_SIZE; i++) {
-		struct sparse_array_group *sag = &arr->groups[i];
-		sag->elem_size = element_size;
+	/* Every group header in one block, lined up so that none of them
+	 * straddles a cache line.
+	 */
+	if (_sparse_memalign(&groups, CACHE_LINE_SIZE, MAX_ARR_SIZE * sizeof(struct sparse_array_group)) != 0) {
+		_sparse_free(arr);
+		return NULL;
 	}
+	memset(groups, 0, MAX_ARR_SIZE * sizeof(struct sparse_array_group));
+	arr->groups = groups;
 
 	return arr;
 }
 
+struct sparse_array *sparse_array_init(const size_t element_size, const uint32_t maximum) {
+	return _sparse_array_create(element_size, maximum, element_size + sizeof(size_t));
+}
+
+struct sparse_array *sparse_array_init_fixed(const size_t element_size, const uint32_t maximum) {
+	if (element_size == 0)
+		return NULL;
+	return _sparse_array_create(element_size, maximum, element_size);
+}
+
 const int sparse_array_set(struct sparse_array *arr, const uint32_t i,
 						   const void *val, const size_t vlen) {
 	/* Don't let users set outside the bounds of the array. */
-	if (i > arr->maximum)
+	if (i >= arr->maximum)
 		return 0;
 	/* Since our hashtable is divided into many arrays, we need to pick the one
 	 * relevant to `i` in this case:
 	 */
 	struct sparse_array_group *operating_group = &arr->groups[i / GROUP_SIZE];
 	const int position = i % GROUP_SIZE;
-	return _sparse_array_group_set(operating_group, position, val, vlen);
+	if (arr->epoch != NULL)
+		return _sparse_array_group_set_shared(arr, operating_group, position, val, vlen);
+	return _sparse_array_group_set(arr, operating_group, position, val, vlen);
 }
 
 const void *sparse_array_get(struct sparse_array *arr, const uint32_t i, size_t *outsize) {
-	if (i > arr->maximum)
+	if (i >= arr->maximum)
 		return NULL;
 	struct sparse_array_group *operating_group = &arr->groups[i / GROUP_SIZE];
 	const int position = i % GROUP_SIZE;
-	return _sparse_array_group_get(operating_group, position, outsize);
+	return _sparse_array_group_get(arr, operating_group, position, outsize);
+}
+
+const int sparse_array_erase(struct sparse_array *arr, const uint32_t i) {
+	if (i >= arr->maximum)
+		return 0;
+	struct sparse_array_group *operating_group = &arr->groups[i / GROUP_SIZE];
+	const int position = i % GROUP_SIZE;
+	if (arr->epoch != NULL)
+		return _sparse_array_group_erase_shared(arr, operating_group, position);
+	return _sparse_array_group_erase(arr, operating_group, position);
+}
+
+void sparse_array_hint_density(struct sparse_array *arr, const unsigned int percent) {
+	uint32_t first_capacity = (GROUP_SIZE * percent) / 100;
+	if (first_capacity < 1)
+		first_capacity = 1;
+	if (first_capacity > GROUP_SIZE)
+		first_capacity = GROUP_SIZE;
+	arr->first_capacity = first_capacity;
 }
 
 const int sparse_array_free(struct sparse_array *arr) {
@@ -237,244 +950,3048 @@ const int sparse_array_free(struct sparse_array *arr) {
 		struct sparse_array_group *sag = &arr->groups[i];
 		_sparse_array_group_free(sag);
 	}
-	free(arr->groups);
-	free(arr);
+	_sparse_free(arr->tags);
+	_sparse_free(arr->groups);
+	_sparse_free(arr);
 	return 1;
 }
 
-/* Sparse Dictionary */
-struct sparse_dict *sparse_dict_init() {
-	struct sparse_dict *new = NULL;
-	new = calloc(1, sizeof(struct sparse_dict));
-	if (new == NULL)
-		return NULL;
-
-	new->bucket_max = STARTING_SIZE;
-	new->bucket_count = 0;
-	new->buckets = sparse_array_init(sizeof(struct sparse_bucket), STARTING_SIZE);
-	if (new->buckets == NULL)
-		goto error;
-
-	return new;
-
-error:
-	free(new);
-	return NULL;
+/* Finds the lowest set bit. Only ever called with x != 0. */
+static inline uint32_t _lowest_bit(const uint64_t x) {
+#if defined(__GNUC__)
+	return __builtin_ctzll(x);
+#else
+	return popcount_64((x & -x) - 1);
+#endif
 }
 
-static const int _create_and_insert_new_bucket(
-						struct sparse_array *array, const unsigned int i,
-						const char *key, const size_t klen,
-						const void *value, const size_t vlen,
-						const uint64_t key_hash) {
-	void *copied_value = NULL;
-	char *copied_key = NULL;
+static void _sparse_array_iter_init_at(struct sparse_array_iter *iter,
+							struct sparse_array *arr, const size_t first_group) {
+	iter->arr = arr;
+	iter->group = first_group;
+	iter->word = 0;
+	iter->offset = 0;
+	iter->bits = first_group < MAX_ARR_SIZE ? arr->groups[first_group].bitmap[0] : 0;
+}
 
-	copied_value = malloc(vlen + klen);
-	if (copied_value == NULL)
-		goto error;
-	memcpy(copied_value, value, vlen);
+void sparse_array_iter_init(struct sparse_array_iter *iter, struct sparse_array *arr) {
+	_sparse_array_iter_init_at(iter, arr, 0);
+}
 
-	copied_key = copied_value + vlen;
-	strncpy(copied_key, key, klen);
+const int sparse_array_iter_next(struct sparse_array_iter *iter, uint32_t *i,
+								 const void **val, size_t *vlen) {
+	const struct sparse_array *arr = iter->arr;
 
-	struct sparse_bucket bct = {
-		.key = copied_key,
-		.klen = klen,
-		.val = copied_value,
-		.vlen = vlen,
-		.hash = key_hash
-	};
+	while (1) {
+		const struct sparse_array_group *sag = NULL;
+		const unsigned char *item = NULL;
+		uint32_t position = 0;
+		size_t item_len = 0;
+
+		/* Out of bits in this word? Move on to the next word, or the next
+		 * group. Storage is kept in position order, so the offset just keeps
+		 * counting up until we change groups.
+		 */
+		while (iter->bits == 0) {
+			iter->word++;
+			if (iter->word >= BITMAP_SIZE) {
+				iter->group++;
+				iter->word = 0;
+				iter->offset = 0;
+			}
+			if (iter->group >= MAX_ARR_SIZE)
+				return 0;
+			iter->bits = arr->groups[iter->group].bitmap[iter->word];
+		}
 
-	if (!sparse_array_set(array, i, &bct, sizeof(bct)))
-		goto error;
+		sag = &arr->groups[iter->group];
+		position = iter->word * BITCHUNK_SIZE + _lowest_bit(iter->bits);
+		iter->bits &= iter->bits - 1;
+		item_len = _element_len(arr, sag->group, iter->offset);
+		item = _element_at(arr, sag->group, iter->offset);
+		iter->offset++;
+
+		/* Same deal as _sparse_array_group_get: zero-sized things aren't real. */
+		if (item_len == 0)
+			continue;
+
+		if (i)
+			*i = iter->group * GROUP_SIZE + position;
+		if (val)
+			*val = item;
+		if (vlen)
+			*vlen = item_len;
+		return 1;
+	}
+}
 
+/* Gives `arr` a byte of metadata per slot, a cache line per group. Nothing in
+ * here reads it, it's for the dictionary to keep fingerprints in.
+ */
+static const int _sparse_array_alloc_tags(struct sparse_array *arr) {
+	const size_t tags_siz = MAX_ARR_SIZE * GROUP_SIZE;
+	void *tags = NULL;
+	if (_sparse_memalign(&tags, 64, tags_siz) != 0)
+		return 0;
+	memset(tags, 0, tags_siz);
+	arr->tags = tags;
 	return 1;
+}
 
-error:
-	free(copied_value);
-	return 0;
+/* Sparse Dictionary */
+struct sparse_dict *sparse_dict_init() {
+	return sparse_dict_init_with_hash(NULL);
 }
 
-static const int _rehash_and_grow_table(struct sparse_dict *dict) {
-	/* We've reached our chosen 'rehash the table' point, so
-	 * we need to resize the table now.
-	 */
-	unsigned int i = 0, buckets_rehashed = 0;
-	const size_t new_bucket_max = dict->bucket_max * 2;
-	struct sparse_array *new_buckets = NULL;
+/* The smallest table that holds `count` buckets without tripping
+ * `resize_percent`. Tables are always a power of two so probing can mask.
+ */
+static const size_t _table_size_for(const size_t count, const unsigned int resize_percent) {
+	size_t bucket_max = STARTING_SIZE;
+	while (count * 100 >= bucket_max * resize_percent)
+		bucket_max *= 2;
+	return bucket_max;
+}
 
-	new_buckets = sparse_array_init(sizeof(struct sparse_bucket), new_bucket_max);
-	if (new_buckets == NULL)
-		goto error;
+/* A new, empty table for `dict`, probed however `dict` probes. */
+static struct sparse_array *_dict_table_create(const struct sparse_dict *dict, const size_t bucket_max) {
+	struct sparse_array *buckets = sparse_array_init_fixed(sizeof(struct sparse_bucket), bucket_max);
+	if (buckets == NULL)
+		return NULL;
+	if (!_sparse_array_alloc_tags(buckets)) {
+		sparse_array_free(buckets);
+		return NULL;
+	}
+	buckets->probing = dict->probing;
+	return buckets;
+}
 
-	/* Loop through each bucket and stick it into the new array. */
-	for (i = 0; i < dict->bucket_max; i++) {
-		size_t bucket_siz = 0;
-		const struct sparse_bucket *bucket = sparse_array_get(dict->buckets, i, &bucket_siz);
-
-		if (bucket_siz != 0 && bucket != NULL) {
-			/* We found a bucket. */
-			unsigned int probed_val = 0, num_probes = 0;
-			uint64_t key_hash = bucket->hash;
-			while (1) {
-				/* Quadratically probe along the hash table for an empty slot. */
-				probed_val = QUADRATIC_PROBE(new_bucket_max);
-				size_t current_value_siz = 0;
-				const void *current_value = sparse_array_get(new_buckets, probed_val, &current_value_siz);
-
-				if (current_value_siz == 0 && current_value == NULL)
-					break;
-
-				/* If the following ever happens, there are deeply troubling
-				 * things that no longer make sense in the universe.
-				 */
-				if (num_probes > dict->bucket_count)
-					goto error;
+static struct sparse_dict *_sparse_dict_create(const sparse_hash_fn hash_fn,
+											   const size_t bucket_max) {
+	struct sparse_dict *new = NULL;
+	new = _sparse_calloc(1, sizeof(struct sparse_dict));
+	if (new == NULL)
+		return NULL;
 
-				num_probes++;
-			}
-			if (!sparse_array_set(new_buckets, probed_val,
-						bucket, sizeof(struct sparse_bucket)))
-				goto error;
-			buckets_rehashed++;
-		}
+	new->hash_fn = hash_fn != NULL ? hash_fn : sparse_hash_wy;
+	new->seed = _new_seed(new);
+	new->bucket_max = bucket_max;
+	new->bucket_count = 0;
+	new->shrink_percent = SHRINK_PERCENT;
+	new->resize_percent = RESIZE_PERCENT;
+	new->probing = SPARSE_PROBE_QUADRATIC;
+	new->buckets = _dict_table_create(new, bucket_max);
+	if (new->buckets == NULL) {
+		_sparse_free(new);
+		return NULL;
+	}
 
-		/* Short circuit to see if we can quit early: */
-		if (buckets_rehashed == dict->bucket_count)
-			break;
+	return new;
+}
+
+struct sparse_dict *sparse_dict_init_with_hash(const sparse_hash_fn hash_fn) {
+	return _sparse_dict_create(hash_fn, STARTING_SIZE);
+}
+
+struct sparse_dict *sparse_dict_init_with_capacity(const size_t capacity) {
+	struct sparse_dict *new = _sparse_dict_create(NULL, _table_size_for(capacity, RESIZE_PERCENT));
+	if (new == NULL)
+		return NULL;
+	/* Groups may as well start out about as big as they're going to get. */
+	sparse_array_hint_density(new->buckets, (capacity * 100) / new->bucket_max);
+	return new;
+}
+
+/* Buckets either carry their key and value around with them or point at a
+ * heap allocation holding them. Either way the value comes first and the key
+ * follows it.
+ */
+static inline const int _bucket_is_inline(const struct sparse_bucket *bucket) {
+	return bucket->klen + bucket->vlen <= INLINE_SIZE;
+}
+
+/* Deleted buckets stay in the table as tombstones, so that probe sequences
+ * running through them don't stop early. They're recognizable by a key length
+ * no real key can have, and own nothing.
+ */
+static inline const int _bucket_is_tombstone(const struct sparse_bucket *bucket) {
+	return bucket->klen == TOMBSTONE_KLEN;
+}
+
+static inline unsigned char *_bucket_data(struct sparse_bucket *bucket) {
+	if (_bucket_is_inline(bucket))
+		return bucket->data.bytes;
+	return bucket->data.heap;
+}
+
+static inline const int _bucket_matches(struct sparse_bucket *bucket,
+						const char *key, const size_t klen,
+						const uint64_t key_hash) {
+	return bucket->hash == key_hash && bucket->klen == klen &&
+		memcmp(_bucket_data(bucket) + bucket->vlen, key, klen) == 0;
+}
+
+static void _bucket_free(struct sparse_bucket *bucket) {
+	if (!_bucket_is_inline(bucket) && !_bucket_is_tombstone(bucket))
+		_sparse_free(bucket->data.heap);
+}
+
+/* Every slot in a dictionary's table has a one byte tag next to it: the top
+ * seven bits of the hash with the high bit set for live buckets, TAG_TOMBSTONE
+ * for dead ones. Probing compares tags first, so most slots that aren't what
+ * we're looking for get skipped without loading their bucket. What the tag
+ * says about a slot only counts if its bitmap bit is set.
+ */
+static inline const uint8_t _hash_tag(const uint64_t key_hash) {
+	return (uint8_t)(key_hash >> 57) | 0x80;
+}
+
+/* Tags are written after the slot they describe is filled, and released, so a
+ * lock-free reader that sees a tag sees the bucket that goes with it.
+ */
+static inline void _set_tag(struct sparse_array *array, const unsigned int i, const uint8_t tag) {
+	STORE_RELEASE(&array->tags[i], tag);
+}
+
+/* Frees whatever a bucket that's just been replaced owned, or retires it if
+ * a lock-free reader could still be looking at it.
+ */
+static void _release_bucket(struct sparse_array *array, struct sparse_bucket *bucket) {
+	if (array->epoch != NULL && !_bucket_is_inline(bucket) && !_bucket_is_tombstone(bucket))
+		_epoch_retire(array->epoch, bucket->data.heap, _sparse_free);
+	else
+		_bucket_free(bucket);
+}
+
+static const int _bury_bucket(struct sparse_array *array, const unsigned int i,
+						struct sparse_bucket *bucket) {
+	const struct sparse_bucket tombstone = {
+		.klen = TOMBSTONE_KLEN,
+	};
+	struct sparse_bucket old_bucket = *bucket;
+
+	if (!sparse_array_set(array, i, &tombstone, sizeof(tombstone)))
+		return 0;
+	_set_tag(array, i, TAG_TOMBSTONE);
+	_release_bucket(array, &old_bucket);
+	return 1;
+}
+
+/* Fills in `bct` with a copy of `key` and `value`, or zeroes if `value` is
+ * NULL.
+ */
+static const int _make_bucket(struct sparse_bucket *bct,
+						const char *key, const size_t klen,
+						const void *value, const size_t vlen,
+						const uint64_t key_hash) {
+	unsigned char *destination = NULL;
+
+	bct->klen = klen;
+	bct->vlen = vlen;
+	bct->hash = key_hash;
+
+	/* Small things get built right inside the bucket, which then gets copied
+	 * into the array. Only big things cost us an extra allocation.
+	 */
+	if (_bucket_is_inline(bct)) {
+		destination = bct->data.bytes;
+	} else {
+		bct->data.heap = _sparse_malloc(vlen + klen);
+		if (bct->data.heap == NULL)
+			return 0;
+		destination = bct->data.heap;
 	}
 
-	/* Finally, swap out the old array with the new one: */
-	sparse_array_free(dict->buckets);
-	dict->buckets = new_buckets;
-	dict->bucket_max = new_bucket_max;
+	if (value != NULL)
+		memcpy(destination, value, vlen);
+	else
+		memset(destination, 0, vlen);
+	memcpy(destination + vlen, key, klen);
+	return 1;
+}
+
+static const int _create_and_insert_new_bucket(
+						struct sparse_array *array, const unsigned int i,
+						const char *key, const size_t klen,
+						const void *value, const size_t vlen,
+						const uint64_t key_hash) {
+	struct sparse_bucket bct;
+
+	if (!_make_bucket(&bct, key, klen, value, vlen, key_hash))
+		return 0;
+	if (!sparse_array_set(array, i, &bct, sizeof(bct)))
+		goto error;
+	_set_tag(array, i, _hash_tag(key_hash));
 
 	return 1;
 
 error:
-	if (new_buckets)
-		sparse_array_free(new_buckets);
+	_bucket_free(&bct);
 	return 0;
 }
 
-const int sparse_dict_set(struct sparse_dict *dict,
-						  const char *key, const size_t klen,
-						  const void *value, const size_t vlen) {
-	const uint64_t key_hash = hash_fnv1a(key, klen);
+#ifdef SPARSE_DICT_STATS
+/* Lock-free readers count too, so then the counts have to be atomic. The
+ * rest of the time that'd be most of what counting costs.
+ */
+static void _count_lookup(struct sparse_dict *dict, const unsigned int probes) {
+	struct sparse_dict_counters *counters = &dict->counters;
+	const unsigned int i = probes < SPARSE_PROBE_HISTOGRAM_SIZE ? probes : SPARSE_PROBE_HISTOGRAM_SIZE - 1;
+	if (dict->epoch != NULL) {
+		COUNTER_ADD(&counters->lookups, 1);
+		COUNTER_ADD(&counters->lookup_probes[i], 1);
+	} else {
+		counters->lookups++;
+		counters->lookup_probes[i]++;
+	}
+}
+#endif
+
+#ifdef SPARSE_CHECK_HASHES
+/* A hash that doesn't match what hash_fn would've said sends the key to the
+ * wrong bucket, and nothing downstream can tell: gets miss, sets go in twice.
+ * So stop right there instead.
+ */
+static void _check_hash(struct sparse_dict *dict, const char *key, const size_t klen,
+						const uint64_t key_hash) {
+	if (dict->hash_fn(key, klen, dict->seed) != key_hash) {
+		fprintf(stderr, "simple_sparsehash: hash %" PRIx64 " for a %zu byte key isn't what hash_fn gives it.\n",
+				key_hash, klen);
+		abort();
+	}
+}
+#endif
+
+/* Finds the slot holding `key` in `array`, or the slot it should be put in if
+ * it isn't there: the first tombstone on its probe sequence, or failing that
+ * the empty slot the sequence ended on. Returns the bucket if we found one.
+ * Slots below `skip_below` belong to groups that have already been migrated
+ * out of this table: their bitmaps are still intact, so we treat them as
+ * occupied by somebody else and keep walking, but their storage is gone.
+ */
+static struct sparse_bucket *_table_lookup(struct sparse_array *array,
+						const size_t bucket_max, const size_t max_probes,
+						const char *key, const size_t klen,
+						const uint64_t key_hash, const size_t skip_below,
+						unsigned int *slot, int *slot_is_tombstone, unsigned int *probes) {
 	unsigned int num_probes = 0;
+	int found_tombstone = 0;
+	const uint8_t tag = _hash_tag(key_hash);
+
+	*slot = bucket_max;
+	*slot_is_tombstone = 0;
 
-	/* First check the array to see if we have an object already stored in
-	 * 'out' position.
-	 */
 	while (1) {
-		size_t current_value_siz = 0;
-		/* Use quadratic probing here to insert into the table.
+		/* Use quadratic probing here to insert into the table, unless the
+		 * dictionary asked for something else.
 		 * Further reading: https://en.wikipedia.org/wiki/Quadratic_probing
 		 */
-		const unsigned int probed_val = QUADRATIC_PROBE(dict->bucket_max);
-		const void *current_value = sparse_array_get(dict->buckets, probed_val, &current_value_siz);
+		const unsigned int probed_val = PROBE(array->probing, bucket_max);
+		const struct sparse_array_group *sag = &array->groups[probed_val / GROUP_SIZE];
+
+		if (probed_val >= skip_below) {
+			if (!is_position_occupied(sag->bitmap, probed_val % GROUP_SIZE)) {
+				/* We found nothing where we expected something. */
+				if (!found_tombstone)
+					*slot = probed_val;
+				*probes = num_probes;
+				return NULL;
+			}
 
-		if (current_value_siz == 0 && current_value == NULL) {
-			/* Awesome, the slot we want is empty. Insert as normal. */
-			if (_create_and_insert_new_bucket(dict->buckets, probed_val, key, klen, value, vlen, key_hash))
-				break;
-			else
-				goto error;
-		} else {
-			/* We found a bucket. Check to see if it has the same key as we do. */
-			struct sparse_bucket *existing_bucket = (struct sparse_bucket *)current_value;
-			const size_t lrgr_key = existing_bucket->klen > klen ? existing_bucket->klen : klen;
-			if (existing_bucket->hash == key_hash && strncmp(existing_bucket->key, key, lrgr_key) == 0) {
-				/* Great, we probed along the hashtable and found a bucket with the same key as
-				 * the key we want to insert. Replace it. */
-				char *existing_key = existing_bucket->key;
-				void *existing_val = existing_bucket->val;
-				if (_create_and_insert_new_bucket(dict->buckets, probed_val, key, klen, value, vlen, key_hash)) {
-					/* We return here because we don't want to execute the 'resize the table'
-					 * logic. We overwrote a bucket instead of adding a new one, so we know
-					 * we don't need to resize anything.
-					 */
-					free(existing_key);
-					free(existing_val);
-					return 1;
-				} else {
-					goto error;
+			if (array->tags[probed_val] == TAG_TOMBSTONE) {
+				/* Somebody used to live here. Remember it in case we want to
+				 * move in, but whoever we're looking for could be further on.
+				 */
+				if (!found_tombstone) {
+					found_tombstone = 1;
+					*slot = probed_val;
+					*slot_is_tombstone = 1;
+				}
+			} else if (array->tags[probed_val] == tag) {
+				/* The tag only tells us this might be it. We have to compare
+				 * keys here because we use open addressing. The value we pull
+				 * from the underlying array could be anything.
+				 */
+				struct sparse_bucket *existing_bucket =
+					(struct sparse_bucket *)sparse_array_get(array, probed_val, NULL);
+				if (_bucket_matches(existing_bucket, key, klen, key_hash)) {
+					*slot = probed_val;
+					*slot_is_tombstone = 0;
+					*probes = num_probes;
+					return existing_bucket;
 				}
 			}
 		}
 
 		num_probes++;
 
-		if (num_probes > dict->bucket_count) {
-			/* If this ever happens something has gone very, very wrong.
-			 * The hash table is full.
-			 */
-			printf("Could not find an open slot in the table.\n");
-			goto error;
+		/* If this ever happens something has gone very, very wrong.
+		 * The hash table is full.
+		 */
+		if (num_probes > max_probes) {
+			*probes = num_probes;
+			return NULL;
 		}
 	}
+}
 
-	dict->bucket_count++;
+/* What a lock-free reader sees in slot `i` of `array`: the bucket there, or
+ * NULL if it's empty. Published storage never changes, so all we need is a
+ * bitmap and a storage pointer that go together, and `seq` tells us whether
+ * we got that.
+ */
+static struct sparse_bucket *_shared_array_get(struct sparse_array *array, const unsigned int i) {
+	const struct sparse_array_group *sag = &array->groups[i / GROUP_SIZE];
+	uint64_t bitmap[BITMAP_SIZE];
+	unsigned char *storage = NULL;
+	uint32_t seq = 0;
+	unsigned int word = 0;
+
+	do {
+		seq = LOAD_ACQUIRE(&sag->seq);
+		for (word = 0; word < BITMAP_SIZE; word++)
+			bitmap[word] = LOAD_RELAXED(&sag->bitmap[word]);
+		storage = LOAD_ACQUIRE(&sag->group);
+		FENCE_ACQUIRE();
+	} while ((seq & 1) || LOAD_RELAXED(&sag->seq) != seq);
+
+	if (!is_position_occupied(bitmap, i % GROUP_SIZE))
+		return NULL;
+	return (struct sparse_bucket *)_element_at(array, storage, position_to_offset(bitmap, i % GROUP_SIZE));
+}
+
+/* _table_lookup for lock-free readers. A slot's tag is only set once it's
+ * been filled, and slots never go back to being empty, so a zero tag means
+ * the probe sequence ends here: nothing that was in the table before this
+ * slot got filled can be any further along.
+ */
+static struct sparse_bucket *_shared_table_lookup(struct sparse_array *array,
+						const char *key, const size_t klen,
+						const uint64_t key_hash, unsigned int *probes) {
+	const size_t bucket_max = array->maximum;
+	const uint8_t tag = _hash_tag(key_hash);
+	unsigned int num_probes = 0;
+
+	for (num_probes = 0; num_probes < bucket_max; num_probes++) {
+		const unsigned int probed_val = PROBE(array->probing, bucket_max);
+		const uint8_t slot_tag = LOAD_ACQUIRE(&array->tags[probed_val]);
+
+		if (slot_tag == 0)
+			break;
+		if (slot_tag == tag) {
+			struct sparse_bucket *bucket = _shared_array_get(array, probed_val);
+			if (bucket != NULL && _bucket_matches(bucket, key, klen, key_hash)) {
+				*probes = num_probes;
+				return bucket;
+			}
+		}
+	}
+
+	*probes = num_probes;
+	return NULL;
+}
+
+/* Lookups stop once they've gone as far as anything was ever put. */
+static inline void _note_probes(struct sparse_array *array, const unsigned int probes) {
+	if (probes > array->max_probe)
+		array->max_probe = probes;
+}
+
+/* Robin Hood insertion. Walking along from where `bucket` hashes to, whoever
+ * is further from home gets the slot, and whoever loses carries on walking.
+ * That can only end at the first empty slot along the way, so we claim that
+ * first: overwriting occupied slots never allocates, so once that's worked,
+ * nothing can fail halfway and lose somebody. Where `bucket` itself ended up
+ * goes in `slot`, if that isn't NULL.
+ * Tables probed like this never have tombstones in them. See
+ * _unlink_bucket.
+ */
+static const int _robin_hood_insert(struct sparse_array *array, const size_t bucket_max,
+						const struct sparse_bucket *bucket, unsigned int *slot) {
+	const size_t mask = bucket_max - 1;
+	struct sparse_bucket carry = *bucket;
+	unsigned int distance = 0, end = 0, probed_val = 0;
+	int placed = 0;
+
+	for (end = bucket->hash & mask;
+			is_position_occupied(array->groups[end / GROUP_SIZE].bitmap, end % GROUP_SIZE);
+			end = (end + 1) & mask) {
+		if (++distance >= bucket_max)
+			return 0;
+	}
+	if (!sparse_array_set(array, end, bucket, sizeof(struct sparse_bucket)))
+		return 0;
 
-	/* See if we've hit our 'we should rehash the table' occupancy number: */
-	if (dict->bucket_count / (float)dict->bucket_max >= RESIZE_PERCENT/100.0f)
-		return _rehash_and_grow_table(dict);
+	distance = 0;
+	for (probed_val = bucket->hash & mask; probed_val != end; probed_val = (probed_val + 1) & mask) {
+		struct sparse_bucket *resident =
+			(struct sparse_bucket *)sparse_array_get(array, probed_val, NULL);
+		const unsigned int resident_distance = (probed_val - resident->hash) & mask;
+
+		if (resident_distance < distance) {
+			const struct sparse_bucket evicted = *resident;
+			sparse_array_set(array, probed_val, &carry, sizeof(carry));
+			_set_tag(array, probed_val, _hash_tag(carry.hash));
+			_note_probes(array, distance);
+			if (!placed && slot != NULL)
+				*slot = probed_val;
+			placed = 1;
+			carry = evicted;
+			distance = resident_distance;
+		}
+		distance++;
+	}
 
+	sparse_array_set(array, end, &carry, sizeof(carry));
+	_set_tag(array, end, _hash_tag(carry.hash));
+	_note_probes(array, distance);
+	if (!placed && slot != NULL)
+		*slot = end;
 	return 1;
+}
 
-error:
-	return 0;
+/* Takes the bucket in `hole` out of a linearly probed table without leaving a
+ * tombstone: anything after it that would still be reachable from where it
+ * hashes to gets moved back into the gap, until we get to an empty slot.
+ * This is Knuth's Algorithm R, and it's why Robin Hood tables never need
+ * tombstones. The caller frees whatever the bucket owned.
+ */
+static const int _unlink_bucket(struct sparse_array *array, const size_t bucket_max, unsigned int hole) {
+	const size_t mask = bucket_max - 1;
+	unsigned int j = hole;
+
+	while (1) {
+		struct sparse_bucket bucket;
+		unsigned int home = 0;
+
+		j = (j + 1) & mask;
+		if (!is_position_occupied(array->groups[j / GROUP_SIZE].bitmap, j % GROUP_SIZE))
+			break;
+		bucket = *(const struct sparse_bucket *)sparse_array_get(array, j, NULL);
+		home = bucket.hash & mask;
+		/* If it hashes somewhere between the hole and where it is, it's fine
+		 * where it is.
+		 */
+		if (hole <= j ? (hole < home && home <= j) : (hole < home || home <= j))
+			continue;
+		sparse_array_set(array, hole, &bucket, sizeof(bucket));
+		_set_tag(array, hole, _hash_tag(bucket.hash));
+		hole = j;
+	}
+
+	if (!sparse_array_erase(array, hole))
+		return 0;
+	_set_tag(array, hole, 0);
+	return 1;
 }
 
-const void *sparse_dict_get(struct sparse_dict *dict, const char *key,
-							const size_t klen, size_t *outsize) {
-	const uint64_t key_hash = hash_fnv1a(key, klen);
-	unsigned int num_probes = 0;
+/* Rehashing copies buckets as-is, they already know their hash. Where it
+ * went ends up in `slot`, if that isn't NULL.
+ */
+static const int _table_insert_bucket(struct sparse_array *array,
+						const size_t bucket_max, const size_t max_probes,
+						const struct sparse_bucket *bucket, unsigned int *slot) {
+	unsigned int probed_val = 0, num_probes = 0;
+	const uint64_t key_hash = bucket->hash;
+
+	if (array->probing == SPARSE_PROBE_ROBIN_HOOD)
+		return _robin_hood_insert(array, bucket_max, bucket, slot);
 
 	while (1) {
-		size_t current_value_siz = 0;
-		const unsigned int probed_val = QUADRATIC_PROBE(dict->bucket_max);
-		const void *current_value = sparse_array_get(dict->buckets, probed_val, &current_value_siz);
+		/* Probe along the hash table for an empty slot. */
+		probed_val = PROBE(array->probing, bucket_max);
+		if (!is_position_occupied(array->groups[probed_val / GROUP_SIZE].bitmap, probed_val % GROUP_SIZE))
+			break;
 
-		if (current_value_siz != 0 && current_value != NULL) {
-			/* We have to do a string comparison here because we use quadratic probing.
-			 * The value we pulled from the underlying array could be anything.
-			 */
-			struct sparse_bucket *existing_bucket = (struct sparse_bucket *)current_value;
-			const size_t lrgr_key = existing_bucket->klen > klen ? existing_bucket->klen : klen;
-			if (existing_bucket->hash == key_hash && strncmp(existing_bucket->key, key, lrgr_key) == 0) {
-				if (outsize)
-					memcpy(outsize, &existing_bucket->vlen, sizeof(existing_bucket->vlen));
+		/* If the following ever happens, there are deeply troubling
+		 * things that no longer make sense in the universe.
+		 */
+		if (num_probes > max_probes)
+			return 0;
 
-				return existing_bucket->val;
-			}
-		} else {
-			/* We found nothing where we expected something. */
-			return NULL;
+		num_probes++;
+	}
+
+	if (!sparse_array_set(array, probed_val, bucket, sizeof(struct sparse_bucket)))
+		return 0;
+	_set_tag(array, probed_val, _hash_tag(key_hash));
+	_note_probes(array, num_probes);
+	if (slot != NULL)
+		*slot = probed_val;
+	return 1;
+}
+
+/* Walks the live buckets of `array`, starting at `first_group`. */
+static const int _table_iter_next(struct sparse_array_iter *iter,
+								  struct sparse_bucket **bucket) {
+	const void *current_value = NULL;
+	while (sparse_array_iter_next(iter, NULL, &current_value, NULL)) {
+		if (!_bucket_is_tombstone(current_value)) {
+			*bucket = (struct sparse_bucket *)current_value;
+			return 1;
 		}
+	}
+	return 0;
+}
 
-		num_probes++;
+/* A cache keeps its recency bits beside the table rather than in it, one
+ * bitmap per group laid end to end, so they have to be moved along with the
+ * buckets. This makes room for the new table's; the old ones stay around
+ * until the migration's done.
+ */
+static const int _cache_table_replaced(struct sparse_cache *cache, const size_t new_bucket_max) {
+	uint64_t *recent = _sparse_calloc(((new_bucket_max - 1) / GROUP_SIZE + 1) * BITMAP_SIZE, sizeof(uint64_t));
+	if (recent == NULL)
+		return 0;
+	cache->old_recent = cache->recent;
+	cache->recent = recent;
+	return 1;
+}
 
-		if (num_probes > dict->bucket_count)
-			return NULL;
+/* Drops the old table's recency bits, or the new one's if it never happened. */
+static void _cache_migration_done(struct sparse_cache *cache, const int replaced) {
+	if (replaced) {
+		_sparse_free(cache->old_recent);
+	} else {
+		_sparse_free(cache->recent);
+		cache->recent = cache->old_recent;
+	}
+	cache->old_recent = NULL;
+}
+
+/* Moves every bucket in the next group of the old table over to the new one.
+ * The group's storage is freed afterwards but its bitmap stays behind, so
+ * that probe sequences through the old table still walk past it.
+ */
+static const int _migrate_next_group(struct sparse_dict *dict) {
+	struct sparse_array_group *sag = &dict->old_buckets->groups[dict->migrate_group];
+	struct sparse_array_iter iter;
+	uint32_t i = 0;
+	const void *bucket = NULL;
+
+	_sparse_array_iter_init_at(&iter, dict->old_buckets, dict->migrate_group);
+	while (sparse_array_iter_next(&iter, &i, &bucket, NULL) &&
+			i / GROUP_SIZE == dict->migrate_group) {
+		/* Tombstones don't get to come along. Anything that's been used
+		 * lately is still recent in its new home.
+		 */
+		if (!_bucket_is_tombstone(bucket)) {
+			unsigned int slot = 0;
+			if (!_table_insert_bucket(dict->buckets, dict->bucket_max,
+						dict->bucket_count + dict->tombstone_count, bucket, &slot))
+				return 0;
+			if (dict->cache != NULL && is_position_occupied(dict->cache->old_recent, i))
+				set_position(dict->cache->recent, slot);
+		}
+	}
+
+	_sparse_array_group_free(sag);
+	dict->migrate_group++;
+
+	/* That was the last one, so the old table can go. */
+	if (dict->migrate_group * GROUP_SIZE >= dict->old_bucket_max) {
+		sparse_array_free(dict->old_buckets);
+		dict->old_buckets = NULL;
+		dict->old_bucket_max = 0;
+		dict->migrate_group = 0;
+		if (dict->cache != NULL)
+			_cache_migration_done(dict->cache, 1);
+	}
+
+	return 1;
+}
+
+static const int _migrate_groups(struct sparse_dict *dict, const size_t max_groups) {
+	size_t i = 0;
+	for (i = 0; dict->old_buckets != NULL && i < max_groups; i++) {
+		if (!_migrate_next_group(dict))
+			return 0;
+	}
+	return 1;
+}
+
+static const int _finish_migration(struct sparse_dict *dict) {
+	return _migrate_groups(dict, (size_t)-1);
+}
+
+static void _free_table(void *table) {
+	sparse_array_free(table);
+}
+
+/* Copies every live bucket in `from` into `to`, which nobody else can see yet. */
+static const int _copy_buckets(struct sparse_array *from, struct sparse_array *to,
+							   const size_t to_max) {
+	struct sparse_array_iter iter;
+	struct sparse_bucket *bucket = NULL;
+
+	_sparse_array_iter_init_at(&iter, from, 0);
+	while (_table_iter_next(&iter, &bucket)) {
+		if (!_table_insert_bucket(to, to_max, to_max, bucket, NULL))
+			return 0;
+	}
+	return 1;
+}
+
+/* Parallel rehashing.
+ * Workers first split the old table's groups between them and sort every
+ * live bucket by which range of the new table it hashes into. Then each
+ * worker takes some of those ranges and places everything that hashes into
+ * them. Nobody else touches groups in a worker's range, so nothing needs a
+ * lock. A bucket whose probe sequence leaves its range before it finds an
+ * empty slot gets put aside and inserted afterwards, on one thread. Slots
+ * never empty out while we do this, so wherever a bucket ends up, every slot
+ * before it on its probe sequence is full and lookups will find it.
+ */
+struct rehash_list {
+	const struct sparse_bucket	**items;
+	size_t						count;
+	size_t						capacity;
+};
+
+struct rehash_worker {
+	pthread_t				thread;
+	struct sparse_array		*from;
+	struct sparse_array		*to;
+	size_t					to_max;
+	size_t					first_group;		/* The old groups we sort, */
+	size_t					last_group;
+	size_t					first_partition;	/* and the new ranges we fill. */
+	size_t					last_partition;
+	size_t					groups_per_partition;
+	struct rehash_list		*lists;				/* One per partition, of what we sorted. */
+	struct rehash_list		deferred;
+	unsigned int			max_probe;			/* The furthest we put anything. */
+	struct rehash_worker	*workers;
+	unsigned int			worker_count;
+	int						failed;
+};
+
+static const int _rehash_list_push(struct rehash_list *list, const struct sparse_bucket *bucket) {
+	if (list->count == list->capacity) {
+		const size_t new_capacity = list->capacity * 2 + 64;
+		const struct sparse_bucket **new_items =
+			_sparse_realloc(list->items, new_capacity * sizeof(const struct sparse_bucket *));
+		if (new_items == NULL)
+			return 0;
+		list->items = new_items;
+		list->capacity = new_capacity;
+	}
+	list->items[list->count++] = bucket;
+	return 1;
+}
+
+static void *_rehash_sort(void *arg) {
+	struct rehash_worker *worker = arg;
+	struct sparse_array_iter iter;
+	uint32_t i = 0;
+	const void *value = NULL;
+
+	_sparse_array_iter_init_at(&iter, worker->from, worker->first_group);
+	while (sparse_array_iter_next(&iter, &i, &value, NULL) && i / GROUP_SIZE < worker->last_group) {
+		const struct sparse_bucket *bucket = value;
+		size_t home_group = 0;
+		if (_bucket_is_tombstone(bucket))
+			continue;
+		home_group = (bucket->hash & (worker->to_max - 1)) / GROUP_SIZE;
+		if (!_rehash_list_push(&worker->lists[home_group / worker->groups_per_partition], bucket)) {
+			worker->failed = 1;
+			break;
+		}
 	}
+	return NULL;
+}
 
+static void *_rehash_place(void *arg) {
+	struct rehash_worker *worker = arg;
+	const size_t to_max = worker->to_max;
+	size_t partition = 0;
+	unsigned int w = 0;
+	size_t j = 0;
+
+	for (partition = worker->first_partition; partition < worker->last_partition; partition++) {
+		const size_t range_start = partition * worker->groups_per_partition * GROUP_SIZE;
+		const size_t range_end = range_start + worker->groups_per_partition * GROUP_SIZE;
+
+		for (w = 0; w < worker->worker_count; w++) {
+			const struct rehash_list *list = &worker->workers[w].lists[partition];
+			for (j = 0; j < list->count; j++) {
+				const struct sparse_bucket *bucket = list->items[j];
+				const uint64_t key_hash = bucket->hash;
+				unsigned int num_probes = 0;
+
+				while (1) {
+					const unsigned int probed_val = PROBE(worker->to->probing, to_max);
+					if (probed_val < range_start || probed_val >= range_end || num_probes > to_max) {
+						if (!_rehash_list_push(&worker->deferred, bucket))
+							worker->failed = 1;
+						break;
+					}
+					if (!is_position_occupied(worker->to->groups[probed_val / GROUP_SIZE].bitmap,
+											  probed_val % GROUP_SIZE)) {
+						if (sparse_array_set(worker->to, probed_val, bucket, sizeof(struct sparse_bucket)))
+							_set_tag(worker->to, probed_val, _hash_tag(key_hash));
+						else
+							worker->failed = 1;
+						if (num_probes > worker->max_probe)
+							worker->max_probe = num_probes;
+						break;
+					}
+					num_probes++;
+				}
+				if (worker->failed)
+					return NULL;
+			}
+		}
+	}
 	return NULL;
 }
 
-const int sparse_dict_free(struct sparse_dict *dict) {
-	unsigned int i = 0;
-	for (i = 0; i < dict->bucket_max; i++) {
-		size_t current_value_siz = 0;
-		const void *current_value = sparse_array_get(dict->buckets, i, &current_value_siz);
+/* Runs `fn` on every worker, each on its own thread if we can get one. */
+static void _rehash_run(struct rehash_worker *workers, const unsigned int worker_count,
+						void *(*fn)(void *)) {
+	unsigned int w = 0;
+	int *started = _sparse_calloc(worker_count, sizeof(int));
+
+	for (w = 1; w < worker_count; w++) {
+		if (started != NULL && pthread_create(&workers[w].thread, NULL, fn, &workers[w]) == 0)
+			started[w] = 1;
+		else
+			fn(&workers[w]);
+	}
+	/* The calling thread does its share too. */
+	fn(&workers[0]);
+	for (w = 1; w < worker_count; w++) {
+		if (started != NULL && started[w])
+			pthread_join(workers[w].thread, NULL);
+	}
+	_sparse_free(started);
+}
+
+static const int _parallel_copy_buckets(struct sparse_array *from, struct sparse_array *to,
+										const size_t to_max, const unsigned int worker_count) {
+	const size_t from_groups = (from->maximum - 1) / GROUP_SIZE + 1;
+	const size_t to_groups = (to_max - 1) / GROUP_SIZE + 1;
+	struct rehash_worker *workers = NULL;
+	size_t partitions = worker_count * PARTITIONS_PER_WORKER;
+	size_t groups_per_partition = 0;
+	unsigned int w = 0;
+	size_t p = 0, j = 0;
+	int ret = 0;
+
+	if (partitions > to_groups)
+		partitions = to_groups;
+	groups_per_partition = (to_groups - 1) / partitions + 1;
+	partitions = (to_groups - 1) / groups_per_partition + 1;
+
+	workers = _sparse_calloc(worker_count, sizeof(struct rehash_worker));
+	if (workers == NULL)
+		return 0;
+	for (w = 0; w < worker_count; w++) {
+		struct rehash_worker *worker = &workers[w];
+		worker->from = from;
+		worker->to = to;
+		worker->to_max = to_max;
+		worker->first_group = (from_groups * w) / worker_count;
+		worker->last_group = (from_groups * (w + 1)) / worker_count;
+		worker->first_partition = (partitions * w) / worker_count;
+		worker->last_partition = (partitions * (w + 1)) / worker_count;
+		worker->groups_per_partition = groups_per_partition;
+		worker->workers = workers;
+		worker->worker_count = worker_count;
+		worker->lists = _sparse_calloc(partitions, sizeof(struct rehash_list));
+		if (worker->lists == NULL)
+			goto cleanup;
+	}
 
-		if (current_value_siz != 0 && current_value != NULL) {
-			struct sparse_bucket *existing_bucket = (struct sparse_bucket *)current_value;
-			free(existing_bucket->val);
+	_rehash_run(workers, worker_count, _rehash_sort);
+	for (w = 0; w < worker_count; w++) {
+		if (workers[w].failed)
+			goto cleanup;
+	}
+	_rehash_run(workers, worker_count, _rehash_place);
+	for (w = 0; w < worker_count; w++) {
+		if (workers[w].failed)
+			goto cleanup;
+		_note_probes(to, workers[w].max_probe);
+	}
+
+	/* Whatever didn't fit in its own range. */
+	for (w = 0; w < worker_count; w++) {
+		for (j = 0; j < workers[w].deferred.count; j++) {
+			if (!_table_insert_bucket(to, to_max, to_max, workers[w].deferred.items[j], NULL))
+				goto cleanup;
+		}
+	}
+	ret = 1;
+
+cleanup:
+	for (w = 0; w < worker_count; w++) {
+		if (workers[w].lists != NULL) {
+			for (p = 0; p < partitions; p++)
+				_sparse_free(workers[w].lists[p].items);
+		}
+		_sparse_free(workers[w].lists);
+		_sparse_free(workers[w].deferred.items);
+	}
+	_sparse_free(workers);
+	return ret;
+}
+
+/* Makes `new_buckets`, already filled, the table. With lock-free readers
+ * about the old table has to stay exactly as it is until they're done with
+ * it, so it gets retired instead of freed. The buckets' heap allocations
+ * belong to the new table now: either way only the old one's groups go.
+ */
+static void _replace_table(struct sparse_dict *dict, struct sparse_array *new_buckets,
+						   const size_t new_bucket_max) {
+	struct sparse_array *old_buckets = dict->buckets;
+
+	dict->bucket_max = new_bucket_max;
+	dict->tombstone_count = 0;
+	if (dict->epoch != NULL) {
+		/* Nobody could see it while it was filled, so it didn't need copying. */
+		new_buckets->epoch = dict->epoch;
+		STORE_RELEASE(&dict->buckets, new_buckets);
+		_epoch_retire(dict->epoch, old_buckets, _free_table);
+	} else {
+		dict->buckets = new_buckets;
+		sparse_array_free(old_buckets);
+	}
+}
+
+static const int _rebuild_table(struct sparse_dict *dict, const size_t new_bucket_max) {
+	/* This allocates the new table and makes the current one the 'old'
+	 * table. Unless we're doing things incrementally, everything gets moved
+	 * over right away. Either way the tombstones get left behind.
+	 */
+	struct sparse_array *new_buckets = NULL;
+
+	/* We never have more than two tables going at once. */
+	if (!_finish_migration(dict))
+		return 0;
+
+	new_buckets = _dict_table_create(dict, new_bucket_max);
+	if (new_buckets == NULL)
+		return 0;
+	/* We know roughly how full the new groups are going to be. */
+	sparse_array_hint_density(new_buckets, (dict->bucket_count * 100) / new_bucket_max);
+	if (dict->cache != NULL && !_cache_table_replaced(dict->cache, new_bucket_max)) {
+		sparse_array_free(new_buckets);
+		return 0;
+	}
+
+	/* Big tables get copied across by several threads. With lock-free
+	 * readers, the old table can't be migrated out of in place, so it gets
+	 * copied too. Robin Hood tables don't split up: workers only ever put
+	 * things in empty slots, and the ordering needs buckets displaced.
+	 */
+	const int parallel = dict->rehash_threads > 1 && dict->bucket_count >= PARALLEL_REHASH_MIN &&
+		new_buckets->probing != SPARSE_PROBE_ROBIN_HOOD;
+	if ((parallel && !dict->incremental) || dict->epoch != NULL) {
+		const int copied = parallel ?
+			_parallel_copy_buckets(dict->buckets, new_buckets, new_bucket_max, dict->rehash_threads) :
+			_copy_buckets(dict->buckets, new_buckets, new_bucket_max);
+		/* Copies don't say where anything went, so recency starts over. */
+		if (dict->cache != NULL)
+			_cache_migration_done(dict->cache, copied);
+		if (!copied) {
+			sparse_array_free(new_buckets);
+			return 0;
 		}
+		_replace_table(dict, new_buckets, new_bucket_max);
+		return 1;
 	}
+
+	dict->old_buckets = dict->buckets;
+	dict->old_bucket_max = dict->bucket_max;
+	dict->migrate_group = 0;
+	dict->buckets = new_buckets;
+	dict->bucket_max = new_bucket_max;
+	dict->tombstone_count = 0;
+
+	if (!dict->incremental)
+		return _finish_migration(dict);
+
+	return 1;
+}
+
+static uint64_t _now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Incremental rehashes only get timed for the part that happens up front. */
+static const int _resize_table(struct sparse_dict *dict, const size_t new_bucket_max) {
+	const uint64_t start = _now_ns();
+	const int ret = _rebuild_table(dict, new_bucket_max);
+	if (ret) {
+		dict->counters.rehashes++;
+		dict->counters.rehash_ns += _now_ns() - start;
+	}
+	return ret;
+}
+
+static const int _rehash_and_grow_table(struct sparse_dict *dict) {
+	/* We've reached our chosen 'rehash the table' point. Usually that means
+	 * we need a bigger table, but if it's mostly tombstones that are filling
+	 * it up, a fresh one the same size will do.
+	 */
+	if (dict->bucket_count * 200 >= dict->bucket_max * dict->resize_percent)
+		return _resize_table(dict, dict->bucket_max * 2);
+	return _resize_table(dict, dict->bucket_max);
+}
+
+/* Halve the table for as long as what's left would still be under half of
+ * our resize point, so we don't immediately grow again.
+ */
+static const size_t _shrunk_size(const size_t bucket_count, const size_t bucket_max,
+						const unsigned int resize_percent) {
+	size_t new_bucket_max = bucket_max;
+	while (new_bucket_max / 2 >= STARTING_SIZE &&
+			bucket_count * 200 < (new_bucket_max / 2) * resize_percent)
+		new_bucket_max /= 2;
+	return new_bucket_max;
+}
+
+static const int _shrink_table(struct sparse_dict *dict) {
+	const size_t new_bucket_max = _shrunk_size(dict->bucket_count, dict->bucket_max,
+											   dict->resize_percent);
+	if (new_bucket_max == dict->bucket_max)
+		return 1;
+	return _resize_table(dict, new_bucket_max);
+}
+
+static void _free_buckets_in(struct sparse_array *array, const size_t first_group) {
+	struct sparse_array_iter iter;
+	struct sparse_bucket *bucket = NULL;
+
+	_sparse_array_iter_init_at(&iter, array, first_group);
+	while (_table_iter_next(&iter, &bucket))
+		_bucket_free(bucket);
+	sparse_array_free(array);
+}
+
+/* Images */
+
+/* Where a spilled key and value live in the arena, or NULL if the image says
+ * it's somewhere it can't be.
+ */
+static const unsigned char *_image_bucket_data(const struct sparse_mapping *mapping,
+						const struct sparse_image_bucket *bucket) {
+	if (bucket->klen > INLINE_SIZE || bucket->vlen > INLINE_SIZE - bucket->klen) {
+		if (bucket->klen > mapping->arena_len || bucket->vlen > mapping->arena_len - bucket->klen)
+			return NULL;
+		if (bucket->data.offset > mapping->arena_len - bucket->klen - bucket->vlen)
+			return NULL;
+		return mapping->arena + bucket->data.offset;
+	}
+	return bucket->data.bytes;
+}
+
+/* The bucket stored `offset` buckets into `group`. */
+static const struct sparse_image_bucket *_image_group_bucket(const struct sparse_mapping *mapping,
+						const struct sparse_image_group *group, const uint32_t offset) {
+	uint64_t at = 0;
+	if (group->storage_offset > mapping->storage_len)
+		return NULL;
+	at = group->storage_offset + (uint64_t)offset * sizeof(struct sparse_image_bucket);
+	if (at > mapping->storage_len || mapping->storage_len - at < sizeof(struct sparse_image_bucket))
+		return NULL;
+	return (const struct sparse_image_bucket *)(mapping->storage + at);
+}
+
+/* _table_lookup, for an image. The header has already been checked, but
+ * nothing else has, so everything we follow gets bounds-checked on the way.
+ */
+static const struct sparse_image_bucket *_image_lookup(const struct sparse_mapping *mapping,
+						const size_t bucket_max, const char *key, const size_t klen,
+						const uint64_t key_hash, const unsigned char **data) {
+	const uint8_t tag = _hash_tag(key_hash);
+	const int probing = mapping->header->probing;
+	unsigned int num_probes = 0;
+
+	for (num_probes = 0; num_probes <= mapping->header->max_probe && num_probes < bucket_max; num_probes++) {
+		const unsigned int probed_val = PROBE(probing, bucket_max);
+		const struct sparse_image_group *group = &mapping->groups[probed_val / GROUP_SIZE];
+		const struct sparse_image_bucket *bucket = NULL;
+
+		if (!is_position_occupied(group->bitmap, probed_val % GROUP_SIZE))
+			return NULL;
+		if (mapping->tags[probed_val] != tag)
+			continue;
+
+		bucket = _image_group_bucket(mapping, group,
+				position_to_offset(group->bitmap, probed_val % GROUP_SIZE));
+		if (bucket == NULL)
+			return NULL;
+		if (bucket->hash != key_hash || bucket->klen != klen)
+			continue;
+		*data = _image_bucket_data(mapping, bucket);
+		if (*data != NULL && memcmp(*data + bucket->vlen, key, klen) == 0)
+			return bucket;
+	}
+	return NULL;
+}
+
+/* sparse_array_iter_next, for an image. Skips tombstones. */
+static const int _image_iter_next(struct sparse_array_iter *iter, const struct sparse_mapping *mapping,
+						const struct sparse_image_bucket **bucket) {
+	const size_t num_groups = (mapping->header->bucket_max - 1) / GROUP_SIZE + 1;
+
+	while (1) {
+		while (iter->bits == 0) {
+			iter->word++;
+			if (iter->word >= BITMAP_SIZE) {
+				iter->group++;
+				iter->word = 0;
+				iter->offset = 0;
+			}
+			if (iter->group >= num_groups)
+				return 0;
+			iter->bits = mapping->groups[iter->group].bitmap[iter->word];
+		}
+
+		iter->bits &= iter->bits - 1;
+		*bucket = _image_group_bucket(mapping, &mapping->groups[iter->group], iter->offset++);
+		if (*bucket == NULL)
+			return 0;
+		if ((*bucket)->klen != IMAGE_TOMBSTONE_KLEN)
+			return 1;
+	}
+}
+
+static void _image_iter_init(struct sparse_array_iter *iter, const struct sparse_mapping *mapping) {
+	iter->arr = NULL;
+	iter->group = 0;
+	iter->word = 0;
+	iter->offset = 0;
+	iter->bits = mapping->groups[0].bitmap[0];
+}
+
+static void _unmap_image(struct sparse_mapping *mapping) {
+	munmap((void *)mapping->base, mapping->len);
+	_sparse_free(mapping);
+}
+
+/* Copies an image into a normal table, so it can be changed. Tombstones
+ * don't come along.
+ */
+static const int _thaw_image(struct sparse_dict *dict) {
+	struct sparse_mapping *mapping = dict->mapping;
+	struct sparse_array *buckets = NULL;
+	struct sparse_array_iter iter;
+	const struct sparse_image_bucket *image_bucket = NULL;
+
+	buckets = _dict_table_create(dict, dict->bucket_max);
+	if (buckets == NULL)
+		return 0;
+	sparse_array_hint_density(buckets, (dict->bucket_count * 100) / dict->bucket_max);
+
+	_image_iter_init(&iter, mapping);
+	while (_image_iter_next(&iter, mapping, &image_bucket)) {
+		const unsigned char *data = _image_bucket_data(mapping, image_bucket);
+		struct sparse_bucket bucket = {0};
+
+		if (data == NULL)
+			goto error;
+		bucket.klen = image_bucket->klen;
+		bucket.vlen = image_bucket->vlen;
+		bucket.hash = image_bucket->hash;
+		if (_bucket_is_inline(&bucket)) {
+			memcpy(bucket.data.bytes, data, bucket.klen + bucket.vlen);
+		} else {
+			bucket.data.heap = _sparse_malloc(bucket.klen + bucket.vlen);
+			if (bucket.data.heap == NULL)
+				goto error;
+			memcpy(bucket.data.heap, data, bucket.klen + bucket.vlen);
+		}
+
+		if (!_table_insert_bucket(buckets, dict->bucket_max, dict->bucket_max, &bucket, NULL)) {
+			_bucket_free(&bucket);
+			goto error;
+		}
+	}
+
+	dict->mapping = NULL;
+	dict->buckets = buckets;
+	dict->tombstone_count = 0;
+	_unmap_image(mapping);
+	return 1;
+
+error:
+	_free_buckets_in(buckets, 0);
+	return 0;
+}
+
+/* Everything that changes a dictionary checks this first. Read-only images
+ * can't be changed, copy-on-write ones get copied.
+ */
+static const int _make_writable(struct sparse_dict *dict) {
+	if (dict->mapping == NULL)
+		return 1;
+	if (!(dict->mapping->flags & SPARSE_MMAP_COPY_ON_WRITE))
+		return 0;
+	return _thaw_image(dict);
+}
+
+/* Looks `key` up in the current table and then, if we're in the middle of a
+ * migration, in the part of the old table that hasn't moved yet. Where it
+ * was found goes in `table` and `slot`. If it wasn't found, `slot` and
+ * `is_tombstone` say where in the current table it should go, and `probes`
+ * how far along that is.
+ */
+static struct sparse_bucket *_dict_find(struct sparse_dict *dict,
+						const char *key, const size_t klen, const uint64_t key_hash,
+						struct sparse_array **table, unsigned int *slot,
+						int *is_tombstone, unsigned int *probes) {
+	struct sparse_bucket *existing_bucket = NULL;
+	unsigned int old_slot = 0, old_probes = 0;
+	int old_is_tombstone = 0;
+
+	*table = dict->buckets;
+	existing_bucket = _table_lookup(dict->buckets, dict->bucket_max,
+									dict->bucket_count + dict->tombstone_count,
+									key, klen, key_hash, 0, slot, is_tombstone, probes);
+	COUNT_LOOKUP(dict, *probes);
+	if (existing_bucket == NULL && dict->old_buckets != NULL) {
+		existing_bucket = _table_lookup(dict->old_buckets, dict->old_bucket_max, dict->old_buckets->max_probe,
+										key, klen, key_hash, dict->migrate_group * GROUP_SIZE,
+										&old_slot, &old_is_tombstone, &old_probes);
+		if (existing_bucket != NULL) {
+			*table = dict->old_buckets;
+			*slot = old_slot;
+		}
+	}
+	return existing_bucket;
+}
+
+/* Everything that's left to do once we know `key` isn't in `dict` and where
+ * _dict_find says it should go. If `inserted` isn't NULL, it gets the new
+ * bucket, wherever it ended up.
+ */
+static const int _dict_insert(struct sparse_dict *dict,
+						const char *key, const size_t klen,
+						const void *value, const size_t vlen,
+						const uint64_t key_hash, unsigned int slot,
+						const int is_tombstone, const unsigned int probes,
+						struct sparse_bucket **inserted) {
+	unsigned int num_probes = 0;
+
+	if (slot >= dict->bucket_max) {
+		printf("Could not find an open slot in the table.\n");
+		goto error;
+	}
+
+	if (dict->buckets->probing == SPARSE_PROBE_ROBIN_HOOD) {
+		/* Robin Hood tables decide for themselves where things go. */
+		struct sparse_bucket new_bucket;
+		if (!_make_bucket(&new_bucket, key, klen, value, vlen, key_hash))
+			goto error;
+		if (!_robin_hood_insert(dict->buckets, dict->bucket_max, &new_bucket, &slot)) {
+			_bucket_free(&new_bucket);
+			goto error;
+		}
+	} else {
+		/* Awesome, the slot we want is empty (or dead). Insert as normal. */
+		if (!_create_and_insert_new_bucket(dict->buckets, slot, key, klen, value, vlen, key_hash))
+			goto error;
+		_note_probes(dict->buckets, probes);
+	}
+
+	dict->bucket_count++;
+	if (is_tombstone)
+		dict->tombstone_count--;
+
+	/* See if we've hit our 'we should rehash the table' occupancy number.
+	 * Tombstones count, they make probe sequences just as long.
+	 */
+	if ((dict->bucket_count + dict->tombstone_count) / (float)dict->bucket_max >= dict->resize_percent/100.0f) {
+		struct sparse_array *table = NULL;
+		int ignored = 0;
+
+		if (!_rehash_and_grow_table(dict))
+			goto error;
+		/* Everything's moved, so it has to be found all over again. Only
+		 * one insert in a great many gets here.
+		 */
+		if (inserted != NULL)
+			*inserted = _dict_find(dict, key, klen, key_hash, &table, &slot, &ignored, &num_probes);
+		return 1;
+	}
+
+	if (inserted != NULL)
+		*inserted = (struct sparse_bucket *)sparse_array_get(dict->buckets, slot, NULL);
+	return 1;
+
+error:
+	return 0;
+}
+
+static const int _sparse_dict_set(struct sparse_dict *dict,
+						  const char *key, const size_t klen,
+						  const void *value, const size_t vlen,
+						  const uint64_t key_hash) {
+	unsigned int slot = 0, probes = 0;
+	int is_tombstone = 0;
+	struct sparse_array *table = NULL;
+	struct sparse_bucket *existing_bucket = NULL;
+
+	if (!_make_writable(dict))
+		goto error;
+
+	/* Pay off a little bit of any resize that's in progress. */
+	if (!_migrate_groups(dict, REHASH_GROUPS_PER_SET))
+		goto error;
+
+	/* First check the array to see if we have an object already stored in
+	 * 'out' position. If we're in the middle of a migration it could also be
+	 * in a part of the old table that we haven't gotten to yet.
+	 */
+	existing_bucket = _dict_find(dict, key, klen, key_hash, &table, &slot, &is_tombstone, &probes);
+	if (existing_bucket != NULL) {
+		/* Great, we probed along the hashtable and found a bucket with the same key as
+		 * the key we want to insert. Replace it. If the new value is the same size,
+		 * it goes right where the old one was: the key hasn't changed, so neither
+		 * has whether it all fits in the bucket. Readers might be looking at it
+		 * though, and they get a new bucket.
+		 * Otherwise the old bucket gets overwritten in place, so hang on to a copy
+		 * to free whatever it pointed at. If it was in the old table, it'll get
+		 * moved along with its group.
+		 */
+		struct sparse_bucket old_bucket = *existing_bucket;
+		if (existing_bucket->vlen == vlen && dict->epoch == NULL) {
+			memcpy(_bucket_data(existing_bucket), value, vlen);
+			return 1;
+		}
+		if (!_create_and_insert_new_bucket(table, slot, key, klen, value, vlen, key_hash))
+			goto error;
+		/* We return here because we don't want to execute the 'resize the table'
+		 * logic. We overwrote a bucket instead of adding a new one, so we know
+		 * we don't need to resize anything.
+		 */
+		_release_bucket(table, &old_bucket);
+		return 1;
+	}
+
+	return _dict_insert(dict, key, klen, value, vlen, key_hash, slot, is_tombstone, probes, NULL);
+
+error:
+	return 0;
+}
+
+/* Finds `key`, putting it in with `vlen` bytes of `value` if it isn't there,
+ * or zeroes if `value` is NULL. One probe either way, unless adding it made
+ * the table grow.
+ */
+static struct sparse_bucket *_sparse_dict_find_or_insert(struct sparse_dict *dict,
+						const char *key, const size_t klen,
+						const void *value, const size_t vlen,
+						const uint64_t key_hash, int *inserted) {
+	unsigned int slot = 0, probes = 0;
+	int is_tombstone = 0;
+	struct sparse_array *table = NULL;
+	struct sparse_bucket *bucket = NULL;
+
+	*inserted = 0;
+	/* Readers would see whatever gets done to the value half-done. */
+	if (dict->epoch != NULL)
+		return NULL;
+	if (!_make_writable(dict))
+		return NULL;
+	if (!_migrate_groups(dict, REHASH_GROUPS_PER_SET))
+		return NULL;
+
+	bucket = _dict_find(dict, key, klen, key_hash, &table, &slot, &is_tombstone, &probes);
+	if (bucket != NULL)
+		return bucket;
+	if (!_dict_insert(dict, key, klen, value, vlen, key_hash, slot, is_tombstone, probes, &bucket))
+		return NULL;
+	*inserted = 1;
+	return bucket;
+}
+
+const int sparse_dict_set(struct sparse_dict *dict,
+						  const char *key, const size_t klen,
+						  const void *value, const size_t vlen) {
+	return _sparse_dict_set(dict, key, klen, value, vlen, dict->hash_fn(key, klen, dict->seed));
+}
+
+const int sparse_dict_set_hashed(struct sparse_dict *dict,
+								 const char *key, const size_t klen,
+								 const void *value, const size_t vlen,
+								 const uint64_t key_hash) {
+	CHECK_HASH(dict, key, klen, key_hash);
+	return _sparse_dict_set(dict, key, klen, value, vlen, key_hash);
+}
+
+const int sparse_dict_upsert(struct sparse_dict *dict, const char *key, const size_t klen,
+							 const size_t vlen, sparse_upsert_fn callback, void *ctx) {
+	int inserted = 0;
+	struct sparse_bucket *bucket = _sparse_dict_find_or_insert(dict, key, klen, NULL, vlen,
+			dict->hash_fn(key, klen, dict->seed), &inserted);
+	if (bucket == NULL)
+		return 0;
+	callback(_bucket_data(bucket), bucket->vlen, inserted, ctx);
+	return 1;
+}
+
+void *sparse_dict_get_or_insert(struct sparse_dict *dict, const char *key, const size_t klen,
+								const void *value, const size_t vlen, size_t *outsize) {
+	int inserted = 0;
+	struct sparse_bucket *bucket = _sparse_dict_find_or_insert(dict, key, klen, value, vlen,
+			dict->hash_fn(key, klen, dict->seed), &inserted);
+	if (bucket == NULL)
+		return NULL;
+	if (outsize)
+		*outsize = bucket->vlen;
+	return _bucket_data(bucket);
+}
+
+const int sparse_dict_reserve(struct sparse_dict *dict, const size_t capacity) {
+	const size_t new_bucket_max = _table_size_for(capacity, dict->resize_percent);
+	if (!_make_writable(dict))
+		return 0;
+	if (new_bucket_max <= dict->bucket_max)
+		return 1;
+	return _resize_table(dict, new_bucket_max);
+}
+
+/* What sparse_dict_bulk_load sorts: a hash and where it came from. */
+struct bulk_entry {
+	uint64_t hash;
+	size_t index;
+};
+
+const int sparse_dict_bulk_load(struct sparse_dict *dict,
+								const char **keys, const size_t *klens,
+								const void **values, const size_t *vlens,
+								const size_t count) {
+	struct bulk_entry *entries = NULL, *sorted = NULL;
+	size_t *group_starts = NULL;
+	size_t i = 0, num_groups = 0;
+	int ret = 0;
+
+	/* Size the table once, up front, and do it all at once even if we're
+	 * incremental: we're about to touch every group anyway.
+	 */
+	if (!sparse_dict_reserve(dict, dict->bucket_count + count))
+		return 0;
+	if (!_finish_migration(dict))
+		return 0;
+	/* Nothing to load, and malloc(0) is allowed to hand back NULL. */
+	if (count == 0)
+		return 1;
+	sparse_array_hint_density(dict->buckets,
+			((dict->bucket_count + count) * 100) / dict->bucket_max);
+
+	num_groups = (dict->bucket_max - 1) / GROUP_SIZE + 1;
+	entries = _sparse_malloc(count * sizeof(struct bulk_entry));
+	sorted = _sparse_malloc(count * sizeof(struct bulk_entry));
+	group_starts = _sparse_calloc(num_groups + 1, sizeof(size_t));
+	if (entries == NULL || sorted == NULL || group_starts == NULL)
+		goto cleanup;
+
+	/* Hash everything, then counting-sort it by the group it lands in. The
+	 * sort is stable, so if a key shows up twice the last one still wins.
+	 */
+	for (i = 0; i < count; i++) {
+		entries[i].hash = dict->hash_fn(keys[i], klens[i], dict->seed);
+		entries[i].index = i;
+		group_starts[((entries[i].hash & (dict->bucket_max - 1)) / GROUP_SIZE) + 1]++;
+	}
+	for (i = 0; i < num_groups; i++)
+		group_starts[i + 1] += group_starts[i];
+	for (i = 0; i < count; i++) {
+		const size_t group = (entries[i].hash & (dict->bucket_max - 1)) / GROUP_SIZE;
+		sorted[group_starts[group]++] = entries[i];
+	}
+
+	/* Now fill the table a group at a time. Most things land in the group
+	 * they hash to, so we're only ever working on a couple of groups.
+	 */
+	for (i = 0; i < count; i++) {
+		const size_t index = sorted[i].index;
+		if (!_sparse_dict_set(dict, keys[index], klens[index], values[index], vlens[index],
+							  sorted[i].hash))
+			goto cleanup;
+	}
+	ret = 1;
+
+cleanup:
+	_sparse_free(entries);
+	_sparse_free(sorted);
+	_sparse_free(group_starts);
+	return ret;
+}
+
+static const void *_sparse_dict_get(struct sparse_dict *dict, const char *key,
+							const size_t klen, size_t *outsize,
+							const uint64_t key_hash) {
+	unsigned int probed_val = 0, probes = 0;
+	int is_tombstone = 0;
+	struct sparse_bucket *existing_bucket = NULL;
+
+	if (dict->mapping != NULL) {
+		const unsigned char *data = NULL;
+		const struct sparse_image_bucket *image_bucket = _image_lookup(dict->mapping, dict->bucket_max,
+				key, klen, key_hash, &data);
+		if (image_bucket == NULL)
+			return NULL;
+		if (outsize)
+			*outsize = image_bucket->vlen;
+		return data;
+	}
+
+	if (dict->epoch != NULL) {
+		existing_bucket = _shared_table_lookup(LOAD_ACQUIRE(&dict->buckets), key, klen, key_hash, &probes);
+		COUNT_LOOKUP(dict, probes);
+		if (existing_bucket == NULL)
+			return NULL;
+		if (outsize)
+			*outsize = existing_bucket->vlen;
+		return _bucket_data(existing_bucket);
+	}
+
+	/* Nothing was ever put further along its probe sequence than max_probe,
+	 * so there's no point looking any further than that.
+	 */
+	existing_bucket = _table_lookup(dict->buckets, dict->bucket_max, dict->buckets->max_probe,
+									key, klen, key_hash, 0, &probed_val, &is_tombstone, &probes);
+	COUNT_LOOKUP(dict, probes);
+	/* Until a migration is finished, things might still be in the old table. */
+	if (existing_bucket == NULL && dict->old_buckets != NULL)
+		existing_bucket = _table_lookup(dict->old_buckets, dict->old_bucket_max, dict->old_buckets->max_probe,
+										key, klen, key_hash, dict->migrate_group * GROUP_SIZE,
+										&probed_val, &is_tombstone, &probes);
+
+	if (existing_bucket == NULL)
+		return NULL;
+
+	if (outsize)
+		memcpy(outsize, &existing_bucket->vlen, sizeof(existing_bucket->vlen));
+
+	return _bucket_data(existing_bucket);
+}
+
+const void *sparse_dict_get(struct sparse_dict *dict, const char *key,
+							const size_t klen, size_t *outsize) {
+	return _sparse_dict_get(dict, key, klen, outsize, dict->hash_fn(key, klen, dict->seed));
+}
+
+const void *sparse_dict_get_hashed(struct sparse_dict *dict, const char *key,
+								   const size_t klen, size_t *outsize,
+								   const uint64_t key_hash) {
+	CHECK_HASH(dict, key, klen, key_hash);
+	return _sparse_dict_get(dict, key, klen, outsize, key_hash);
+}
+
+/* Pulls in everything a lookup of `key_hash` is going to touch first: the
+ * group header and tags, then the bucket in the slot it hashes to, then the
+ * bucket's spilled key if it has one. Each stage needs the one before it to
+ * have landed, so the batch functions run a stage for every key in the batch
+ * before moving on to the next. That way the misses for the whole batch
+ * overlap instead of happening one after another.
+ */
+static void _prefetch_group(const struct sparse_array *array, const uint64_t key_hash) {
+	const size_t slot = key_hash & (array->maximum - 1);
+	PREFETCH(&array->groups[slot / GROUP_SIZE]);
+	PREFETCH(&array->tags[slot]);
+}
+
+static const struct sparse_bucket *_prefetch_bucket(const struct sparse_dict *dict,
+													const uint64_t key_hash) {
+	const size_t slot = key_hash & (dict->bucket_max - 1);
+	const struct sparse_array_group *sag = &dict->buckets->groups[slot / GROUP_SIZE];
+	const struct sparse_bucket *bucket = NULL;
+
+	if (!is_position_occupied(sag->bitmap, slot % GROUP_SIZE))
+		return NULL;
+	bucket = (const struct sparse_bucket *)_element_at(dict->buckets, sag->group,
+			position_to_offset(sag->bitmap, slot % GROUP_SIZE));
+	PREFETCH(bucket);
+	return bucket;
+}
+
+static void _prefetch_key(const struct sparse_dict *dict, const struct sparse_bucket *bucket,
+						  const uint64_t key_hash) {
+	if (bucket != NULL && dict->buckets->tags[key_hash & (dict->bucket_max - 1)] == _hash_tag(key_hash) &&
+			!_bucket_is_inline(bucket) && !_bucket_is_tombstone(bucket))
+		PREFETCH(bucket->data.heap);
+}
+
+/* Fills `hashes` in for the `batch` keys starting at `start`, from
+ * `key_hashes` if the caller already has them.
+ */
+static void _batch_hashes(struct sparse_dict *dict, const size_t start, const size_t batch,
+						  const char **keys, const size_t *klens, const uint64_t *key_hashes,
+						  uint64_t *hashes) {
+	size_t i = 0;
+	for (i = 0; i < batch; i++) {
+		if (key_hashes != NULL) {
+			hashes[i] = key_hashes[start + i];
+			CHECK_HASH(dict, keys[start + i], klens[start + i], hashes[i]);
+		} else {
+			hashes[i] = dict->hash_fn(keys[start + i], klens[start + i], dict->seed);
+		}
+	}
+}
+
+static const size_t _sparse_dict_get_many(struct sparse_dict *dict, const size_t count,
+								  const char **keys, const size_t *klens, const uint64_t *key_hashes,
+								  const void **values, size_t *outsizes) {
+	uint64_t hashes[BATCH_SIZE];
+	const struct sparse_bucket *buckets[BATCH_SIZE];
+	size_t start = 0, i = 0, found = 0;
+
+	for (start = 0; start < count; start += BATCH_SIZE) {
+		const size_t batch = count - start < BATCH_SIZE ? count - start : BATCH_SIZE;
+
+		_batch_hashes(dict, start, batch, keys, klens, key_hashes, hashes);
+		/* Images get read straight off the page cache, there's nothing to
+		 * prefetch that the kernel isn't already reading ahead.
+		 */
+		if (dict->mapping == NULL) {
+			for (i = 0; i < batch; i++)
+				_prefetch_group(LOAD_ACQUIRE(&dict->buckets), hashes[i]);
+		}
+		/* Following pointers any further means reading groups, which lock-free
+		 * readers can only do through _shared_array_get.
+		 */
+		if (dict->epoch == NULL && dict->mapping == NULL) {
+			for (i = 0; i < batch; i++)
+				buckets[i] = _prefetch_bucket(dict, hashes[i]);
+			for (i = 0; i < batch; i++)
+				_prefetch_key(dict, buckets[i], hashes[i]);
+		}
+
+		for (i = 0; i < batch; i++) {
+			values[start + i] = _sparse_dict_get(dict, keys[start + i], klens[start + i],
+					outsizes ? &outsizes[start + i] : NULL, hashes[i]);
+			if (values[start + i] != NULL)
+				found++;
+		}
+	}
+
+	return found;
+}
+
+const size_t sparse_dict_get_many(struct sparse_dict *dict, const size_t count,
+								  const char **keys, const size_t *klens,
+								  const void **values, size_t *outsizes) {
+	return _sparse_dict_get_many(dict, count, keys, klens, NULL, values, outsizes);
+}
+
+const size_t sparse_dict_get_many_hashed(struct sparse_dict *dict, const size_t count,
+										 const char **keys, const size_t *klens, const uint64_t *key_hashes,
+										 const void **values, size_t *outsizes) {
+	return _sparse_dict_get_many(dict, count, keys, klens, key_hashes, values, outsizes);
+}
+
+static const int _sparse_dict_set_many(struct sparse_dict *dict, const size_t count,
+							   const char **keys, const size_t *klens, const uint64_t *key_hashes,
+							   const void **values, const size_t *vlens) {
+	uint64_t hashes[BATCH_SIZE];
+	const struct sparse_bucket *buckets[BATCH_SIZE];
+	size_t start = 0, i = 0;
+
+	if (!_make_writable(dict))
+		return 0;
+
+	/* Same as sparse_dict_get_many. A set can grow the table partway through
+	 * a batch, which makes the rest of the prefetching pointless but not
+	 * wrong.
+	 */
+	for (start = 0; start < count; start += BATCH_SIZE) {
+		const size_t batch = count - start < BATCH_SIZE ? count - start : BATCH_SIZE;
+
+		_batch_hashes(dict, start, batch, keys, klens, key_hashes, hashes);
+		for (i = 0; i < batch; i++)
+			_prefetch_group(dict->buckets, hashes[i]);
+		for (i = 0; i < batch; i++)
+			buckets[i] = _prefetch_bucket(dict, hashes[i]);
+		for (i = 0; i < batch; i++)
+			_prefetch_key(dict, buckets[i], hashes[i]);
+
+		for (i = 0; i < batch; i++) {
+			if (!_sparse_dict_set(dict, keys[start + i], klens[start + i],
+						values[start + i], vlens[start + i], hashes[i]))
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+const int sparse_dict_set_many(struct sparse_dict *dict, const size_t count,
+							   const char **keys, const size_t *klens,
+							   const void **values, const size_t *vlens) {
+	return _sparse_dict_set_many(dict, count, keys, klens, NULL, values, vlens);
+}
+
+const int sparse_dict_set_many_hashed(struct sparse_dict *dict, const size_t count,
+									  const char **keys, const size_t *klens, const uint64_t *key_hashes,
+									  const void **values, const size_t *vlens) {
+	return _sparse_dict_set_many(dict, count, keys, klens, key_hashes, values, vlens);
+}
+
+static const int _sparse_dict_delete(struct sparse_dict *dict, const char *key,
+							  const size_t klen, const uint64_t key_hash) {
+	unsigned int probed_val = 0, probes = 0;
+	int is_tombstone = 0;
+	struct sparse_bucket *existing_bucket = NULL;
+
+	if (!_make_writable(dict))
+		return 0;
+	if (!_migrate_groups(dict, REHASH_GROUPS_PER_SET))
+		return 0;
+
+	/* We can't just pull the bucket out of the array, because then anything
+	 * that probed past it to get where it is would become unreachable. So it
+	 * gets replaced with a tombstone instead, unless the table is Robin Hood
+	 * probed and can close the gap up.
+	 */
+	existing_bucket = _table_lookup(dict->buckets, dict->bucket_max, dict->buckets->max_probe,
+									key, klen, key_hash, 0, &probed_val, &is_tombstone, &probes);
+	if (existing_bucket != NULL && dict->buckets->probing == SPARSE_PROBE_ROBIN_HOOD) {
+		struct sparse_bucket old_bucket = *existing_bucket;
+		if (!_unlink_bucket(dict->buckets, dict->bucket_max, probed_val))
+			return 0;
+		_release_bucket(dict->buckets, &old_bucket);
+	} else if (existing_bucket != NULL) {
+		if (!_bury_bucket(dict->buckets, probed_val, existing_bucket))
+			return 0;
+		dict->tombstone_count++;
+	} else if (dict->old_buckets != NULL) {
+		/* Tombstones in the old table go away when their group is migrated,
+		 * so we don't bother counting them.
+		 */
+		existing_bucket = _table_lookup(dict->old_buckets, dict->old_bucket_max, dict->old_buckets->max_probe,
+										key, klen, key_hash, dict->migrate_group * GROUP_SIZE,
+										&probed_val, &is_tombstone, &probes);
+		if (existing_bucket == NULL)
+			return 0;
+		if (!_bury_bucket(dict->old_buckets, probed_val, existing_bucket))
+			return 0;
+	} else {
+		return 0;
+	}
+
+	dict->bucket_count--;
+
+	/* If we've dropped below our low-water mark, give some memory back. */
+	if (dict->shrink_percent > 0 &&
+			dict->bucket_count / (float)dict->bucket_max < dict->shrink_percent/100.0f)
+		_shrink_table(dict);
+
+	return 1;
+}
+
+const int sparse_dict_delete(struct sparse_dict *dict, const char *key,
+							  const size_t klen) {
+	return _sparse_dict_delete(dict, key, klen, dict->hash_fn(key, klen, dict->seed));
+}
+
+const int sparse_dict_delete_hashed(struct sparse_dict *dict, const char *key,
+									const size_t klen, const uint64_t key_hash) {
+	CHECK_HASH(dict, key, klen, key_hash);
+	return _sparse_dict_delete(dict, key, klen, key_hash);
+}
+
+const int sparse_dict_parallel_rehash(struct sparse_dict *dict, const unsigned int threads) {
+	dict->rehash_threads = threads;
+	return 1;
+}
+
+const int sparse_dict_incremental_rehash(struct sparse_dict *dict, const int enabled) {
+	/* Readers can't cope with two tables. */
+	if (enabled && dict->epoch != NULL)
+		return 0;
+	/* Turning it off means we have to finish whatever we started. */
+	if (!enabled && !_finish_migration(dict))
+		return 0;
+	dict->incremental = enabled;
+	return 1;
+}
+
+void sparse_dict_iter_init(struct sparse_dict_iter *iter, struct sparse_dict *dict) {
+	iter->dict = dict;
+	iter->in_old_buckets = 0;
+	if (dict->mapping != NULL)
+		_image_iter_init(&iter->buckets_iter, dict->mapping);
+	else
+		sparse_array_iter_init(&iter->buckets_iter, dict->buckets);
+}
+
+const int sparse_dict_iter_next(struct sparse_dict_iter *iter,
+								const char **key, size_t *klen,
+								const void **value, size_t *vlen) {
+	struct sparse_bucket *bucket = NULL;
+
+	if (iter->dict->mapping != NULL) {
+		const struct sparse_image_bucket *image_bucket = NULL;
+		const unsigned char *data = NULL;
+		if (!_image_iter_next(&iter->buckets_iter, iter->dict->mapping, &image_bucket))
+			return 0;
+		data = _image_bucket_data(iter->dict->mapping, image_bucket);
+		if (data == NULL)
+			return 0;
+		if (key)
+			*key = (const char *)data + image_bucket->vlen;
+		if (klen)
+			*klen = image_bucket->klen;
+		if (value)
+			*value = data;
+		if (vlen)
+			*vlen = image_bucket->vlen;
+		return 1;
+	}
+
+	/* Everything in the current table, then whatever hasn't been migrated
+	 * out of the old one yet.
+	 */
+	if (!iter->in_old_buckets && !_table_iter_next(&iter->buckets_iter, &bucket)) {
+		if (iter->dict->old_buckets == NULL)
+			return 0;
+		iter->in_old_buckets = 1;
+		_sparse_array_iter_init_at(&iter->buckets_iter, iter->dict->old_buckets,
+								   iter->dict->migrate_group);
+	}
+	if (iter->in_old_buckets && !_table_iter_next(&iter->buckets_iter, &bucket))
+		return 0;
+
+	if (key)
+		*key = (const char *)_bucket_data(bucket) + bucket->vlen;
+	if (klen)
+		*klen = bucket->klen;
+	if (value)
+		*value = _bucket_data(bucket);
+	if (vlen)
+		*vlen = bucket->vlen;
+	return 1;
+}
+
+const int sparse_dict_probing(struct sparse_dict *dict, const int probing, const unsigned int resize_percent) {
+	const unsigned int percent = resize_percent != 0 ? resize_percent : RESIZE_PERCENT;
+	size_t new_bucket_max = dict->bucket_max;
+
+	if (probing < SPARSE_PROBE_QUADRATIC || probing > SPARSE_PROBE_ROBIN_HOOD)
+		return 0;
+	/* Past this, probe sequences get long enough that nobody should want it,
+	 * and a completely full table has nowhere to put anything.
+	 */
+	if (percent < 10 || percent > SPARSE_MAX_RESIZE_PERCENT)
+		return 0;
+	if (probing == SPARSE_PROBE_ROBIN_HOOD && dict->epoch != NULL)
+		return 0;
+	if (!_make_writable(dict))
+		return 0;
+
+	dict->probing = probing;
+	dict->resize_percent = percent;
+
+	/* Everything has to be moved to where the new probe sequences expect it,
+	 * so this is a rehash, and while we're at it the table might as well be
+	 * big enough for what's in it.
+	 */
+	while ((dict->bucket_count + 1) * 100 >= new_bucket_max * percent)
+		new_bucket_max *= 2;
+	return _resize_table(dict, new_bucket_max);
+}
+
+const int sparse_dict_concurrent_readers(struct sparse_dict *dict, const int enabled) {
+	size_t i = 0;
+
+	if (!HAVE_ATOMICS)
+		return !enabled;
+
+	if (enabled) {
+		if (dict->epoch != NULL)
+			return 1;
+		/* Robin Hood moves buckets that are already there around, and
+		 * readers could miss one that's in the middle of moving.
+		 */
+		if (dict->probing == SPARSE_PROBE_ROBIN_HOOD)
+			return 0;
+		if (!_make_writable(dict))
+			return 0;
+		if (!sparse_dict_incremental_rehash(dict, 0))
+			return 0;
+		dict->epoch = _epoch_create();
+		if (dict->epoch == NULL)
+			return 0;
+		dict->buckets->epoch = dict->epoch;
+		return 1;
+	}
+
+	if (dict->epoch == NULL)
+		return 1;
+	for (i = 0; i < MAX_READERS; i++) {
+		if (LOAD_ACQUIRE(&dict->epoch->readers[i].in_use))
+			return 0;
+	}
+	_epoch_free(dict->epoch);
+	dict->epoch = NULL;
+	dict->buckets->epoch = NULL;
+	return 1;
+}
+
+struct sparse_reader *sparse_dict_reader_register(struct sparse_dict *dict) {
+	size_t i = 0;
+
+	if (dict->epoch == NULL)
+		return NULL;
+	for (i = 0; i < MAX_READERS; i++) {
+		struct sparse_reader *reader = &dict->epoch->readers[i];
+		uint32_t expected = 0;
+		if (COMPARE_AND_SWAP(&reader->in_use, expected, 1)) {
+			reader->owner = dict->epoch;
+			STORE_RELAXED(&reader->epoch, 0);
+			return reader;
+		}
+	}
+	return NULL;
+}
+
+void sparse_dict_reader_unregister(struct sparse_reader *reader) {
+	STORE_RELEASE(&reader->in_use, 0);
+}
+
+/* An old global epoch just means we hold things up a little longer, but a new
+ * one is only safe if we also see whatever the writer unlinked before moving
+ * it on, hence the acquire (see _epoch_advance). Announcing it has to be
+ * exact too: the fence keeps any of our lookups from happening before the
+ * writer can see that we're here.
+ */
+void sparse_dict_read_begin(struct sparse_reader *reader) {
+	STORE_RELAXED(&reader->epoch, LOAD_ACQUIRE(&reader->owner->global));
+	FENCE_FULL();
+}
+
+void sparse_dict_read_end(struct sparse_reader *reader) {
+	STORE_RELEASE(&reader->epoch, 0);
+}
+
+/* Checksums for images, eight bytes at a time. Everything but the very last
+ * call has to be a multiple of eight long.
+ */
+static uint64_t _image_checksum(uint64_t state, const void *data, const size_t len) {
+	const unsigned char *bytes = data;
+	size_t i = 0;
+
+	for (i = 0; i + 8 <= len; i += 8)
+		state = _mix(state ^ _read64(bytes + i), 0x9e3779b97f4a7c15ULL);
+	if (i < len) {
+		uint64_t tail = 0;
+		memcpy(&tail, bytes + i, len - i);
+		state = _mix(state ^ tail, 0x9e3779b97f4a7c15ULL);
+	}
+	return state;
+}
+
+static const uint64_t _image_align(const uint64_t offset) {
+	return (offset + CACHE_LINE_SIZE - 1) & ~(uint64_t)(CACHE_LINE_SIZE - 1);
+}
+
+static const int _write_all(const int fd, const void *data, size_t len) {
+	const unsigned char *bytes = data;
+	while (len > 0) {
+		const ssize_t written = write(fd, bytes, len);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		bytes += written;
+		len -= written;
+	}
+	return 1;
+}
+
+/* Images get written through a buffer, so that writing one out is a few big
+ * writes instead of one per bucket. The checksum is taken as it goes.
+ */
+struct image_writer {
+	int				fd;
+	unsigned char	*buf;
+	size_t			used;
+	uint64_t		written;	/* Bytes of the image so far, including what's in buf. */
+	uint64_t		checksum;
+	int				failed;
+};
+
+static void _image_flush(struct image_writer *writer) {
+	if (writer->failed)
+		return;
+	writer->checksum = _image_checksum(writer->checksum, writer->buf, writer->used);
+	if (!_write_all(writer->fd, writer->buf, writer->used))
+		writer->failed = 1;
+	writer->used = 0;
+}
+
+static void _image_put(struct image_writer *writer, const void *data, size_t len) {
+	const unsigned char *bytes = data;
+	while (len > 0 && !writer->failed) {
+		const size_t n = len < IMAGE_BUFFER_SIZE - writer->used ? len : IMAGE_BUFFER_SIZE - writer->used;
+		memcpy(writer->buf + writer->used, bytes, n);
+		writer->used += n;
+		writer->written += n;
+		bytes += n;
+		len -= n;
+		if (writer->used == IMAGE_BUFFER_SIZE)
+			_image_flush(writer);
+	}
+}
+
+/* Zeroes up to the next multiple of `align`, which is at most a cache line. */
+static void _image_pad(struct image_writer *writer, const uint64_t align) {
+	static const unsigned char zeroes[CACHE_LINE_SIZE] = {0};
+	_image_put(writer, zeroes, (align - writer->written % align) % align);
+}
+
+const int sparse_dict_save(struct sparse_dict *dict, const int fd) {
+	struct sparse_image_header header;
+	struct image_writer writer = {0};
+	struct sparse_array *arr = NULL;
+	struct sparse_array_iter iter;
+	const void *value = NULL;
+	size_t num_groups = 0, i = 0;
+	uint64_t slots = 0, arena_len = 0, storage_cursor = 0, arena_cursor = 0;
+	int ret = 0;
+
+	/* Saving an image we're reading out of is just copying it. */
+	if (dict->mapping != NULL)
+		return _write_all(fd, dict->mapping->base, dict->mapping->len);
+
+	memset(&header, 0, sizeof(header));
+	if (dict->hash_fn == sparse_hash_wy)
+		header.hash_id = IMAGE_HASH_WY;
+	else if (dict->hash_fn == sparse_hash_fnv1a)
+		header.hash_id = IMAGE_HASH_FNV1A;
+	else
+		return 0;
+	if (!_finish_migration(dict))
+		return 0;
+
+	/* Everything's position in the image has to be known before any of it is
+	 * written, so count first.
+	 */
+	arr = dict->buckets;
+	num_groups = MAX_ARR_SIZE;
+	for (i = 0; i < num_groups; i++)
+		slots += _group_count(arr->groups[i].bitmap);
+	sparse_array_iter_init(&iter, arr);
+	while (sparse_array_iter_next(&iter, NULL, &value, NULL)) {
+		const struct sparse_bucket *bucket = value;
+		if (!_bucket_is_tombstone(bucket) && !_bucket_is_inline(bucket))
+			arena_len += bucket->klen + bucket->vlen;
+	}
+
+	memcpy(header.magic, SPARSE_IMAGE_MAGIC, sizeof(header.magic));
+	header.version = SPARSE_IMAGE_VERSION;
+	header.group_size = GROUP_SIZE;
+	header.inline_size = INLINE_SIZE;
+	header.bucket_size = sizeof(struct sparse_image_bucket);
+	header.probing = arr->probing;
+	header.max_probe = arr->max_probe;
+	header.byte_order = SPARSE_IMAGE_BYTE_ORDER;
+	header.seed = dict->seed;
+	header.bucket_max = dict->bucket_max;
+	header.bucket_count = dict->bucket_count;
+	header.tombstone_count = dict->tombstone_count;
+	header.groups_offset = _image_align(sizeof(header));
+	header.tags_offset = _image_align(header.groups_offset + num_groups * sizeof(struct sparse_image_group));
+	header.storage_offset = _image_align(header.tags_offset + num_groups * GROUP_SIZE);
+	header.arena_offset = _image_align(header.storage_offset + slots * sizeof(struct sparse_image_bucket));
+	header.arena_len = arena_len;
+	header.image_len = ((header.arena_offset + arena_len + 7) & ~(uint64_t)7) + sizeof(uint64_t);
+	header.header_checksum = _image_checksum(0, &header, sizeof(header));
+
+	writer.fd = fd;
+	writer.buf = _sparse_malloc(IMAGE_BUFFER_SIZE);
+	if (writer.buf == NULL)
+		return 0;
+
+	_image_put(&writer, &header, sizeof(header));
+	_image_pad(&writer, CACHE_LINE_SIZE);
+
+	for (i = 0; i < num_groups; i++) {
+		struct sparse_image_group group;
+		group.storage_offset = storage_cursor;
+		memcpy(group.bitmap, arr->groups[i].bitmap, sizeof(group.bitmap));
+		storage_cursor += _group_count(arr->groups[i].bitmap) * sizeof(struct sparse_image_bucket);
+		_image_put(&writer, &group, sizeof(group));
+	}
+	_image_pad(&writer, CACHE_LINE_SIZE);
+
+	_image_put(&writer, arr->tags, num_groups * GROUP_SIZE);
+	_image_pad(&writer, CACHE_LINE_SIZE);
+
+	/* Tombstones get written too, or probes that used to go past them would
+	 * stop short.
+	 */
+	sparse_array_iter_init(&iter, arr);
+	while (sparse_array_iter_next(&iter, NULL, &value, NULL)) {
+		const struct sparse_bucket *bucket = value;
+		struct sparse_image_bucket image_bucket;
+
+		memset(&image_bucket, 0, sizeof(image_bucket));
+		image_bucket.hash = bucket->hash;
+		if (_bucket_is_tombstone(bucket)) {
+			image_bucket.klen = IMAGE_TOMBSTONE_KLEN;
+		} else {
+			image_bucket.klen = bucket->klen;
+			image_bucket.vlen = bucket->vlen;
+			if (_bucket_is_inline(bucket)) {
+				memcpy(image_bucket.data.bytes, bucket->data.bytes, bucket->klen + bucket->vlen);
+			} else {
+				image_bucket.data.offset = arena_cursor;
+				arena_cursor += bucket->klen + bucket->vlen;
+			}
+		}
+		_image_put(&writer, &image_bucket, sizeof(image_bucket));
+	}
+	_image_pad(&writer, CACHE_LINE_SIZE);
+
+	sparse_array_iter_init(&iter, arr);
+	while (sparse_array_iter_next(&iter, NULL, &value, NULL)) {
+		const struct sparse_bucket *bucket = value;
+		if (!_bucket_is_tombstone(bucket) && !_bucket_is_inline(bucket))
+			_image_put(&writer, bucket->data.heap, bucket->klen + bucket->vlen);
+	}
+	_image_pad(&writer, sizeof(uint64_t));
+
+	_image_flush(&writer);
+	if (writer.failed || writer.written + sizeof(uint64_t) != header.image_len)
+		goto cleanup;
+	if (!_write_all(fd, &writer.checksum, sizeof(writer.checksum)))
+		goto cleanup;
+	ret = 1;
+
+cleanup:
+	_sparse_free(writer.buf);
+	return ret;
+}
+
+/* Everything we need to trust about an image before reading anything else
+ * out of it. Sizes get checked before they're added up, so a garbage header
+ * can't overflow its way past the bounds checks.
+ */
+static const int _image_header_ok(const struct sparse_image_header *header, const uint64_t len) {
+	struct sparse_image_header copy = *header;
+	uint64_t num_groups = 0;
+
+	if (memcmp(header->magic, SPARSE_IMAGE_MAGIC, sizeof(header->magic)) != 0)
+		return 0;
+	if (header->byte_order != SPARSE_IMAGE_BYTE_ORDER)
+		return 0;
+	if (header->version != SPARSE_IMAGE_VERSION || header->group_size != GROUP_SIZE ||
+			header->inline_size != INLINE_SIZE || header->bucket_size != sizeof(struct sparse_image_bucket))
+		return 0;
+	copy.header_checksum = 0;
+	if (_image_checksum(0, &copy, sizeof(copy)) != header->header_checksum)
+		return 0;
+	if (header->hash_id != IMAGE_HASH_WY && header->hash_id != IMAGE_HASH_FNV1A)
+		return 0;
+	if (header->probing > SPARSE_PROBE_ROBIN_HOOD)
+		return 0;
+
+	if (header->image_len != len)
+		return 0;
+	/* The tags alone are a byte per bucket. */
+	if (header->bucket_max == 0 || header->bucket_max > len || header->bucket_max > UINT32_MAX ||
+			(header->bucket_max & (header->bucket_max - 1)) != 0)
+		return 0;
+	if (header->bucket_count > header->bucket_max ||
+			header->tombstone_count > header->bucket_max - header->bucket_count)
+		return 0;
+	num_groups = (header->bucket_max - 1) / GROUP_SIZE + 1;
+	if (header->groups_offset < sizeof(*header) || header->groups_offset > len ||
+			header->tags_offset > len || header->storage_offset > len ||
+			header->arena_offset > len || header->arena_len > len)
+		return 0;
+	if (header->groups_offset % sizeof(uint64_t) != 0 || header->storage_offset % sizeof(uint64_t) != 0)
+		return 0;
+	if (header->groups_offset + num_groups * sizeof(struct sparse_image_group) > header->tags_offset ||
+			header->tags_offset + num_groups * GROUP_SIZE > header->storage_offset ||
+			header->storage_offset > header->arena_offset ||
+			header->arena_offset + header->arena_len + sizeof(uint64_t) > len)
+		return 0;
+	return 1;
+}
+
+struct sparse_dict *sparse_dict_open_mmap(const char *path, const int flags) {
+	struct sparse_image_header header;
+	struct sparse_mapping *mapping = NULL;
+	struct sparse_dict *dict = NULL;
+	struct stat st;
+	void *base = MAP_FAILED;
+	int fd = -1;
+
+	/* Mapped tables never make an array, but they count bits all the same. */
+	select_popcount();
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(header))
+		goto error;
+	/* Private, so that nobody changing the file under us can change what
+	 * we've got mapped. It'll still be read lazily.
+	 */
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED)
+		goto error;
+	close(fd);
+	fd = -1;
+
+	memcpy(&header, base, sizeof(header));
+	if (!_image_header_ok(&header, st.st_size))
+		goto error;
+	if (flags & SPARSE_MMAP_VERIFY) {
+		uint64_t trailer = 0;
+		memcpy(&trailer, (const unsigned char *)base + header.image_len - sizeof(trailer), sizeof(trailer));
+		if (_image_checksum(0, base, header.image_len - sizeof(trailer)) != trailer)
+			goto error;
+	}
+
+	mapping = _sparse_calloc(1, sizeof(struct sparse_mapping));
+	dict = _sparse_calloc(1, sizeof(struct sparse_dict));
+	if (mapping == NULL || dict == NULL)
+		goto error;
+
+	mapping->base = base;
+	mapping->len = st.st_size;
+	mapping->flags = flags;
+	mapping->header = base;
+	mapping->groups = (const struct sparse_image_group *)(mapping->base + header.groups_offset);
+	mapping->tags = mapping->base + header.tags_offset;
+	mapping->storage = mapping->base + header.storage_offset;
+	mapping->storage_len = header.arena_offset - header.storage_offset;
+	mapping->arena = mapping->base + header.arena_offset;
+	mapping->arena_len = header.arena_len;
+
+	dict->hash_fn = header.hash_id == IMAGE_HASH_WY ? sparse_hash_wy : sparse_hash_fnv1a;
+	dict->seed = header.seed;
+	dict->bucket_max = header.bucket_max;
+	dict->bucket_count = header.bucket_count;
+	dict->tombstone_count = header.tombstone_count;
+	dict->shrink_percent = SHRINK_PERCENT;
+	dict->resize_percent = RESIZE_PERCENT;
+	dict->probing = header.probing;
+	dict->mapping = mapping;
+	return dict;
+
+error:
+	if (fd >= 0)
+		close(fd);
+	if (base != MAP_FAILED)
+		munmap(base, st.st_size);
+	_sparse_free(mapping);
+	_sparse_free(dict);
+	return NULL;
+}
+
+/* Streams are little-endian on the wire, so they can go between machines. */
+static void _put_le64(unsigned char *p, const uint64_t v) {
+	unsigned int i = 0;
+	for (i = 0; i < 8; i++)
+		p[i] = (unsigned char)(v >> (i * 8));
+}
+
+static uint64_t _get_le64(const unsigned char *p) {
+	uint64_t v = 0;
+	unsigned int i = 0;
+	for (i = 0; i < 8; i++)
+		v |= (uint64_t)p[i] << (i * 8);
+	return v;
+}
+
+/* The header is the magic, the version, and how many records follow. Each
+ * record is the key length, the value length, the key, then the value.
+ */
+const int sparse_dict_dump_stream(struct sparse_dict *dict, FILE *out) {
+	unsigned char header[STREAM_HEADER_SIZE] = {0};
+	struct sparse_dict_iter iter;
+	const char *key = NULL;
+	const void *value = NULL;
+	size_t klen = 0, vlen = 0, written = 0;
+
+	memcpy(header, SPARSE_STREAM_MAGIC, 8);
+	_put_le64(header + 8, SPARSE_STREAM_VERSION);
+	_put_le64(header + 16, dict->bucket_count);
+	if (fwrite(header, sizeof(header), 1, out) != 1)
+		return 0;
+
+	/* The iterator walks groups in memory order, which is as close to the
+	 * order things are stored in as we can get.
+	 */
+	sparse_dict_iter_init(&iter, dict);
+	while (sparse_dict_iter_next(&iter, &key, &klen, &value, &vlen)) {
+		unsigned char record[STREAM_RECORD_HEADER_SIZE];
+		_put_le64(record, klen);
+		_put_le64(record + 8, vlen);
+		if (fwrite(record, sizeof(record), 1, out) != 1)
+			return 0;
+		if (klen > 0 && fwrite(key, klen, 1, out) != 1)
+			return 0;
+		if (vlen > 0 && fwrite(value, vlen, 1, out) != 1)
+			return 0;
+		written++;
+	}
+
+	/* If that didn't match, somebody changed the dictionary under us. */
+	if (written != dict->bucket_count)
+		return 0;
+	return fflush(out) == 0;
+}
+
+const int sparse_dict_load_stream(struct sparse_dict *dict, FILE *in) {
+	unsigned char header[STREAM_HEADER_SIZE];
+	unsigned char *record = NULL;
+	size_t record_siz = 0;
+	uint64_t count = 0, i = 0;
+	int ret = 0;
+
+	if (fread(header, sizeof(header), 1, in) != 1)
+		return 0;
+	if (memcmp(header, SPARSE_STREAM_MAGIC, 8) != 0 || _get_le64(header + 8) != SPARSE_STREAM_VERSION)
+		return 0;
+	count = _get_le64(header + 16);
+
+	/* Tables are indexed with 32 bits, so anything claiming more than that
+	 * isn't something we wrote.
+	 */
+	if (count > UINT32_MAX)
+		return 0;
+	/* A short or corrupt stream could still claim billions, and we'd only
+	 * find out after allocating the table for them. Past a point, let the
+	 * table grow as the records actually show up.
+	 */
+	if (!sparse_dict_reserve(dict, dict->bucket_count +
+				(count < STREAM_PRESIZE_MAX ? count : STREAM_PRESIZE_MAX)))
+		return 0;
+
+	/* One buffer, as big as the biggest record so far. */
+	for (i = 0; i < count; i++) {
+		unsigned char lengths[STREAM_RECORD_HEADER_SIZE];
+		uint64_t klen = 0, vlen = 0;
+
+		if (fread(lengths, sizeof(lengths), 1, in) != 1)
+			goto cleanup;
+		klen = _get_le64(lengths);
+		vlen = _get_le64(lengths + 8);
+		if (klen > SIZE_MAX / 2 || vlen > SIZE_MAX / 2)
+			goto cleanup;
+
+		if (klen + vlen > record_siz) {
+			unsigned char *bigger = _sparse_realloc(record, klen + vlen);
+			if (bigger == NULL)
+				goto cleanup;
+			record = bigger;
+			record_siz = klen + vlen;
+		}
+		if (klen + vlen > 0 && fread(record, klen + vlen, 1, in) != 1)
+			goto cleanup;
+
+		if (!sparse_dict_set(dict, (const char *)record, klen, record + klen, vlen))
+			goto cleanup;
+	}
+	ret = 1;
+
+cleanup:
+	_sparse_free(record);
+	return ret;
+}
+
+/* Adds what `arr` is taking up to `out`, from `first_group` on. Only the
+ * current table gets its groups and displacements looked at, the old one is
+ * on its way out.
+ */
+static void _table_stats(struct sparse_array *arr, const size_t first_group, const int current,
+						 struct sparse_dict_stats *out) {
+	struct sparse_array_iter iter;
+	const void *value = NULL;
+	size_t i = 0;
+	uint32_t slot = 0;
+
+	out->table_bytes += sizeof(struct sparse_array) + MAX_ARR_SIZE * (sizeof(struct sparse_array_group) + GROUP_SIZE);
+	for (i = first_group; i < MAX_ARR_SIZE; i++) {
+		const uint32_t count = _group_count(arr->groups[i].bitmap);
+		out->storage_bytes += arr->groups[i].capacity * arr->stride;
+		out->bucket_bytes += count * sizeof(struct sparse_bucket);
+		if (current)
+			out->group_fill[count]++;
+	}
+
+	_sparse_array_iter_init_at(&iter, arr, first_group);
+	while (sparse_array_iter_next(&iter, &slot, &value, NULL)) {
+		const struct sparse_bucket *bucket = value;
+		const uint64_t key_hash = bucket->hash;
+		unsigned int num_probes = 0;
+
+		if (_bucket_is_tombstone(bucket))
+			continue;
+		if (!_bucket_is_inline(bucket))
+			out->blob_bytes += bucket->klen + bucket->vlen;
+		if (!current)
+			continue;
+
+		/* Follow the probe sequence until we get to where it is. */
+		while (PROBE(arr->probing, arr->maximum) != slot && num_probes < arr->maximum)
+			num_probes++;
+		out->displacement[num_probes < SPARSE_PROBE_HISTOGRAM_SIZE ?
+				num_probes : SPARSE_PROBE_HISTOGRAM_SIZE - 1]++;
+	}
+}
+
+const int sparse_dict_stats(struct sparse_dict *dict, struct sparse_dict_stats *out) {
+	size_t i = 0;
+
+	memset(out, 0, sizeof(*out));
+	out->bucket_max = dict->bucket_max;
+	out->bucket_count = dict->bucket_count;
+	out->tombstone_count = dict->tombstone_count;
+	out->load_factor = dict->bucket_max > 0 ? dict->bucket_count / (double)dict->bucket_max : 0.0;
+	out->rehashes = dict->counters.rehashes;
+	out->rehash_ns = dict->counters.rehash_ns;
+	out->lookups = LOAD_RELAXED(&dict->counters.lookups);
+	for (i = 0; i < SPARSE_PROBE_HISTOGRAM_SIZE; i++)
+		out->lookup_probes[i] = LOAD_RELAXED(&dict->counters.lookup_probes[i]);
+
+	if (dict->mapping != NULL) {
+		const struct sparse_mapping *mapping = dict->mapping;
+		const size_t num_groups = (dict->bucket_max - 1) / GROUP_SIZE + 1;
+		for (i = 0; i < num_groups; i++) {
+			out->group_fill[_group_count(mapping->groups[i].bitmap)]++;
+		}
+		out->table_bytes = num_groups * (sizeof(struct sparse_image_group) + GROUP_SIZE);
+		out->storage_bytes = mapping->storage_len;
+		out->bucket_bytes = mapping->storage_len;
+		out->blob_bytes = mapping->arena_len;
+		out->max_probe = mapping->header->max_probe;
+		return 1;
+	}
+
+	out->max_probe = dict->buckets->max_probe;
+	_table_stats(dict->buckets, 0, 1, out);
+	if (dict->old_buckets != NULL)
+		_table_stats(dict->old_buckets, dict->migrate_group, 0, out);
+	return 1;
+}
+
+const int sparse_dict_free(struct sparse_dict *dict) {
+	if (dict->mapping != NULL) {
+		_unmap_image(dict->mapping);
+		_sparse_free(dict);
+		return 1;
+	}
+	_free_buckets_in(dict->buckets, 0);
+	if (dict->old_buckets != NULL)
+		_free_buckets_in(dict->old_buckets, dict->migrate_group);
+	if (dict->epoch != NULL)
+		_epoch_free(dict->epoch);
+	_sparse_free(dict);
+	return 1;
+}
+
+/* Sharded dictionaries */
+
+/* Which shard a hash belongs to. The top 7 bits of the hash are the slot tag
+ * and the bottom bits pick the slot, so the shard comes out of the middle.
+ * Taking it from either end would leave every key in a shard agreeing on
+ * those bits.
+ */
+static inline size_t _shard_for(const struct sparse_sharded_dict *dict,
+								const uint64_t key_hash) {
+	return (size_t)(key_hash >> 32) & (dict->shard_count - 1);
+}
+
+struct sparse_sharded_dict *sparse_sharded_dict_init(const size_t shard_count) {
+	struct sparse_sharded_dict *new = NULL;
+	void *shards = NULL;
+	size_t i = 0;
+	size_t initialized = 0;
+
+	new = _sparse_calloc(1, sizeof(struct sparse_sharded_dict));
+	if (new == NULL)
+		return NULL;
+
+	new->hash_fn = sparse_hash_wy;
+	new->seed = _new_seed(new);
+	new->shard_count = 1;
+	while (new->shard_count < shard_count)
+		new->shard_count *= 2;
+
+	if (_sparse_memalign(&shards, CACHE_LINE_SIZE,
+				new->shard_count * sizeof(struct sparse_shard)) != 0)
+		goto error;
+	new->shards = shards;
+
+	for (i = 0; i < new->shard_count; i++) {
+		struct sparse_shard *shard = &new->shards[i];
+		shard->dict = _sparse_dict_create(new->hash_fn, STARTING_SIZE);
+		if (shard->dict == NULL)
+			goto error;
+		/* Every shard has to hash the same way we do, since we hand them
+		 * the hash we worked out when picking the shard.
+		 */
+		shard->dict->seed = new->seed;
+		if (pthread_mutex_init(&shard->lock, NULL) != 0) {
+			sparse_dict_free(shard->dict);
+			goto error;
+		}
+		initialized++;
+	}
+
+	return new;
+
+error:
+	for (i = 0; i < initialized; i++) {
+		pthread_mutex_destroy(&new->shards[i].lock);
+		sparse_dict_free(new->shards[i].dict);
+	}
+	_sparse_free(new->shards);
+	_sparse_free(new);
+	return NULL;
+}
+
+const int sparse_sharded_dict_set(struct sparse_sharded_dict *dict,
+								  const char *key, const size_t klen,
+								  const void *value, const size_t vlen) {
+	const uint64_t key_hash = dict->hash_fn(key, klen, dict->seed);
+	struct sparse_shard *shard = &dict->shards[_shard_for(dict, key_hash)];
+	int ret = 0;
+
+	pthread_mutex_lock(&shard->lock);
+	ret = _sparse_dict_set(shard->dict, key, klen, value, vlen, key_hash);
+	pthread_mutex_unlock(&shard->lock);
+	return ret;
+}
+
+const int sparse_sharded_dict_get(struct sparse_sharded_dict *dict,
+								  const char *key, const size_t klen,
+								  void *value, const size_t vlen, size_t *outsize) {
+	const uint64_t key_hash = dict->hash_fn(key, klen, dict->seed);
+	struct sparse_shard *shard = &dict->shards[_shard_for(dict, key_hash)];
+	const void *found = NULL;
+	size_t found_size = 0;
+
+	pthread_mutex_lock(&shard->lock);
+	found = _sparse_dict_get(shard->dict, key, klen, &found_size, key_hash);
+	if (found != NULL && value != NULL)
+		memcpy(value, found, found_size < vlen ? found_size : vlen);
+	pthread_mutex_unlock(&shard->lock);
+
+	if (found == NULL)
+		return 0;
+	if (outsize)
+		*outsize = found_size;
+	return 1;
+}
+
+const int sparse_sharded_dict_delete(struct sparse_sharded_dict *dict,
+									 const char *key, const size_t klen) {
+	const uint64_t key_hash = dict->hash_fn(key, klen, dict->seed);
+	struct sparse_shard *shard = &dict->shards[_shard_for(dict, key_hash)];
+	int ret = 0;
+
+	pthread_mutex_lock(&shard->lock);
+	ret = _sparse_dict_delete(shard->dict, key, klen, key_hash);
+	pthread_mutex_unlock(&shard->lock);
+	return ret;
+}
+
+const size_t sparse_sharded_dict_count(struct sparse_sharded_dict *dict) {
+	size_t i = 0;
+	size_t count = 0;
+
+	for (i = 0; i < dict->shard_count; i++) {
+		pthread_mutex_lock(&dict->shards[i].lock);
+		count += dict->shards[i].dict->bucket_count;
+		pthread_mutex_unlock(&dict->shards[i].lock);
+	}
+	return count;
+}
+
+const int sparse_sharded_dict_free(struct sparse_sharded_dict *dict) {
+	size_t i = 0;
+
+	for (i = 0; i < dict->shard_count; i++) {
+		pthread_mutex_destroy(&dict->shards[i].lock);
+		sparse_dict_free(dict->shards[i].dict);
+	}
+	_sparse_free(dict->shards);
+	_sparse_free(dict);
+	return 1;
+}
+
+/* Caches */
+
+/* A cache can't let its table grow however it likes, so the table gets
+ * charged for the most it can hold before it has to rehash: the group headers,
+ * tags and recency bits, and RESIZE_PERCENT of its slots, whether they're live or
+ * tombstones. Keys and values too big for their bucket are on top of that.
+ */
+#define CACHE_SLOT_COST sizeof(struct sparse_bucket)
+
+static const size_t _cache_blob_cost(const size_t klen, const size_t vlen) {
+	return klen + vlen <= INLINE_SIZE ? 0 : klen + vlen;
+}
+
+static const size_t _cache_table_cost(const size_t bucket_max) {
+	const size_t num_groups = (bucket_max - 1) / GROUP_SIZE + 1;
+	return sizeof(struct sparse_cache) + sizeof(struct sparse_dict) + sizeof(struct sparse_array) +
+		num_groups * (sizeof(struct sparse_array_group) + GROUP_SIZE + BITMAP_SIZE * sizeof(uint64_t)) +
+		bucket_max * RESIZE_PERCENT / 100 * CACHE_SLOT_COST;
+}
+
+struct sparse_cache *sparse_cache_init(const size_t max_bytes) {
+	struct sparse_cache *cache = _sparse_calloc(1, sizeof(struct sparse_cache));
+	if (cache == NULL)
+		return NULL;
+	cache->dict = sparse_dict_init();
+	if (cache->dict == NULL) {
+		_sparse_free(cache);
+		return NULL;
+	}
+	cache->recent = _sparse_calloc(((cache->dict->bucket_max - 1) / GROUP_SIZE + 1) * BITMAP_SIZE,
+								   sizeof(uint64_t));
+	if (cache->recent == NULL) {
+		sparse_dict_free(cache->dict);
+		_sparse_free(cache);
+		return NULL;
+	}
+	cache->dict->cache = cache;
+	cache->max_bytes = max_bytes;
+	return cache;
+}
+
+const size_t sparse_cache_bytes(const struct sparse_cache *cache) {
+	return _cache_table_cost(cache->dict->bucket_max) + cache->blob_bytes;
+}
+
+/* Marks whatever is in `slot` as recently used. */
+static void _cache_touch(struct sparse_cache *cache, const unsigned int slot) {
+	set_position(cache->recent, slot);
+}
+
+/* CLOCK. The hand goes round the table clearing recent bits, and the first
+ * live thing it finds without one gets evicted, until there's `room` bytes
+ * free and at most `max_count` things left. Evicting just buries the bucket
+ * where the hand is, the same as sparse_dict_delete would, except we
+ * already know where it is.
+ */
+static const int _cache_evict(struct sparse_cache *cache, const size_t room, const size_t max_count) {
+	struct sparse_dict *dict = cache->dict;
+
+	while (sparse_cache_bytes(cache) + room > cache->max_bytes || dict->bucket_count > max_count) {
+		struct sparse_array_group *group = NULL;
+		struct sparse_bucket *bucket = NULL;
+		size_t cost = 0;
+		unsigned int position = 0;
+
+		if (dict->bucket_count == 0)
+			return 0;
+		if (cache->hand >= dict->bucket_max)
+			cache->hand = 0;
+
+		group = &dict->buckets->groups[cache->hand / GROUP_SIZE];
+		position = cache->hand % GROUP_SIZE;
+		/* Skip over empty stretches a word at a time. */
+		if (group->bitmap[position / BITCHUNK_SIZE] == 0) {
+			cache->hand = (cache->hand | (BITCHUNK_SIZE - 1)) + 1;
+			continue;
+		}
+		if (!is_position_occupied(group->bitmap, position) ||
+				dict->buckets->tags[cache->hand] == TAG_TOMBSTONE) {
+			cache->hand++;
+			continue;
+		}
+		if (is_position_occupied(cache->recent, cache->hand)) {
+			clear_position(cache->recent, cache->hand);
+			cache->hand++;
+			continue;
+		}
+
+		bucket = (struct sparse_bucket *)sparse_array_get(dict->buckets, cache->hand, NULL);
+		cost = _cache_blob_cost(bucket->klen, bucket->vlen);
+		if (!_bury_bucket(dict->buckets, cache->hand, bucket))
+			return 0;
+		dict->bucket_count--;
+		dict->tombstone_count++;
+		cache->blob_bytes -= cost;
+		cache->evictions++;
+		cache->hand++;
+	}
+	return 1;
+}
+
+const int sparse_cache_set(struct sparse_cache *cache,
+						   const char *key, const size_t klen,
+						   const void *value, const size_t vlen) {
+	struct sparse_dict *dict = cache->dict;
+	const uint64_t key_hash = dict->hash_fn(key, klen, dict->seed);
+	const size_t cost = _cache_blob_cost(klen, vlen);
+	struct sparse_bucket *existing_bucket = NULL;
+	size_t max_count = SIZE_MAX;
+	unsigned int slot = 0, probes = 0;
+	int is_tombstone = 0;
+
+	if (cost + _cache_table_cost(dict->bucket_max) > cache->max_bytes)
+		return 0;
+
+	existing_bucket = _table_lookup(dict->buckets, dict->bucket_max,
+									dict->bucket_count + dict->tombstone_count,
+									key, klen, key_hash, 0, &slot, &is_tombstone, &probes);
+	if (existing_bucket != NULL) {
+		/* Overwriting never moves anything, so the slot's still good. */
+		const size_t old_cost = _cache_blob_cost(existing_bucket->klen, existing_bucket->vlen);
+		if (!_sparse_dict_set(dict, key, klen, value, vlen, key_hash))
+			return 0;
+		cache->blob_bytes = cache->blob_bytes - old_cost + cost;
+		_cache_touch(cache, slot);
+		return _cache_evict(cache, 0, SIZE_MAX);
+	}
+
+	/* If there's no budget for a table twice the size, stay below the point
+	 * where it would grow. Rehashes then just clear out tombstones.
+	 */
+	if (_cache_table_cost(dict->bucket_max * 2) + cache->blob_bytes + cost > cache->max_bytes) {
+		const size_t grow_at = (dict->bucket_max * dict->resize_percent + 199) / 200;
+		max_count = grow_at > 1 ? grow_at - 2 : 0;
+	}
+	if (!_cache_evict(cache, cost, max_count))
+		return 0;
+	if (!_sparse_dict_set(dict, key, klen, value, vlen, key_hash))
+		return 0;
+	cache->blob_bytes += cost;
+
+	/* New things start out recent, or they'd be the first to go. */
+	if (_table_lookup(dict->buckets, dict->bucket_max, dict->bucket_count + dict->tombstone_count,
+					  key, klen, key_hash, 0, &slot, &is_tombstone, &probes) != NULL)
+		_cache_touch(cache, slot);
+	return 1;
+}
+
+const void *sparse_cache_get(struct sparse_cache *cache, const char *key,
+							 const size_t klen, size_t *outsize) {
+	struct sparse_dict *dict = cache->dict;
+	const uint64_t key_hash = dict->hash_fn(key, klen, dict->seed);
+	struct sparse_bucket *existing_bucket = NULL;
+	unsigned int slot = 0, probes = 0;
+	int is_tombstone = 0;
+
+	existing_bucket = _table_lookup(dict->buckets, dict->bucket_max,
+									dict->bucket_count + dict->tombstone_count,
+									key, klen, key_hash, 0, &slot, &is_tombstone, &probes);
+	COUNT_LOOKUP(dict, probes);
+	if (existing_bucket == NULL) {
+		cache->misses++;
+		return NULL;
+	}
+
+	cache->hits++;
+	_cache_touch(cache, slot);
+	if (outsize)
+		*outsize = existing_bucket->vlen;
+	return _bucket_data(existing_bucket);
+}
+
+const int sparse_cache_delete(struct sparse_cache *cache, const char *key, const size_t klen) {
+	struct sparse_dict *dict = cache->dict;
+	const uint64_t key_hash = dict->hash_fn(key, klen, dict->seed);
+	size_t vlen = 0;
+
+	if (_sparse_dict_get(dict, key, klen, &vlen, key_hash) == NULL)
+		return 0;
+	if (!_sparse_dict_delete(dict, key, klen, key_hash))
+		return 0;
+	cache->blob_bytes -= _cache_blob_cost(klen, vlen);
+	return 1;
+}
+
+const int sparse_cache_free(struct sparse_cache *cache) {
+	sparse_dict_free(cache->dict);
+	_sparse_free(cache->recent);
+	_sparse_free(cache->old_recent);
+	_sparse_free(cache);
+	return 1;
+}
+
+/* Integer dictionaries */
+
+/* Tombstones have a length no value can have. */
+#define U64_TOMBSTONE_VLEN ((size_t)-1)
+
+static inline const int _u64_bucket_is_inline(const struct sparse_u64_bucket *bucket) {
+	return bucket->vlen <= U64_INLINE_SIZE;
+}
+
+static inline unsigned char *_u64_bucket_data(struct sparse_u64_bucket *bucket) {
+	if (_u64_bucket_is_inline(bucket))
+		return bucket->data.bytes;
+	return bucket->data.heap;
+}
+
+static void _u64_bucket_free(struct sparse_u64_bucket *bucket) {
+	if (bucket->vlen != U64_TOMBSTONE_VLEN && !_u64_bucket_is_inline(bucket))
+		_sparse_free(bucket->data.heap);
+}
+
+static struct sparse_array *_u64_table_create(const size_t bucket_max) {
+	struct sparse_array *array = sparse_array_init_fixed(sizeof(struct sparse_u64_bucket), bucket_max);
+	if (array == NULL)
+		return NULL;
+	if (!_sparse_array_alloc_tags(array)) {
+		sparse_array_free(array);
+		return NULL;
+	}
+	return array;
+}
+
+struct sparse_u64_dict *sparse_u64_dict_init() {
+	struct sparse_u64_dict *new = _sparse_calloc(1, sizeof(struct sparse_u64_dict));
+	if (new == NULL)
+		return NULL;
+
+	new->seed = _new_seed(new);
+	new->bucket_max = STARTING_SIZE;
+	new->buckets = _u64_table_create(STARTING_SIZE);
+	if (new->buckets == NULL) {
+		_sparse_free(new);
+		return NULL;
+	}
+	return new;
+}
+
+/* _table_lookup, except a matching tag only costs us one compare to check. */
+static struct sparse_u64_bucket *_u64_table_lookup(struct sparse_array *array,
+						const size_t bucket_max, const size_t max_probes,
+						const uint64_t key, const uint64_t key_hash,
+						unsigned int *slot, int *slot_is_tombstone) {
+	unsigned int num_probes = 0;
+	int found_tombstone = 0;
+	const uint8_t tag = _hash_tag(key_hash);
+
+	*slot = bucket_max;
+	*slot_is_tombstone = 0;
+
+	for (num_probes = 0; num_probes <= max_probes; num_probes++) {
+		const unsigned int probed_val = QUADRATIC_PROBE(bucket_max);
+		const struct sparse_array_group *sag = &array->groups[probed_val / GROUP_SIZE];
+
+		if (!is_position_occupied(sag->bitmap, probed_val % GROUP_SIZE)) {
+			if (!found_tombstone)
+				*slot = probed_val;
+			return NULL;
+		}
+
+		if (array->tags[probed_val] == TAG_TOMBSTONE) {
+			if (!found_tombstone) {
+				found_tombstone = 1;
+				*slot = probed_val;
+				*slot_is_tombstone = 1;
+			}
+		} else if (array->tags[probed_val] == tag) {
+			struct sparse_u64_bucket *existing_bucket =
+				(struct sparse_u64_bucket *)sparse_array_get(array, probed_val, NULL);
+			if (existing_bucket->key == key) {
+				*slot = probed_val;
+				*slot_is_tombstone = 0;
+				return existing_bucket;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* Moves everything into a fresh table `new_bucket_max` big, leaving the
+ * tombstones behind. Values on the heap go along with their buckets.
+ */
+static const int _u64_resize_table(struct sparse_u64_dict *dict, const size_t new_bucket_max) {
+	struct sparse_array *new_buckets = NULL;
+	struct sparse_array_iter iter;
+	const void *current_value = NULL;
+
+	new_buckets = _u64_table_create(new_bucket_max);
+	if (new_buckets == NULL)
+		return 0;
+	sparse_array_hint_density(new_buckets, (dict->bucket_count * 100) / new_bucket_max);
+
+	sparse_array_iter_init(&iter, dict->buckets);
+	while (sparse_array_iter_next(&iter, NULL, &current_value, NULL)) {
+		const struct sparse_u64_bucket *bucket = current_value;
+		const uint64_t key_hash = sparse_hash_u64(bucket->key, dict->seed);
+		unsigned int probed_val = 0, num_probes = 0;
+
+		if (bucket->vlen == U64_TOMBSTONE_VLEN)
+			continue;
+		while (1) {
+			probed_val = QUADRATIC_PROBE(new_bucket_max);
+			if (!is_position_occupied(new_buckets->groups[probed_val / GROUP_SIZE].bitmap,
+									  probed_val % GROUP_SIZE))
+				break;
+			if (num_probes++ > new_bucket_max)
+				goto error;
+		}
+		if (!sparse_array_set(new_buckets, probed_val, bucket, sizeof(struct sparse_u64_bucket)))
+			goto error;
+		_set_tag(new_buckets, probed_val, _hash_tag(key_hash));
+	}
+
+	sparse_array_free(dict->buckets);
+	dict->buckets = new_buckets;
+	dict->bucket_max = new_bucket_max;
+	dict->tombstone_count = 0;
+	return 1;
+
+error:
+	/* Nothing in the new table owns anything yet. */
+	sparse_array_free(new_buckets);
+	return 0;
+}
+
+const int sparse_u64_dict_set(struct sparse_u64_dict *dict, const uint64_t key,
+							  const void *value, const size_t vlen) {
+	const uint64_t key_hash = sparse_hash_u64(key, dict->seed);
+	struct sparse_u64_bucket bucket = {
+		.key = key,
+		.vlen = vlen
+	};
+	struct sparse_u64_bucket old_bucket;
+	struct sparse_u64_bucket *existing_bucket = NULL;
+	unsigned int probed_val = 0;
+	int is_tombstone = 0;
+
+	if (vlen == U64_TOMBSTONE_VLEN)
+		return 0;
+
+	existing_bucket = _u64_table_lookup(dict->buckets, dict->bucket_max,
+										dict->bucket_count + dict->tombstone_count,
+										key, key_hash, &probed_val, &is_tombstone);
+	/* Nowhere to put it. Shouldn't happen with the table never over full. */
+	if (existing_bucket == NULL && probed_val >= dict->bucket_max)
+		return 0;
+	if (existing_bucket != NULL)
+		old_bucket = *existing_bucket;
+
+	if (_u64_bucket_is_inline(&bucket)) {
+		memcpy(bucket.data.bytes, value, vlen);
+	} else {
+		bucket.data.heap = _sparse_malloc(vlen);
+		if (bucket.data.heap == NULL)
+			return 0;
+		memcpy(bucket.data.heap, value, vlen);
+	}
+
+	if (!sparse_array_set(dict->buckets, probed_val, &bucket, sizeof(bucket))) {
+		_u64_bucket_free(&bucket);
+		return 0;
+	}
+	_set_tag(dict->buckets, probed_val, _hash_tag(key_hash));
+
+	if (existing_bucket != NULL) {
+		_u64_bucket_free(&old_bucket);
+		return 1;
+	}
+
+	dict->bucket_count++;
+	if (is_tombstone)
+		dict->tombstone_count--;
+
+	/* Same rules as sparse_dict: tombstones count towards the resize point,
+	 * but if they're most of what got us there, the table stays the same size.
+	 */
+	if ((dict->bucket_count + dict->tombstone_count) * 100 >= dict->bucket_max * RESIZE_PERCENT) {
+		if (dict->bucket_count * 200 >= dict->bucket_max * RESIZE_PERCENT)
+			return _u64_resize_table(dict, dict->bucket_max * 2);
+		return _u64_resize_table(dict, dict->bucket_max);
+	}
+
+	return 1;
+}
+
+const void *sparse_u64_dict_get(struct sparse_u64_dict *dict, const uint64_t key, size_t *outsize) {
+	struct sparse_u64_bucket *existing_bucket = NULL;
+	unsigned int probed_val = 0;
+	int is_tombstone = 0;
+
+	existing_bucket = _u64_table_lookup(dict->buckets, dict->bucket_max,
+										dict->bucket_count + dict->tombstone_count,
+										key, sparse_hash_u64(key, dict->seed), &probed_val, &is_tombstone);
+	if (existing_bucket == NULL)
+		return NULL;
+	if (outsize)
+		*outsize = existing_bucket->vlen;
+	return _u64_bucket_data(existing_bucket);
+}
+
+const int sparse_u64_dict_delete(struct sparse_u64_dict *dict, const uint64_t key) {
+	const struct sparse_u64_bucket tombstone = {
+		.vlen = U64_TOMBSTONE_VLEN,
+	};
+	struct sparse_u64_bucket old_bucket;
+	struct sparse_u64_bucket *existing_bucket = NULL;
+	unsigned int probed_val = 0;
+	int is_tombstone = 0;
+	size_t new_bucket_max = 0;
+
+	existing_bucket = _u64_table_lookup(dict->buckets, dict->bucket_max,
+										dict->bucket_count + dict->tombstone_count,
+										key, sparse_hash_u64(key, dict->seed), &probed_val, &is_tombstone);
+	if (existing_bucket == NULL)
+		return 0;
+
+	old_bucket = *existing_bucket;
+	if (!sparse_array_set(dict->buckets, probed_val, &tombstone, sizeof(tombstone)))
+		return 0;
+	_set_tag(dict->buckets, probed_val, TAG_TOMBSTONE);
+	_u64_bucket_free(&old_bucket);
+	dict->bucket_count--;
+	dict->tombstone_count++;
+
+	/* Shrinking can fail without anything being lost, so we don't care if it
+	 * does.
+	 */
+	new_bucket_max = _shrunk_size(dict->bucket_count, dict->bucket_max, RESIZE_PERCENT);
+	if (dict->bucket_count * 100 < dict->bucket_max * SHRINK_PERCENT && new_bucket_max != dict->bucket_max)
+		_u64_resize_table(dict, new_bucket_max);
+
+	return 1;
+}
+
+void sparse_u64_dict_iter_init(struct sparse_u64_dict_iter *iter, struct sparse_u64_dict *dict) {
+	sparse_array_iter_init(&iter->buckets_iter, dict->buckets);
+}
+
+const int sparse_u64_dict_iter_next(struct sparse_u64_dict_iter *iter, uint64_t *key,
+									const void **value, size_t *vlen) {
+	const void *current_value = NULL;
+	while (sparse_array_iter_next(&iter->buckets_iter, NULL, &current_value, NULL)) {
+		struct sparse_u64_bucket *bucket = (struct sparse_u64_bucket *)current_value;
+		if (bucket->vlen == U64_TOMBSTONE_VLEN)
+			continue;
+		if (key)
+			*key = bucket->key;
+		if (value)
+			*value = _u64_bucket_data(bucket);
+		if (vlen)
+			*vlen = bucket->vlen;
+		return 1;
+	}
+	return 0;
+}
+
+const int sparse_u64_dict_free(struct sparse_u64_dict *dict) {
+	struct sparse_array_iter iter;
+	const void *current_value = NULL;
+
+	sparse_array_iter_init(&iter, dict->buckets);
+	while (sparse_array_iter_next(&iter, NULL, &current_value, NULL))
+		_u64_bucket_free((struct sparse_u64_bucket *)current_value);
 	sparse_array_free(dict->buckets);
-	free(dict);
+	_sparse_free(dict);
 	return 1;
 }
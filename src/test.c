@@ -1,8 +1,15 @@
 /* vim: noet ts=4 sw=4
 */
+#define _POSIX_C_SOURCE 200112L
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "simple_sparsehash.h"
+#include "sparse_dict_define.h"
+#include "simple_densehash.h"
 
 #define begin_tests() int test_return_val = 0;\
 					  int tests_failed = 0;\
@@ -179,6 +186,144 @@ int test_array_get() {
 	return 1;
 }
 
+int test_array_erase() {
+	int i;
+	const int array_size = 130;
+	struct sparse_array *arr = NULL;
+	arr = sparse_array_init(sizeof(int), array_size);
+	assert(arr);
+
+	for (i = 0; i < array_size; i++)
+		assert(sparse_array_set(arr, i, &i, sizeof(i)));
+
+	/* Knock out every other element, the rest should be untouched. */
+	for (i = 0; i < array_size; i += 2)
+		assert(sparse_array_erase(arr, i));
+	assert(!sparse_array_erase(arr, 0));
+	assert(!sparse_array_erase(arr, array_size));
+
+	for (i = 0; i < array_size; i++) {
+		const int *returned = sparse_array_get(arr, i, NULL);
+		if (i % 2 == 0) {
+			assert(returned == NULL);
+		} else {
+			assert(returned);
+			assert(*returned == i);
+		}
+	}
+
+	/* Empty a group out entirely and refill it. */
+	for (i = 0; i < GROUP_SIZE; i++)
+		sparse_array_erase(arr, i);
+	assert(arr->groups[0].group == NULL);
+	assert(sparse_array_set(arr, 3, &i, sizeof(i)));
+	assert(*(const int *)sparse_array_get(arr, 3, NULL) == i);
+
+	assert(sparse_array_free(arr));
+	return 1;
+}
+
+int test_array_group_capacity() {
+	int i;
+	struct sparse_array *arr = NULL;
+	arr = sparse_array_init(sizeof(int), GROUP_SIZE * 2);
+	assert(arr);
+
+	/* Groups grow ahead of what they hold, never past GROUP_SIZE. */
+	for (i = 0; i < GROUP_SIZE; i++) {
+		assert(sparse_array_set(arr, i, &i, sizeof(i)));
+		assert(arr->groups[0].capacity >= i + 1);
+	}
+	assert(arr->groups[0].capacity == GROUP_SIZE);
+
+	/* And give memory back as they empty out. */
+	for (i = 0; i < GROUP_SIZE - 4; i++)
+		assert(sparse_array_erase(arr, i));
+	assert(arr->groups[0].capacity < GROUP_SIZE / 2);
+	for (i = GROUP_SIZE - 4; i < GROUP_SIZE; i++)
+		assert(*(const int *)sparse_array_get(arr, i, NULL) == i);
+
+	/* With a hint, the first allocation is already big enough. */
+	sparse_array_hint_density(arr, 50);
+	assert(sparse_array_set(arr, GROUP_SIZE, &i, sizeof(i)));
+	assert(arr->groups[1].capacity == GROUP_SIZE / 2);
+
+	assert(sparse_array_free(arr));
+	return 1;
+}
+
+int test_array_fixed() {
+	struct sparse_array *arr = NULL;
+	struct sparse_array_iter iter;
+	uint64_t i = 0, seen = 0;
+	const void *val = NULL;
+	size_t vlen = 0;
+	char small = 0;
+
+	assert(sparse_array_init_fixed(0, GROUP_SIZE) == NULL);
+	arr = sparse_array_init_fixed(sizeof(i), GROUP_SIZE * 3);
+	assert(arr);
+	assert(arr->stride == sizeof(i));
+
+	/* Exactly the right size, or not at all. */
+	assert(!sparse_array_set(arr, 0, &small, sizeof(small)));
+	assert(sparse_array_get(arr, 0, NULL) == NULL);
+	for (i = 0; i < GROUP_SIZE * 3; i += 3)
+		assert(sparse_array_set(arr, i, &i, sizeof(i)));
+	assert(sparse_array_erase(arr, 0));
+	for (i = 3; i < GROUP_SIZE * 3; i += 3) {
+		assert(*(const uint64_t *)sparse_array_get(arr, i, &vlen) == i);
+		assert(vlen == sizeof(i));
+	}
+
+	sparse_array_iter_init(&iter, arr);
+	while (sparse_array_iter_next(&iter, NULL, &val, &vlen)) {
+		assert(vlen == sizeof(i));
+		assert(*(const uint64_t *)val == (seen + 1) * 3);
+		seen++;
+	}
+	assert(seen == GROUP_SIZE - 1);
+
+	assert(sparse_array_free(arr));
+	return 1;
+}
+
+int test_array_iterate() {
+	struct sparse_array *arr = NULL;
+	struct sparse_array_iter iter;
+	uint32_t i = 0, expected = 0;
+	const void *val = NULL;
+	size_t vlen = 0;
+	const uint32_t array_size = GROUP_SIZE * 5;
+
+	arr = sparse_array_init(sizeof(uint32_t), array_size);
+	assert(arr);
+
+	/* Nothing in it, nothing to see. */
+	sparse_array_iter_init(&iter, arr);
+	assert(!sparse_array_iter_next(&iter, &i, &val, &vlen));
+
+	/* Every third slot, with a whole empty group in the middle. */
+	for (i = 0; i < array_size; i += 3) {
+		if (i / GROUP_SIZE != 2)
+			assert(sparse_array_set(arr, i, &i, sizeof(i)));
+	}
+
+	sparse_array_iter_init(&iter, arr);
+	while (sparse_array_iter_next(&iter, &i, &val, &vlen)) {
+		while (expected / GROUP_SIZE == 2)
+			expected += 3;
+		assert(i == expected);
+		assert(*(const uint32_t *)val == i);
+		assert(vlen == sizeof(uint32_t));
+		expected += 3;
+	}
+	assert(expected >= array_size);
+
+	assert(sparse_array_free(arr));
+	return 1;
+}
+
 int test_dict_set() {
 	struct sparse_dict *dict = NULL;
 	dict = sparse_dict_init();
@@ -210,6 +355,46 @@ int test_dict_get() {
 	return 1;
 }
 
+int test_dict_inline_and_spilled_values() {
+	struct sparse_dict *dict = NULL;
+	size_t outsize = 0;
+	const char *value = NULL;
+	char big_value[INLINE_SIZE * 4] = {0};
+	const char nul_key[] = {'k', 0, 'a'};
+	const char nul_key2[] = {'k', 0, 'b'};
+
+	memset(big_value, 'x', sizeof(big_value));
+
+	dict = sparse_dict_init();
+	assert(dict);
+
+	/* Short values live in the bucket, long ones spill. Overwrite each way. */
+	assert(sparse_dict_set(dict, "key", strlen("key"), "value", strlen("value")));
+	assert(sparse_dict_set(dict, "key", strlen("key"), big_value, sizeof(big_value)));
+	value = sparse_dict_get(dict, "key", strlen("key"), &outsize);
+	assert(value);
+	assert(outsize == sizeof(big_value));
+	assert(memcmp(value, big_value, outsize) == 0);
+
+	assert(sparse_dict_set(dict, "key", strlen("key"), "short", strlen("short")));
+	value = sparse_dict_get(dict, "key", strlen("key"), &outsize);
+	assert(value);
+	assert(outsize == strlen("short"));
+	assert(strncmp(value, "short", outsize) == 0);
+
+	/* Keys are compared by length and bytes, not as C strings. */
+	assert(sparse_dict_set(dict, nul_key, sizeof(nul_key), "a", 1));
+	assert(sparse_dict_set(dict, nul_key2, sizeof(nul_key2), "b", 1));
+	assert(dict->bucket_count == 3);
+	value = sparse_dict_get(dict, nul_key2, sizeof(nul_key2), &outsize);
+	assert(value);
+	assert(outsize == 1 && value[0] == 'b');
+	assert(!sparse_dict_get(dict, "k", 1, NULL));
+
+	assert(sparse_dict_free(dict));
+	return 1;
+}
+
 int test_dict_lots_of_set() {
 	struct sparse_dict *dict = NULL;
 	int i = 0;
@@ -254,6 +439,1475 @@ int test_dict_lots_of_set() {
 	return 1;
 }
 
+int test_dict_parallel_rehash() {
+	struct sparse_dict *dict = NULL;
+	const unsigned int iterations = PARALLEL_REHASH_MIN * 4;
+	const char spilled[] = "this one is long enough that it has to go on the heap";
+	char key[32] = {0};
+	unsigned int i = 0;
+
+	dict = sparse_dict_init();
+	assert(dict);
+	assert(sparse_dict_parallel_rehash(dict, 4));
+
+	/* Long enough to go through a couple of parallel resizes. */
+	for (i = 0; i < iterations; i++) {
+		snprintf(key, sizeof(key), "%u", i);
+		if (i % 3 == 0) {
+			assert(sparse_dict_set(dict, key, strlen(key), spilled, sizeof(spilled)));
+		} else {
+			assert(sparse_dict_set(dict, key, strlen(key), &i, sizeof(i)));
+		}
+	}
+	assert(dict->bucket_count == iterations);
+
+	for (i = 0; i < iterations; i++) {
+		size_t outsize = 0;
+		const void *value = NULL;
+		snprintf(key, sizeof(key), "%u", i);
+		value = sparse_dict_get(dict, key, strlen(key), &outsize);
+		assert(value);
+		if (i % 3 == 0) {
+			assert(outsize == sizeof(spilled));
+			assert(memcmp(value, spilled, sizeof(spilled)) == 0);
+		} else {
+			assert(*(const unsigned int *)value == i);
+		}
+	}
+
+	/* And the one-thread resizes that follow still work with what the
+	 * parallel ones left behind.
+	 */
+	assert(sparse_dict_parallel_rehash(dict, 0));
+	assert(sparse_dict_reserve(dict, iterations * 4));
+	for (i = 0; i < iterations; i += 7) {
+		snprintf(key, sizeof(key), "%u", i);
+		assert(sparse_dict_get(dict, key, strlen(key), NULL));
+	}
+
+	assert(sparse_dict_free(dict));
+	return 1;
+}
+
+struct upsert_counts {
+	size_t	inserted;
+	size_t	wrong;			/* Values that weren't the size we asked for, or new ones that weren't zero. */
+};
+
+static void count_up(void *value, const size_t vlen, const int inserted, void *ctx) {
+	struct upsert_counts *counts = ctx;
+	uint64_t counter = 0;
+
+	if (vlen != sizeof(counter)) {
+		counts->wrong++;
+		return;
+	}
+	memcpy(&counter, value, sizeof(counter));
+	if (inserted) {
+		counts->inserted++;
+		if (counter != 0)
+			counts->wrong++;
+	}
+	counter++;
+	memcpy(value, &counter, sizeof(counter));
+}
+
+int test_dict_upsert() {
+	struct sparse_dict *dict = NULL;
+	char key[32] = {0};
+	const char spilled[] = "a value that's far too long to be stored inline";
+	char other[sizeof(spilled)] = {0};
+	const void *before = NULL;
+	uint64_t *counter = NULL;
+	const uint64_t start = 100;
+	struct upsert_counts counts = {0};
+	size_t i = 0, outsize = 0;
+	int round = 0;
+
+	dict = sparse_dict_init();
+	assert(dict);
+
+	/* Every key gets counted three times, through a few rehashes. */
+	for (round = 0; round < 3; round++) {
+		for (i = 0; i < 5000; i++) {
+			snprintf(key, sizeof(key), "key%zu", i);
+			assert(sparse_dict_upsert(dict, key, strlen(key), sizeof(uint64_t), count_up, &counts));
+		}
+	}
+	assert(counts.inserted == 5000);
+	assert(counts.wrong == 0);
+	assert(dict->bucket_count == 5000);
+	for (i = 0; i < 5000; i++) {
+		snprintf(key, sizeof(key), "key%zu", i);
+		assert(*(const uint64_t *)sparse_dict_get(dict, key, strlen(key), NULL) == 3);
+	}
+
+	/* What comes back can be written through, even right after a rehash. */
+	assert(sparse_dict_probing(dict, SPARSE_PROBE_ROBIN_HOOD, 0));
+	for (i = 0; i < 10000; i++) {
+		snprintf(key, sizeof(key), "key%zu", i);
+		counter = sparse_dict_get_or_insert(dict, key, strlen(key), &start, sizeof(start), &outsize);
+		assert(counter);
+		assert(outsize == sizeof(start));
+		assert(*counter == (i < 5000 ? 3 : start));
+		(*counter)++;
+	}
+	for (i = 0; i < 10000; i++) {
+		snprintf(key, sizeof(key), "key%zu", i);
+		assert(*(const uint64_t *)sparse_dict_get(dict, key, strlen(key), NULL) == (i < 5000 ? 4 : start + 1));
+	}
+
+	/* Values the same size as the old one go right where it was. */
+	assert(sparse_dict_set(dict, "spilled", strlen("spilled"), spilled, sizeof(spilled)));
+	before = sparse_dict_get(dict, "spilled", strlen("spilled"), NULL);
+	memset(other, 'x', sizeof(other));
+	assert(sparse_dict_set(dict, "spilled", strlen("spilled"), other, sizeof(other)));
+	assert(sparse_dict_get(dict, "spilled", strlen("spilled"), NULL) == before);
+	assert(memcmp(before, other, sizeof(other)) == 0);
+
+	/* Readers would see values changing underneath them. */
+	if (sparse_dict_probing(dict, SPARSE_PROBE_QUADRATIC, 0) && sparse_dict_concurrent_readers(dict, 1)) {
+		assert(!sparse_dict_upsert(dict, "key1", strlen("key1"), sizeof(uint64_t), count_up, &counts));
+		assert(sparse_dict_get_or_insert(dict, "key1", strlen("key1"), &start, sizeof(start), NULL) == NULL);
+		assert(sparse_dict_concurrent_readers(dict, 0));
+	}
+
+	assert(sparse_dict_free(dict));
+	return 1;
+}
+
+/* Stands in for a hash the caller already worked out for something else. */
+static uint64_t routing_hash(const char *key, const size_t klen, const uint64_t seed) {
+	(void)seed;
+	return sparse_hash_wy(key, klen, 42);
+}
+
+int test_dict_hashed() {
+	struct sparse_dict *dict = NULL;
+	char keys[2000][16];
+	const char *key_ptrs[2000] = {0};
+	size_t klens[2000] = {0};
+	uint64_t hashes[2000] = {0};
+	const void *values[2000] = {0};
+	size_t vlens[2000] = {0};
+	size_t i = 0, outsize = 0;
+
+	dict = sparse_dict_init_with_hash(routing_hash);
+	assert(dict);
+
+	for (i = 0; i < 2000; i++) {
+		snprintf(keys[i], sizeof(keys[i]), "key%zu", i);
+		key_ptrs[i] = keys[i];
+		klens[i] = strlen(keys[i]);
+		hashes[i] = routing_hash(keys[i], klens[i], 0);
+		values[i] = &hashes[i];
+		vlens[i] = sizeof(hashes[i]);
+	}
+
+	/* Whichever way they went in, the plain calls find them. */
+	for (i = 0; i < 1000; i++)
+		assert(sparse_dict_set_hashed(dict, keys[i], klens[i], values[i], vlens[i], hashes[i]));
+	assert(sparse_dict_set_many_hashed(dict, 1000, key_ptrs + 1000, klens + 1000, hashes + 1000,
+									   values + 1000, vlens + 1000));
+	assert(dict->bucket_count == 2000);
+	for (i = 0; i < 2000; i++) {
+		assert(*(const uint64_t *)sparse_dict_get(dict, keys[i], klens[i], NULL) == hashes[i]);
+		assert(*(const uint64_t *)sparse_dict_get_hashed(dict, keys[i], klens[i], &outsize, hashes[i]) == hashes[i]);
+		assert(outsize == sizeof(uint64_t));
+	}
+
+	for (i = 0; i < 2000; i += 2)
+		assert(sparse_dict_delete_hashed(dict, keys[i], klens[i], hashes[i]));
+	assert(!sparse_dict_delete_hashed(dict, keys[0], klens[0], hashes[0]));
+	assert(sparse_dict_get_many_hashed(dict, 2000, key_ptrs, klens, hashes, values, NULL) == 1000);
+	for (i = 0; i < 2000; i += 2) {
+		assert(values[i] == NULL);
+		assert(*(const uint64_t *)values[i + 1] == hashes[i + 1]);
+	}
+
+	assert(sparse_dict_free(dict));
+	return 1;
+}
+
+int test_dict_delete() {
+	struct sparse_dict *dict = NULL;
+	int i = 0;
+	size_t peak_bucket_max = 0;
+	const int iterations = 100000;
+
+	dict = sparse_dict_init();
+	assert(dict);
+
+	assert(!sparse_dict_delete(dict, "nope", strlen("nope")));
+
+	for (i = 0; i < iterations; i++) {
+		char key[64] = {0};
+		snprintf(key, sizeof(key), "crazy hash%i", i);
+		assert(sparse_dict_set(dict, key, strlen(key), &i, sizeof(i)));
+	}
+	peak_bucket_max = dict->bucket_max;
+
+	/* Delete most of them. Whatever is left has to stay reachable even
+	 * though its probe sequences now run through tombstones.
+	 */
+	for (i = 0; i < iterations; i++) {
+		char key[64] = {0};
+		snprintf(key, sizeof(key), "crazy hash%i", i);
+		if (i % 10 != 0)
+			assert(sparse_dict_delete(dict, key, strlen(key)));
+	}
+	assert(dict->bucket_count == (size_t)iterations / 10);
+
+	for (i = 0; i < iterations; i++) {
+		char key[64] = {0};
+		const int *retrieved = NULL;
+		snprintf(key, sizeof(key), "crazy hash%i", i);
+		retrieved = sparse_dict_get(dict, key, strlen(key), NULL);
+		if (i % 10 != 0) {
+			assert(retrieved == NULL);
+			assert(!sparse_dict_delete(dict, key, strlen(key)));
+		} else {
+			assert(retrieved);
+			assert(*retrieved == i);
+		}
+	}
+
+	/* We crossed the low-water mark, so the table should have followed. */
+	assert(dict->bucket_max <= peak_bucket_max / 4);
+
+	/* Deleted keys can come back. */
+	assert(sparse_dict_set(dict, "crazy hash1", strlen("crazy hash1"), "back", 4));
+	assert(sparse_dict_get(dict, "crazy hash1", strlen("crazy hash1"), NULL));
+
+	assert(sparse_dict_free(dict));
+	return 1;
+}
+
+int test_dict_delete_while_migrating() {
+	struct sparse_dict *dict = NULL;
+	int i = 0;
+	const int iterations = 50000;
+
+	dict = sparse_dict_init();
+	assert(dict);
+	assert(sparse_dict_incremental_rehash(dict, 1));
+	dict->shrink_percent = 0;
+
+	for (i = 0; i < iterations; i++) {
+		char key[64] = {0};
+		snprintf(key, sizeof(key), "crazy hash%i", i);
+		assert(sparse_dict_set(dict, key, strlen(key), &i, sizeof(i)));
+		/* Keep deleting older keys as we go, these land in both tables. */
+		if (i >= 7 && i % 3 == 0) {
+			snprintf(key, sizeof(key), "crazy hash%i", i - 7);
+			assert(sparse_dict_delete(dict, key, strlen(key)));
+		}
+	}
+
+	for (i = 0; i < iterations; i++) {
+		char key[64] = {0};
+		const int *retrieved = NULL;
+		const int deleted = i + 7 < iterations && (i + 7) % 3 == 0;
+		snprintf(key, sizeof(key), "crazy hash%i", i);
+		retrieved = sparse_dict_get(dict, key, strlen(key), NULL);
+		if (deleted) {
+			assert(retrieved == NULL);
+		} else {
+			assert(retrieved);
+			assert(*retrieved == i);
+		}
+	}
+
+	assert(sparse_dict_free(dict));
+	return 1;
+}
+
+int test_dict_long_keys() {
+	struct sparse_dict *dict = NULL;
+	char key_a[1000] = {0}, key_b[1000] = {0};
+	const int *retrieved = NULL;
+	const int a = 1, b = 2;
+
+	/* These only differ way past the first 256 bytes. */
+	memset(key_a, 'k', sizeof(key_a));
+	memset(key_b, 'k', sizeof(key_b));
+	key_b[sizeof(key_b) - 1] = 'z';
+
+	dict = sparse_dict_init();
+	assert(dict);
+
+	assert(sparse_dict_set(dict, key_a, sizeof(key_a), &a, sizeof(a)));
+	assert(sparse_dict_set(dict, key_b, sizeof(key_b), &b, sizeof(b)));
+	assert(dict->bucket_count == 2);
+
+	retrieved = sparse_dict_get(dict, key_a, sizeof(key_a), NULL);
+	assert(retrieved && *retrieved == a);
+	retrieved = sparse_dict_get(dict, key_b, sizeof(key_b), NULL);
+	assert(retrieved && *retrieved == b);
+
+	assert(sparse_dict_free(dict));
+	return 1;
+}
+
+int test_dict_tags_follow_buckets() {
+	struct sparse_dict *dict = NULL;
+	unsigned int i = 0, tagged = 0;
+
+	dict = sparse_dict_init();
+	assert(dict);
+	assert(dict->buckets->tags);
+
+	for (i = 0; i < 1000; i++) {
+		char key[64] = {0};
+		snprintf(key, sizeof(key), "crazy hash%u", i);
+		assert(sparse_dict_set(dict, key, strlen(key), &i, sizeof(i)));
+	}
+	assert(sparse_dict_delete(dict, "crazy hash7", strlen("crazy hash7")));
+
+	/* Every live bucket's slot carries the top of its hash, flagged. */
+	for (i = 0; i < dict->bucket_max; i++) {
+		const struct sparse_bucket *bucket = sparse_array_get(dict->buckets, i, NULL);
+		if (bucket == NULL)
+			continue;
+		if (dict->buckets->tags[i] & 0x80) {
+			assert(dict->buckets->tags[i] == (uint8_t)((bucket->hash >> 57) | 0x80));
+			tagged++;
+		}
+	}
+	assert(tagged == dict->bucket_count);
+
+	assert(sparse_dict_free(dict));
+	return 1;
+}
+
+static uint64_t terrible_hash(const char *key, const size_t klen, const uint64_t seed) {
+	(void)key;
+	(void)seed;
+	return klen;
+}
+
+int test_dict_custom_hash() {
+	struct sparse_dict *dict = NULL;
+	int i = 0;
+
+	/* Everything collides with this, so it's all down to probing. */
+	dict = sparse_dict_init_with_hash(terrible_hash);
+	assert(dict);
+	assert(dict->hash_fn == terrible_hash);
+
+	for (i = 0; i < 1000; i++) {
+		char key[64] = {0};
+		snprintf(key, sizeof(key), "crazy hash%04i", i);
+		assert(sparse_dict_set(dict, key, strlen(key), &i, sizeof(i)));
+	}
+
+	for (i = 0; i < 1000; i++) {
+		char key[64] = {0};
+		const int *retrieved = NULL;
+		snprintf(key, sizeof(key), "crazy hash%04i", i);
+		retrieved = sparse_dict_get(dict, key, strlen(key), NULL);
+		assert(retrieved && *retrieved == i);
+	}
+
+	assert(sparse_dict_free(dict));
+
+	/* And the default seeds every dictionary differently. */
+	{
+		struct sparse_dict *one = sparse_dict_init();
+		struct sparse_dict *two = sparse_dict_init();
+		assert(one && two);
+		assert(one->hash_fn == sparse_hash_wy);
+		assert(one->seed != two->seed);
+		assert(sparse_dict_free(one));
+		assert(sparse_dict_free(two));
+	}
+
+	return 1;
+}
+
+int test_dict_init_with_capacity() {
+	struct sparse_dict *dict = NULL;
+	int i = 0;
+	size_t bucket_max = 0;
+	const int iterations = 10000;
+
+	dict = sparse_dict_init_with_capacity(iterations);
+	assert(dict);
+	bucket_max = dict->bucket_max;
+
+	for (i = 0; i < iterations; i++) {
+		char key[64] = {0};
+		snprintf(key, sizeof(key), "crazy hash%i", i);
+		assert(sparse_dict_set(dict, key, strlen(key), &i, sizeof(i)));
+	}
+	/* We said how many there would be, so it never had to grow. */
+	assert(dict->bucket_max == bucket_max);
+
+	/* Reserving less than we have does nothing, more grows it once. */
+	assert(sparse_dict_reserve(dict, 10));
+	assert(dict->bucket_max == bucket_max);
+	assert(sparse_dict_reserve(dict, iterations * 4));
+	assert(dict->bucket_max > bucket_max);
+	assert(dict->bucket_count == (size_t)iterations);
+	for (i = 0; i < iterations; i++) {
+		char key[64] = {0};
+		const int *retrieved = NULL;
+		snprintf(key, sizeof(key), "crazy hash%i", i);
+		retrieved = sparse_dict_get(dict, key, strlen(key), NULL);
+		assert(retrieved && *retrieved == i);
+	}
+
+	assert(sparse_dict_free(dict));
+	return 1;
+}
+
+int test_dict_bulk_load() {
+	struct sparse_dict *dict = NULL;
+	const int count = 50000;
+	char (*key_storage)[32] = malloc(count * sizeof(*key_storage));
+	const char **keys = malloc(count * sizeof(char *));
+	const void **values = malloc(count * sizeof(void *));
+	size_t *klens = malloc(count * sizeof(size_t));
+	size_t *vlens = malloc(count * sizeof(size_t));
+	int *numbers = malloc(count * sizeof(int));
+	int i = 0;
+
+	assert(key_storage && keys && values && klens && vlens && numbers);
+
+	/* The last hundred keys repeat the first hundred with new values. */
+	for (i = 0; i < count; i++) {
+		const int key_num = i < count - 100 ? i : i - (count - 100);
+		snprintf(key_storage[i], sizeof(key_storage[i]), "crazy hash%i", key_num);
+		numbers[i] = i;
+		keys[i] = key_storage[i];
+		klens[i] = strlen(key_storage[i]);
+		values[i] = &numbers[i];
+		vlens[i] = sizeof(int);
+	}
+
+	dict = sparse_dict_init();
+	assert(dict);
+	assert(sparse_dict_set(dict, "already here", strlen("already here"), "yes", 3));
+
+	/* Loading nothing works and changes nothing. */
+	assert(sparse_dict_bulk_load(dict, NULL, NULL, NULL, NULL, 0));
+	assert(dict->bucket_count == 1);
+
+	assert(sparse_dict_bulk_load(dict, keys, klens, values, vlens, count));
+	assert(dict->bucket_count == (size_t)(count - 100 + 1));
+	assert(sparse_dict_get(dict, "already here", strlen("already here"), NULL));
+
+	for (i = 0; i < count - 100; i++) {
+		const int *retrieved = sparse_dict_get(dict, keys[i], klens[i], NULL);
+		assert(retrieved);
+		assert(*retrieved == (i < 100 ? i + (count - 100) : i));
+	}
+
+	assert(sparse_dict_free(dict));
+	free(key_storage);
+	free(keys);
+	free(values);
+	free(klens);
+	free(vlens);
+	free(numbers);
+	return 1;
+}
+
+int test_dict_get_and_set_many() {
+	struct sparse_dict *dict = NULL;
+	const size_t count = BATCH_SIZE * 3 + 7;
+	char key_storage[BATCH_SIZE * 3 + 7][32];
+	const char *keys[BATCH_SIZE * 3 + 7];
+	size_t klens[BATCH_SIZE * 3 + 7], vlens[BATCH_SIZE * 3 + 7];
+	const void *values[BATCH_SIZE * 3 + 7];
+	size_t outsizes[BATCH_SIZE * 3 + 7];
+	int numbers[BATCH_SIZE * 3 + 7];
+	size_t i = 0;
+
+	for (i = 0; i < count; i++) {
+		snprintf(key_storage[i], sizeof(key_storage[i]), "crazy hash%zu", i);
+		keys[i] = key_storage[i];
+		klens[i] = strlen(key_storage[i]);
+		numbers[i] = (int)i * 3;
+		values[i] = &numbers[i];
+		vlens[i] = sizeof(int);
+	}
+
+	dict = sparse_dict_init();
+	assert(dict);
+
+	/* Set every other one. */
+	for (i = 0; i < count; i += 2)
+		assert(sparse_dict_set(dict, keys[i], klens[i], values[i], vlens[i]));
+	assert(sparse_dict_get_many(dict, count, keys, klens, values, outsizes) == (count + 1) / 2);
+	for (i = 0; i < count; i++) {
+		if (i % 2 == 0) {
+			assert(values[i] && *(const int *)values[i] == (int)i * 3);
+			assert(outsizes[i] == sizeof(int));
+		} else {
+			assert(values[i] == NULL);
+		}
+	}
+
+	/* Now all of them, through the batch set. */
+	for (i = 0; i < count; i++)
+		values[i] = &numbers[i];
+	assert(sparse_dict_set_many(dict, count, keys, klens, values, vlens));
+	assert(dict->bucket_count == count);
+	assert(sparse_dict_get_many(dict, count, keys, klens, values, NULL) == count);
+	for (i = 0; i < count; i++)
+		assert(*(const int *)values[i] == (int)i * 3);
+
+	assert(sparse_dict_free(dict));
+	return 1;
+}
+
+int test_dict_iterate() {
+	struct sparse_dict *dict = NULL;
+	struct sparse_dict_iter iter;
+	const char *key = NULL;
+	const void *value = NULL;
+	size_t klen = 0, vlen = 0;
+	int i = 0, seen = 0, iterations = 10000;
+	char *found = calloc(iterations * 4, 1);
+
+	assert(found);
+	dict = sparse_dict_init();
+	assert(dict);
+	assert(sparse_dict_incremental_rehash(dict, 1));
+	dict->shrink_percent = 0;
+
+	for (i = 0; i < iterations; i++) {
+		char k[64] = {0};
+		snprintf(k, sizeof(k), "crazy hash%i", i);
+		assert(sparse_dict_set(dict, k, strlen(k), &i, sizeof(i)));
+	}
+	for (i = 0; i < iterations; i += 5) {
+		char k[64] = {0};
+		snprintf(k, sizeof(k), "crazy hash%i", i);
+		assert(sparse_dict_delete(dict, k, strlen(k)));
+	}
+	/* Keep going until we're looking at a table that's partway through
+	 * migrating, so that both tables get walked.
+	 */
+	for (i = iterations; dict->old_buckets == NULL || i % 5 == 0; i++) {
+		char k[64] = {0};
+		snprintf(k, sizeof(k), "crazy hash%i", i);
+		assert(i < iterations * 4);
+		if (i % 5 != 0)
+			assert(sparse_dict_set(dict, k, strlen(k), &i, sizeof(i)));
+	}
+	iterations = i;
+
+	sparse_dict_iter_init(&iter, dict);
+	while (sparse_dict_iter_next(&iter, &key, &klen, &value, &vlen)) {
+		char k[64] = {0};
+		const int num = *(const int *)value;
+		assert(vlen == sizeof(int));
+		assert(num >= 0 && num < iterations && num % 5 != 0);
+		snprintf(k, sizeof(k), "crazy hash%i", num);
+		assert(klen == strlen(k) && memcmp(key, k, klen) == 0);
+		assert(!found[num]);
+		found[num] = 1;
+		seen++;
+	}
+	assert((size_t)seen == dict->bucket_count);
+
+	assert(sparse_dict_free(dict));
+	free(found);
+	return 1;
+}
+
+int test_dict_incremental_rehash() {
+	struct sparse_dict *dict = NULL;
+	size_t old_bucket_max = 0, migrate_group = 0, sets_migrating = 0, migrations = 0;
+	int i = 0;
+	const int iterations = 600000;
+
+	dict = sparse_dict_init();
+	assert(dict);
+	assert(sparse_dict_incremental_rehash(dict, 1));
+
+	/* Nothing here is timed. What keeps inserts quick is that each one moves
+	 * at most REHASH_GROUPS_PER_SET groups, and that a migration is always
+	 * done by the time the table next needs to grow, so the growing insert
+	 * never has to finish one off.
+	 */
+	for (i = 0; i < iterations; i++) {
+		char key[64] = {0};
+		const int was_migrating = dict->old_buckets != NULL;
+		snprintf(key, sizeof(key), "crazy hash%i", i);
+
+		assert(sparse_dict_set(dict, key, strlen(key), &i, sizeof(i)));
+		if (dict->old_buckets == NULL)
+			continue;
+
+		if (!was_migrating || dict->old_bucket_max != old_bucket_max) {
+			/* A new migration, so the last one has to have drained by itself. */
+			assert(!was_migrating);
+			assert(dict->migrate_group <= REHASH_GROUPS_PER_SET);
+			old_bucket_max = dict->old_bucket_max;
+			sets_migrating = 0;
+			migrations++;
+		} else {
+			assert(dict->migrate_group - migrate_group <= REHASH_GROUPS_PER_SET);
+		}
+		migrate_group = dict->migrate_group;
+		sets_migrating++;
+		assert(sets_migrating <= old_bucket_max / GROUP_SIZE / REHASH_GROUPS_PER_SET + 1);
+	}
+	assert(migrations > 10);
+
+	/* The last growth happens at ~420k keys, so by now we've either finished
+	 * moving or are partway through. Everything has to be findable either way.
+	 */
+	assert(dict->bucket_count == (size_t)iterations);
+	for (i = 0; i < iterations; i++) {
+		char key[64] = {0};
+		size_t outsize = 0;
+		const int *retrieved = NULL;
+		snprintf(key, sizeof(key), "crazy hash%i", i);
+
+		retrieved = sparse_dict_get(dict, key, strlen(key), &outsize);
+		assert(retrieved);
+		assert(outsize == sizeof(i));
+		assert(*retrieved == i);
+	}
+
+	assert(sparse_dict_free(dict));
+	return 1;
+}
+
+struct sharded_writer {
+	struct sparse_sharded_dict *dict;
+	int thread_num;
+	int ok;
+};
+
+#define SHARDED_PER_THREAD 20000
+
+static void *sharded_writer_run(void *arg) {
+	struct sharded_writer *writer = arg;
+	char key[32] = {0};
+	int i = 0;
+	int got = 0;
+	size_t got_size = 0;
+
+	writer->ok = 0;
+	for (i = 0; i < SHARDED_PER_THREAD; i++) {
+		const int val = writer->thread_num * SHARDED_PER_THREAD + i;
+		snprintf(key, sizeof(key), "%i-%i", writer->thread_num, i);
+		if (!sparse_sharded_dict_set(writer->dict, key, strlen(key), &val, sizeof(val)))
+			return NULL;
+	}
+	for (i = 0; i < SHARDED_PER_THREAD; i++) {
+		snprintf(key, sizeof(key), "%i-%i", writer->thread_num, i);
+		if (!sparse_sharded_dict_get(writer->dict, key, strlen(key), &got, sizeof(got), &got_size))
+			return NULL;
+		if (got_size != sizeof(int) || got != writer->thread_num * SHARDED_PER_THREAD + i)
+			return NULL;
+	}
+	writer->ok = 1;
+	return NULL;
+}
+
+int test_sharded_dict() {
+	struct sparse_sharded_dict *dict = NULL;
+	struct sharded_writer writers[4];
+	pthread_t threads[4];
+	const char spilled[] = "long enough that it doesn't fit in the bucket at all";
+	char buf[64] = {0};
+	size_t outsize = 0;
+	int i = 0;
+
+	dict = sparse_sharded_dict_init(6);
+	assert(dict);
+	assert(dict->shard_count == 8);
+
+	assert(sparse_sharded_dict_set(dict, "key", strlen("key"), spilled, sizeof(spilled)));
+	assert(!sparse_sharded_dict_get(dict, "nope", strlen("nope"), buf, sizeof(buf), NULL));
+	/* Too small a buffer gets what fits, and the real size. */
+	assert(sparse_sharded_dict_get(dict, "key", strlen("key"), buf, 4, &outsize));
+	assert(outsize == sizeof(spilled));
+	assert(memcmp(buf, spilled, 4) == 0);
+	assert(sparse_sharded_dict_get(dict, "key", strlen("key"), buf, sizeof(buf), &outsize));
+	assert(strcmp(buf, spilled) == 0);
+	assert(sparse_sharded_dict_delete(dict, "key", strlen("key")));
+	assert(!sparse_sharded_dict_delete(dict, "key", strlen("key")));
+	assert(sparse_sharded_dict_count(dict) == 0);
+
+	for (i = 0; i < 4; i++) {
+		writers[i].dict = dict;
+		writers[i].thread_num = i;
+		assert(pthread_create(&threads[i], NULL, sharded_writer_run, &writers[i]) == 0);
+	}
+	for (i = 0; i < 4; i++) {
+		assert(pthread_join(threads[i], NULL) == 0);
+		assert(writers[i].ok);
+	}
+	assert(sparse_sharded_dict_count(dict) == 4 * SHARDED_PER_THREAD);
+
+	/* And they should have spread out over all the shards. */
+	for (i = 0; i < (int)dict->shard_count; i++)
+		assert(dict->shards[i].dict->bucket_count > 0);
+
+	assert(sparse_sharded_dict_free(dict));
+	return 1;
+}
+
+#define STABLE_KEYS 2000
+
+struct concurrent_reader {
+	struct sparse_dict *dict;
+	int stop;
+	int lookups;
+	int failures;
+};
+
+static void *concurrent_reader_run(void *arg) {
+	struct concurrent_reader *cr = arg;
+	struct sparse_reader *reader = sparse_dict_reader_register(cr->dict);
+	char key[32] = {0};
+	unsigned int i = 0;
+	size_t outsize = 0;
+
+	if (reader == NULL) {
+		cr->failures++;
+		return NULL;
+	}
+	while (!__atomic_load_n(&cr->stop, __ATOMIC_ACQUIRE)) {
+		const unsigned int k = (i++ * 7919) % STABLE_KEYS;
+		const unsigned int *found = NULL;
+
+		snprintf(key, sizeof(key), "stable%u", k);
+		sparse_dict_read_begin(reader);
+		found = sparse_dict_get(cr->dict, key, strlen(key), &outsize);
+		if (found == NULL || outsize != sizeof(unsigned int) || *found != k)
+			cr->failures++;
+		sparse_dict_read_end(reader);
+		cr->lookups++;
+	}
+	sparse_dict_reader_unregister(reader);
+	return NULL;
+}
+
+int test_dict_concurrent_readers() {
+	struct sparse_dict *dict = NULL;
+	struct concurrent_reader readers[2];
+	pthread_t threads[2];
+	struct sparse_reader *extra = NULL;
+	char key[32] = {0};
+	const char spilled[] = "a value that's far too long to be stored inline";
+	unsigned int i = 0;
+	int round = 0;
+
+	dict = sparse_dict_init();
+	assert(dict);
+	for (i = 0; i < STABLE_KEYS; i++) {
+		snprintf(key, sizeof(key), "stable%u", i);
+		assert(sparse_dict_set(dict, key, strlen(key), &i, sizeof(i)));
+	}
+	assert(sparse_dict_concurrent_readers(dict, 1));
+	assert(!sparse_dict_incremental_rehash(dict, 1));
+
+	for (i = 0; i < 2; i++) {
+		readers[i].dict = dict;
+		readers[i].stop = 0;
+		readers[i].lookups = 0;
+		readers[i].failures = 0;
+		assert(pthread_create(&threads[i], NULL, concurrent_reader_run, &readers[i]) == 0);
+	}
+
+	/* Grow the table a few times over, overwrite everything with something
+	 * that has to be retired, then delete it all so the table shrinks again.
+	 * The readers should see every stable key the whole time.
+	 */
+	for (round = 0; round < 2; round++) {
+		for (i = 0; i < 20000; i++) {
+			snprintf(key, sizeof(key), "churn%u", i);
+			assert(sparse_dict_set(dict, key, strlen(key), &i, sizeof(i)));
+		}
+		for (i = 0; i < 20000; i++) {
+			snprintf(key, sizeof(key), "churn%u", i);
+			assert(sparse_dict_set(dict, key, strlen(key), spilled, sizeof(spilled)));
+		}
+		for (i = 0; i < 20000; i++) {
+			snprintf(key, sizeof(key), "churn%u", i);
+			assert(sparse_dict_delete(dict, key, strlen(key)));
+		}
+	}
+
+	/* Can't stop while somebody's still registered. */
+	extra = sparse_dict_reader_register(dict);
+	assert(extra);
+	for (i = 0; i < 2; i++) {
+		__atomic_store_n(&readers[i].stop, 1, __ATOMIC_RELEASE);
+		assert(pthread_join(threads[i], NULL) == 0);
+		assert(readers[i].lookups > 0);
+		assert(readers[i].failures == 0);
+	}
+	assert(!sparse_dict_concurrent_readers(dict, 0));
+	sparse_dict_reader_unregister(extra);
+	assert(sparse_dict_concurrent_readers(dict, 0));
+
+	assert(dict->bucket_count == STABLE_KEYS);
+	for (i = 0; i < STABLE_KEYS; i++) {
+		const unsigned int *found = NULL;
+		snprintf(key, sizeof(key), "stable%u", i);
+		found = sparse_dict_get(dict, key, strlen(key), NULL);
+		assert(found && *found == i);
+	}
+
+	assert(sparse_dict_free(dict));
+	return 1;
+}
+
+#define IMAGE_PATH "sparsehash_test.img"
+
+int test_dict_save_and_mmap() {
+	struct sparse_dict *dict = NULL, *mapped = NULL;
+	struct sparse_dict_iter iter;
+	char key[32] = {0};
+	const char spilled[] = "a value that's far too long to be stored inline";
+	const void *value = NULL;
+	size_t outsize = 0, seen = 0;
+	unsigned char byte = 0;
+	unsigned int i = 0;
+	int fd = -1;
+
+	/* Some inline, some spilled, and some deleted so there are tombstones
+	 * to probe past.
+	 */
+	dict = sparse_dict_init();
+	assert(dict);
+	for (i = 0; i < 2000; i++) {
+		snprintf(key, sizeof(key), "key%u", i);
+		if (i % 3 == 0) {
+			assert(sparse_dict_set(dict, key, strlen(key), spilled, sizeof(spilled)));
+		} else {
+			assert(sparse_dict_set(dict, key, strlen(key), &i, sizeof(i)));
+		}
+	}
+	for (i = 0; i < 2000; i += 7) {
+		snprintf(key, sizeof(key), "key%u", i);
+		assert(sparse_dict_delete(dict, key, strlen(key)));
+	}
+
+	fd = open(IMAGE_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	assert(fd >= 0);
+	assert(sparse_dict_save(dict, fd));
+	close(fd);
+
+	mapped = sparse_dict_open_mmap(IMAGE_PATH, SPARSE_MMAP_VERIFY);
+	assert(mapped);
+	assert(mapped->bucket_count == dict->bucket_count);
+	for (i = 0; i < 2000; i++) {
+		snprintf(key, sizeof(key), "key%u", i);
+		value = sparse_dict_get(mapped, key, strlen(key), &outsize);
+		if (i % 7 == 0) {
+			assert(value == NULL);
+		} else if (i % 3 == 0) {
+			assert(value != NULL);
+			assert(outsize == sizeof(spilled));
+			assert(memcmp(value, spilled, sizeof(spilled)) == 0);
+		} else {
+			assert(value != NULL);
+			assert(outsize == sizeof(i));
+			assert(*(const unsigned int *)value == i);
+		}
+	}
+	assert(sparse_dict_get(mapped, "nope", strlen("nope"), NULL) == NULL);
+	sparse_dict_iter_init(&iter, mapped);
+	while (sparse_dict_iter_next(&iter, NULL, NULL, NULL, NULL))
+		seen++;
+	assert(seen == dict->bucket_count);
+
+	/* Read-only unless we asked otherwise. */
+	assert(!sparse_dict_set(mapped, "new", strlen("new"), &i, sizeof(i)));
+	assert(!sparse_dict_delete(mapped, "key1", strlen("key1")));
+	assert(sparse_dict_free(mapped));
+
+	mapped = sparse_dict_open_mmap(IMAGE_PATH, SPARSE_MMAP_COPY_ON_WRITE);
+	assert(mapped);
+	assert(sparse_dict_set(mapped, "new", strlen("new"), &i, sizeof(i)));
+	assert(sparse_dict_delete(mapped, "key1", strlen("key1")));
+	assert(mapped->bucket_count == dict->bucket_count);
+	assert(sparse_dict_get(mapped, "new", strlen("new"), NULL) != NULL);
+	value = sparse_dict_get(mapped, "key3", strlen("key3"), &outsize);
+	assert(value != NULL);
+	assert(memcmp(value, spilled, sizeof(spilled)) == 0);
+	assert(sparse_dict_free(mapped));
+
+	/* Flip a byte of somebody's value. Only a full check notices. */
+	fd = open(IMAGE_PATH, O_RDWR);
+	assert(fd >= 0);
+	assert(lseek(fd, -16, SEEK_END) >= 0);
+	assert(read(fd, &byte, 1) == 1);
+	byte ^= 0xff;
+	assert(lseek(fd, -16, SEEK_END) >= 0);
+	assert(write(fd, &byte, 1) == 1);
+	close(fd);
+	assert(sparse_dict_open_mmap(IMAGE_PATH, SPARSE_MMAP_VERIFY) == NULL);
+	mapped = sparse_dict_open_mmap(IMAGE_PATH, 0);
+	assert(mapped);
+	assert(sparse_dict_free(mapped));
+
+	/* Anything wrong with the header is always noticed. */
+	fd = open(IMAGE_PATH, O_RDWR);
+	assert(fd >= 0);
+	assert(write(fd, "X", 1) == 1);
+	close(fd);
+	assert(sparse_dict_open_mmap(IMAGE_PATH, 0) == NULL);
+
+	unlink(IMAGE_PATH);
+	assert(sparse_dict_free(dict));
+	return 1;
+}
+
+int test_dict_dump_and_load_stream() {
+	struct sparse_dict *dict = NULL, *loaded = NULL;
+	struct sparse_dict_iter iter;
+	FILE *stream = NULL;
+	char key[32] = {0};
+	const char spilled[] = "a value that's far too long to be stored inline";
+	const char *k = NULL;
+	const void *value = NULL, *copy = NULL;
+	size_t klen = 0, vlen = 0, outsize = 0;
+	long len = 0;
+	unsigned int i = 0;
+
+	dict = sparse_dict_init();
+	assert(dict);
+	for (i = 0; i < 5000; i++) {
+		snprintf(key, sizeof(key), "key%u", i);
+		if (i % 3 == 0) {
+			assert(sparse_dict_set(dict, key, strlen(key), spilled, sizeof(spilled)));
+		} else {
+			assert(sparse_dict_set(dict, key, strlen(key), &i, sizeof(i)));
+		}
+	}
+	assert(sparse_dict_set(dict, "", 0, "", 0));
+
+	stream = tmpfile();
+	assert(stream);
+	assert(sparse_dict_dump_stream(dict, stream));
+	len = ftell(stream);
+	rewind(stream);
+
+	/* Loading into a dictionary with a different hash is fine, everything
+	 * gets rehashed anyway.
+	 */
+	loaded = sparse_dict_init_with_hash(sparse_hash_fnv1a);
+	assert(loaded);
+	assert(sparse_dict_load_stream(loaded, stream));
+	assert(loaded->bucket_count == dict->bucket_count);
+	sparse_dict_iter_init(&iter, dict);
+	while (sparse_dict_iter_next(&iter, &k, &klen, &value, &vlen)) {
+		copy = sparse_dict_get(loaded, k, klen, &outsize);
+		assert(copy != NULL);
+		assert(outsize == vlen);
+		assert(memcmp(copy, value, vlen) == 0);
+	}
+	assert(sparse_dict_free(loaded));
+
+	/* A stream that stops short fails. */
+	rewind(stream);
+	assert(ftruncate(fileno(stream), len - 1) == 0);
+	loaded = sparse_dict_init();
+	assert(loaded);
+	assert(!sparse_dict_load_stream(loaded, stream));
+	assert(sparse_dict_free(loaded));
+
+	/* So does one that claims over a hundred million entries and has none,
+	 * without making room for them all first.
+	 */
+	rewind(stream);
+	assert(ftruncate(fileno(stream), 0) == 0);
+	assert(fwrite("SPARSEDS\x01\0\0\0\0\0\0\0\0\0\0\x08\0\0\0\0", 24, 1, stream) == 1);
+	rewind(stream);
+	loaded = sparse_dict_init();
+	assert(loaded);
+	assert(!sparse_dict_load_stream(loaded, stream));
+	assert(loaded->bucket_max <= (size_t)1 << 22);
+	assert(sparse_dict_free(loaded));
+
+	fclose(stream);
+	assert(sparse_dict_free(dict));
+	return 1;
+}
+
+/* Counts what's outstanding, and nothing else. */
+static long outstanding_allocations = 0;
+
+static void *test_malloc(size_t size) {
+	outstanding_allocations++;
+	return malloc(size);
+}
+
+static void *test_realloc(void *ptr, size_t size) {
+	if (ptr == NULL)
+		outstanding_allocations++;
+	return realloc(ptr, size);
+}
+
+static void test_free(void *ptr) {
+	if (ptr != NULL)
+		outstanding_allocations--;
+	free(ptr);
+}
+
+static int test_memalign(void **ptr, size_t alignment, size_t size) {
+	outstanding_allocations++;
+	return posix_memalign(ptr, alignment, size);
+}
+
+int test_custom_allocator() {
+	const struct sparse_allocator allocator = {test_malloc, test_realloc, test_free, test_memalign};
+	struct sparse_dict *dict = NULL;
+	char key[32] = {0};
+	const char spilled[] = "a value that's far too long to be stored inline";
+	unsigned int i = 0;
+
+	sparse_set_allocator(&allocator);
+	dict = sparse_dict_init();
+	assert(dict);
+	for (i = 0; i < 10000; i++) {
+		snprintf(key, sizeof(key), "key%u", i);
+		assert(sparse_dict_set(dict, key, strlen(key), spilled, sizeof(spilled)));
+	}
+	for (i = 0; i < 10000; i += 2) {
+		snprintf(key, sizeof(key), "key%u", i);
+		assert(sparse_dict_delete(dict, key, strlen(key)));
+	}
+	assert(outstanding_allocations > 0);
+	assert(sparse_dict_free(dict));
+	sparse_set_allocator(NULL);
+
+	assert(outstanding_allocations == 0);
+	return 1;
+}
+
+int test_dict_stats() {
+	struct sparse_dict *dict = NULL;
+	struct sparse_dict_stats stats;
+	char key[32] = {0};
+	const char spilled[] = "a value that's far too long to be stored inline";
+	size_t i = 0, groups = 0, slots = 0, displaced = 0, blobs = 0;
+
+	dict = sparse_dict_init();
+	assert(dict);
+	for (i = 0; i < 10000; i++) {
+		snprintf(key, sizeof(key), "key%zu", i);
+		if (i % 4 == 0) {
+			assert(sparse_dict_set(dict, key, strlen(key), spilled, sizeof(spilled)));
+			blobs += strlen(key) + sizeof(spilled);
+		} else {
+			assert(sparse_dict_set(dict, key, strlen(key), &i, sizeof(i)));
+		}
+	}
+	for (i = 1; i < 10000; i += 4) {
+		snprintf(key, sizeof(key), "key%zu", i);
+		assert(sparse_dict_delete(dict, key, strlen(key)));
+		assert(sparse_dict_get(dict, key, strlen(key), NULL) == NULL);
+	}
+
+	assert(sparse_dict_stats(dict, &stats));
+	assert(stats.bucket_count == 7500);
+	assert(stats.bucket_max == dict->bucket_max);
+	assert(stats.tombstone_count == dict->tombstone_count);
+	assert(stats.load_factor > 0.0 && stats.load_factor < RESIZE_PERCENT / 100.0);
+	assert(stats.rehashes > 0);
+	assert(stats.blob_bytes == blobs);
+	assert(stats.bucket_bytes == (stats.bucket_count + stats.tombstone_count) * sizeof(struct sparse_bucket));
+	assert(stats.storage_bytes >= stats.bucket_bytes);
+
+	/* Every group is counted once, and so is everything in them. */
+	for (i = 0; i <= GROUP_SIZE; i++) {
+		groups += stats.group_fill[i];
+		slots += i * stats.group_fill[i];
+	}
+	assert(groups == (dict->bucket_max - 1) / GROUP_SIZE + 1);
+	assert(slots == stats.bucket_count + stats.tombstone_count);
+	for (i = 0; i < SPARSE_PROBE_HISTOGRAM_SIZE; i++)
+		displaced += stats.displacement[i];
+	assert(displaced == stats.bucket_count);
+
+#ifdef SPARSE_DICT_STATS
+	/* 10000 sets, 2500 gets. */
+	assert(stats.lookups == 12500);
+#else
+	assert(stats.lookups == 0);
+#endif
+
+	assert(sparse_dict_free(dict));
+	return 1;
+}
+
+int test_dict_probing() {
+	const int strategies[] = { SPARSE_PROBE_QUADRATIC, SPARSE_PROBE_LINEAR, SPARSE_PROBE_ROBIN_HOOD };
+	struct sparse_dict *dict = NULL, *mapped = NULL;
+	struct sparse_dict_stats stats;
+	struct sparse_dict_iter iter;
+	char key[32] = {0};
+	const char spilled[] = "a value that's far too long to be stored inline";
+	const void *value = NULL;
+	size_t i = 0, s = 0, seen = 0, outsize = 0;
+	int fd = -1;
+
+	dict = sparse_dict_init();
+	assert(dict);
+	assert(!sparse_dict_probing(dict, SPARSE_PROBE_ROBIN_HOOD + 1, 0));
+	assert(!sparse_dict_probing(dict, SPARSE_PROBE_LINEAR, SPARSE_MAX_RESIZE_PERCENT + 1));
+	if (sparse_dict_concurrent_readers(dict, 1)) {
+		assert(!sparse_dict_probing(dict, SPARSE_PROBE_ROBIN_HOOD, 0));
+		assert(sparse_dict_concurrent_readers(dict, 0));
+	}
+	assert(sparse_dict_probing(dict, SPARSE_PROBE_ROBIN_HOOD, 0));
+	assert(!sparse_dict_concurrent_readers(dict, 1));
+	assert(sparse_dict_free(dict));
+
+	for (s = 0; s < sizeof(strategies) / sizeof(strategies[0]); s++) {
+		/* Switching over with things already in there moves them. */
+		dict = sparse_dict_init();
+		assert(dict);
+		for (i = 0; i < 100; i++) {
+			snprintf(key, sizeof(key), "key%zu", i);
+			assert(sparse_dict_set(dict, key, strlen(key), &i, sizeof(i)));
+		}
+		assert(sparse_dict_probing(dict, strategies[s], 90));
+		assert(dict->probing == strategies[s]);
+
+		for (i = 100; i < 20000; i++) {
+			snprintf(key, sizeof(key), "key%zu", i);
+			if (i % 5 == 0) {
+				assert(sparse_dict_set(dict, key, strlen(key), spilled, sizeof(spilled)));
+			} else {
+				assert(sparse_dict_set(dict, key, strlen(key), &i, sizeof(i)));
+			}
+		}
+		for (i = 1; i < 20000; i += 3) {
+			snprintf(key, sizeof(key), "key%zu", i);
+			assert(sparse_dict_delete(dict, key, strlen(key)));
+			assert(!sparse_dict_delete(dict, key, strlen(key)));
+		}
+		if (strategies[s] == SPARSE_PROBE_ROBIN_HOOD)
+			assert(dict->tombstone_count == 0);
+
+		for (i = 0; i < 20000; i++) {
+			snprintf(key, sizeof(key), "key%zu", i);
+			value = sparse_dict_get(dict, key, strlen(key), &outsize);
+			if (i % 3 == 1) {
+				assert(value == NULL);
+			} else if (i >= 100 && i % 5 == 0) {
+				assert(value != NULL);
+				assert(memcmp(value, spilled, sizeof(spilled)) == 0);
+			} else {
+				assert(value != NULL);
+				assert(*(const size_t *)value == i);
+			}
+		}
+		seen = 0;
+		sparse_dict_iter_init(&iter, dict);
+		while (sparse_dict_iter_next(&iter, NULL, NULL, NULL, NULL))
+			seen++;
+		assert(seen == dict->bucket_count);
+
+		/* Nothing can be further along than the furthest anything was put. */
+		assert(sparse_dict_stats(dict, &stats));
+		for (i = stats.max_probe + 1; i < SPARSE_PROBE_HISTOGRAM_SIZE; i++)
+			assert(stats.displacement[i] == 0);
+
+		/* Images remember how they were probed. */
+		fd = open(IMAGE_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		assert(fd >= 0);
+		assert(sparse_dict_save(dict, fd));
+		close(fd);
+		mapped = sparse_dict_open_mmap(IMAGE_PATH, SPARSE_MMAP_COPY_ON_WRITE);
+		assert(mapped);
+		for (i = 0; i < 20000; i += 7) {
+			snprintf(key, sizeof(key), "key%zu", i);
+			assert((sparse_dict_get(mapped, key, strlen(key), NULL) == NULL) == (i % 3 == 1));
+		}
+		assert(sparse_dict_delete(mapped, "key0", strlen("key0")));
+		assert(mapped->buckets->probing == strategies[s]);
+		assert(sparse_dict_get(mapped, "key3", strlen("key3"), NULL) != NULL);
+		assert(sparse_dict_free(mapped));
+
+		assert(sparse_dict_free(dict));
+	}
+	unlink(IMAGE_PATH);
+
+	/* Robin Hood tables keep their order through parallel resizes too: every
+	 * bucket is at most one further from home than the one before it.
+	 */
+	dict = sparse_dict_init();
+	assert(dict);
+	assert(sparse_dict_probing(dict, SPARSE_PROBE_ROBIN_HOOD, 90));
+	assert(sparse_dict_parallel_rehash(dict, 4));
+	for (i = 0; i < PARALLEL_REHASH_MIN * 2; i++) {
+		snprintf(key, sizeof(key), "key%zu", i);
+		assert(sparse_dict_set(dict, key, strlen(key), &i, sizeof(i)));
+	}
+	seen = 0;
+	for (i = 0; i < dict->bucket_max; i++) {
+		const struct sparse_bucket *bucket = sparse_array_get(dict->buckets, i, NULL);
+		const struct sparse_bucket *before = sparse_array_get(dict->buckets, (i - 1) & (dict->bucket_max - 1), NULL);
+		size_t displacement = 0;
+		if (bucket == NULL)
+			continue;
+		displacement = (i - bucket->hash) & (dict->bucket_max - 1);
+		assert(displacement == 0 || before != NULL);
+		assert(before == NULL ||
+			   displacement <= ((i - 1 - before->hash) & (dict->bucket_max - 1)) + 1);
+		seen++;
+	}
+	assert(seen == dict->bucket_count);
+	assert(sparse_dict_free(dict));
+
+	return 1;
+}
+
+int test_cache() {
+	struct sparse_cache *cache = NULL;
+	char key[32] = {0};
+	char huge[4096] = {0};
+	const char spilled[] = "a value that's far too long to be stored inline";
+	const void *value = NULL;
+	size_t outsize = 0;
+	unsigned int i = 0;
+
+	cache = sparse_cache_init(64 * 1024);
+	assert(cache);
+
+	/* Way more than fits. "hot" gets looked at all the way through, so it
+	 * should never be the one that goes.
+	 */
+	assert(sparse_cache_set(cache, "hot", strlen("hot"), &i, sizeof(i)));
+	for (i = 0; i < 20000; i++) {
+		snprintf(key, sizeof(key), "key%u", i);
+		if (i % 2 == 0) {
+			assert(sparse_cache_set(cache, key, strlen(key), spilled, sizeof(spilled)));
+		} else {
+			assert(sparse_cache_set(cache, key, strlen(key), &i, sizeof(i)));
+		}
+		assert(sparse_cache_bytes(cache) <= 64 * 1024);
+		assert(sparse_cache_get(cache, "hot", strlen("hot"), NULL) != NULL);
+	}
+	assert(cache->evictions > 0);
+	assert(cache->dict->bucket_count < 20000);
+	assert(cache->dict->bucket_count + cache->evictions == 20001);
+
+	/* The most recent ones are still there. */
+	value = sparse_cache_get(cache, "key19999", strlen("key19999"), &outsize);
+	assert(value != NULL);
+	assert(outsize == sizeof(i));
+	assert(sparse_cache_get(cache, "key0", strlen("key0"), NULL) == NULL);
+
+	assert(sparse_cache_delete(cache, "key19999", strlen("key19999")));
+	assert(!sparse_cache_delete(cache, "key19999", strlen("key19999")));
+	assert(sparse_cache_free(cache));
+
+	/* Things bigger than the whole budget don't get to throw everything out. */
+	cache = sparse_cache_init(1024);
+	assert(cache);
+	assert(!sparse_cache_set(cache, "huge", strlen("huge"), huge, sizeof(huge)));
+	assert(sparse_cache_get(cache, "huge", strlen("huge"), NULL) == NULL);
+	assert(sparse_cache_free(cache));
+	return 1;
+}
+
+int test_u64_dict() {
+	struct sparse_u64_dict *dict = NULL;
+	struct sparse_u64_dict_iter iter;
+	const char spilled[] = "a value that's far too long to be stored inline";
+	const void *value = NULL;
+	size_t outsize = 0, seen = 0;
+	uint64_t i = 0, key = 0;
+
+	dict = sparse_u64_dict_init();
+	assert(dict);
+
+	/* 0 and all ones are keys like any other. */
+	for (i = 0; i < 20000; i++) {
+		key = i * 0x9e3779b97f4a7c15ULL;
+		if (i % 10 == 0) {
+			assert(sparse_u64_dict_set(dict, key, spilled, sizeof(spilled)));
+		} else {
+			assert(sparse_u64_dict_set(dict, key, &i, sizeof(i)));
+		}
+	}
+	assert(sparse_u64_dict_set(dict, UINT64_MAX, &i, sizeof(i)));
+	assert(dict->bucket_count == 20001);
+
+	for (i = 0; i < 20000; i++) {
+		value = sparse_u64_dict_get(dict, i * 0x9e3779b97f4a7c15ULL, &outsize);
+		assert(value != NULL);
+		if (i % 10 == 0) {
+			assert(outsize == sizeof(spilled));
+			assert(memcmp(value, spilled, sizeof(spilled)) == 0);
+		} else {
+			assert(outsize == sizeof(i));
+			assert(memcmp(value, &i, sizeof(i)) == 0);
+		}
+	}
+	assert(sparse_u64_dict_get(dict, 1, NULL) == NULL);
+
+	/* Overwriting swaps between inline and spilled both ways. */
+	assert(sparse_u64_dict_set(dict, UINT64_MAX, spilled, sizeof(spilled)));
+	assert(sparse_u64_dict_set(dict, 0, &i, sizeof(i)));
+	value = sparse_u64_dict_get(dict, UINT64_MAX, &outsize);
+	assert(value != NULL && outsize == sizeof(spilled));
+	value = sparse_u64_dict_get(dict, 0, &outsize);
+	assert(value != NULL && outsize == sizeof(i));
+	assert(dict->bucket_count == 20001);
+
+	/* Deleting most of it shrinks it, and what's left is still there. */
+	for (i = 0; i < 19000; i++)
+		assert(sparse_u64_dict_delete(dict, i * 0x9e3779b97f4a7c15ULL));
+	assert(!sparse_u64_dict_delete(dict, 0));
+	assert(dict->bucket_count == 1001);
+	assert(dict->bucket_max < 32768);
+	for (i = 19000; i < 20000; i++)
+		assert(sparse_u64_dict_get(dict, i * 0x9e3779b97f4a7c15ULL, NULL) != NULL);
+
+	sparse_u64_dict_iter_init(&iter, dict);
+	while (sparse_u64_dict_iter_next(&iter, &key, &value, &outsize)) {
+		assert(sparse_u64_dict_get(dict, key, NULL) == value);
+		seen++;
+	}
+	assert(seen == 1001);
+
+	assert(sparse_u64_dict_free(dict));
+	return 1;
+}
+
+/* A dictionary of uint32_t to double, for test_defined_dict. */
+static uint64_t hash_u32(const uint32_t key) {
+	return sparse_hash_u64(key, 0x5eed);
+}
+#define U32_EQUAL(a, b) ((a) == (b))
+SPARSE_DICT_DEFINE(u32_doubles, uint32_t, double, hash_u32, U32_EQUAL)
+
+int test_defined_dict() {
+	struct u32_doubles *dict = NULL;
+	struct u32_doubles_iter iter;
+	uint32_t *key = NULL;
+	double *value = NULL;
+	uint32_t i = 0;
+	size_t seen = 0;
+
+	dict = u32_doubles_init();
+	assert(dict);
+
+	for (i = 0; i < 10000; i++)
+		assert(u32_doubles_set(dict, i * 7, i / 2.0));
+	assert(dict->bucket_count == 10000);
+	for (i = 0; i < 10000; i++) {
+		value = u32_doubles_get(dict, i * 7);
+		assert(value != NULL);
+		assert(*value == i / 2.0);
+	}
+	assert(u32_doubles_get(dict, 1) == NULL);
+
+	/* Overwrites don't add anything. */
+	assert(u32_doubles_set(dict, 0, -1.0));
+	assert(*u32_doubles_get(dict, 0) == -1.0);
+	assert(dict->bucket_count == 10000);
+
+	/* Neither does deleting and putting something back. */
+	assert(u32_doubles_delete(dict, 7));
+	assert(!u32_doubles_delete(dict, 7));
+	assert(u32_doubles_get(dict, 7) == NULL);
+	assert(u32_doubles_set(dict, 7, 7.0));
+	assert(*u32_doubles_get(dict, 7) == 7.0);
+	assert(dict->bucket_count == 10000);
+
+	for (i = 0; i < 9000; i++)
+		assert(u32_doubles_delete(dict, i * 7));
+	assert(dict->bucket_count == 1000);
+	assert(dict->bucket_max < 16384);
+
+	u32_doubles_iter_init(&iter, dict);
+	while (u32_doubles_iter_next(&iter, &key, &value)) {
+		assert(*key % 7 == 0 && *key >= 9000 * 7);
+		assert(*value == (*key / 7) / 2.0);
+		seen++;
+	}
+	assert(seen == 1000);
+
+	u32_doubles_free(dict);
+	return 1;
+}
+
+int test_dense_dict() {
+	struct dense_dict *dict = NULL;
+	struct dense_dict_iter iter;
+	const char spilled[] = "a value that's far too long to be stored inline, even in a dense bucket";
+	const char *key = NULL;
+	const void *value = NULL;
+	char buf[32] = {0};
+	size_t klen = 0, outsize = 0, seen = 0;
+	unsigned int i = 0;
+
+	dict = dense_dict_init();
+	assert(dict);
+	assert(((uintptr_t)dict->buckets % CACHE_LINE_SIZE) == 0);
+	assert(!dense_dict_set_resize_policy(dict, 100, 0));
+	assert(!dense_dict_set_resize_policy(dict, 60, 30));
+	assert(dense_dict_set_resize_policy(dict, 70, 10));
+
+	for (i = 0; i < 10000; i++) {
+		snprintf(buf, sizeof(buf), "key%u", i);
+		if (i % 10 == 0) {
+			assert(dense_dict_set(dict, buf, strlen(buf), spilled, sizeof(spilled)));
+		} else {
+			assert(dense_dict_set(dict, buf, strlen(buf), &i, sizeof(i)));
+		}
+	}
+	assert(dict->bucket_count == 10000);
+	/* 10000 is between 35% and 70% of 16384. */
+	assert(dict->bucket_max == 16384);
+
+	for (i = 0; i < 10000; i++) {
+		snprintf(buf, sizeof(buf), "key%u", i);
+		value = dense_dict_get(dict, buf, strlen(buf), &outsize);
+		assert(value != NULL);
+		if (i % 10 == 0) {
+			assert(outsize == sizeof(spilled));
+			assert(memcmp(value, spilled, sizeof(spilled)) == 0);
+		} else {
+			assert(outsize == sizeof(i));
+			assert(memcmp(value, &i, sizeof(i)) == 0);
+		}
+	}
+	assert(dense_dict_get(dict, "nope", strlen("nope"), NULL) == NULL);
+
+	/* Overwrites swap between inline and spilled. */
+	assert(dense_dict_set(dict, "key0", strlen("key0"), &i, sizeof(i)));
+	assert(dense_dict_set(dict, "key1", strlen("key1"), spilled, sizeof(spilled)));
+	assert(dict->bucket_count == 10000);
+	value = dense_dict_get(dict, "key1", strlen("key1"), &outsize);
+	assert(value != NULL && outsize == sizeof(spilled));
+
+	for (i = 0; i < 9500; i++) {
+		snprintf(buf, sizeof(buf), "key%u", i);
+		assert(dense_dict_delete(dict, buf, strlen(buf)));
+	}
+	assert(!dense_dict_delete(dict, "key0", strlen("key0")));
+	assert(dict->bucket_count == 500);
+	assert(dict->bucket_max < 16384);
+
+	dense_dict_iter_init(&iter, dict);
+	while (dense_dict_iter_next(&iter, &key, &klen, &value, &outsize)) {
+		assert(dense_dict_get(dict, key, klen, NULL) == value);
+		seen++;
+	}
+	assert(seen == 500);
+
+	assert(dense_dict_free(dict));
+	return 1;
+}
+
 int main(int argc, char *argv[]) {
 	(void)argc;
 	(void)argv;
@@ -268,9 +1922,38 @@ int main(int argc, char *argv[]) {
 	run_test(test_array_set_overwrites_old_values);
 	run_test(test_array_set_high_num);
 	run_test(test_array_get);
+	run_test(test_array_erase);
+	run_test(test_array_group_capacity);
+	run_test(test_array_fixed);
+	run_test(test_array_iterate);
 	run_test(test_dict_set);
 	run_test(test_dict_get);
+	run_test(test_dict_inline_and_spilled_values);
+	run_test(test_dict_long_keys);
+	run_test(test_dict_tags_follow_buckets);
+	run_test(test_dict_custom_hash);
+	run_test(test_dict_init_with_capacity);
+	run_test(test_dict_bulk_load);
+	run_test(test_dict_get_and_set_many);
+	run_test(test_dict_iterate);
 	run_test(test_dict_lots_of_set);
+	run_test(test_dict_incremental_rehash);
+	run_test(test_dict_parallel_rehash);
+	run_test(test_dict_upsert);
+	run_test(test_dict_hashed);
+	run_test(test_dict_delete);
+	run_test(test_dict_delete_while_migrating);
+	run_test(test_sharded_dict);
+	run_test(test_dict_concurrent_readers);
+	run_test(test_dict_save_and_mmap);
+	run_test(test_dict_dump_and_load_stream);
+	run_test(test_custom_allocator);
+	run_test(test_dict_stats);
+	run_test(test_dict_probing);
+	run_test(test_cache);
+	run_test(test_u64_dict);
+	run_test(test_defined_dict);
+	run_test(test_dense_dict);
 	finish_tests();
 
 	return 0;